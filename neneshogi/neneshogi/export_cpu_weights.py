@@ -0,0 +1,68 @@
+"""
+学習済みモデル(ResNetAZ)を、エンジンのCPUでの評価(DNN_CPUでビルドしたもの)が読み込む重みファイルにエクスポート
+BatchNormは直前の畳み込みに畳み込み、畳み込みの重みとバイアスとして書き出す。
+書き出したファイルはEvalDirに"model_cpu.bin"という名前で置く。
+
+形式(リトルエンディアン)
+"NCPU", int32 version=1, int32 in_ch, ch, depth, block_depth, move_dim, move_hidden
+以降float32で、各層の重み(PyTorchと同じ並び)・バイアスの順
+conv1, ResBlockAZの畳み込み(depth * block_depth個), p_conv1, p_fc2, v_conv1, v_fc2, v_fc3
+"""
+import argparse
+import struct
+
+import numpy as np
+import torch
+from neneshogi.model_loader import load_model
+from neneshogi.models.resnet import ResNetAZ
+
+FORMAT_VERSION = 1
+
+
+def fold_bn(conv, bn):
+    # BatchNorm(conv(x))をconv'(x) + biasの形にする(推論時のみ)
+    scale = bn.weight.detach() / torch.sqrt(bn.running_var + bn.eps)
+    weight = conv.weight.detach() * scale.view(-1, 1, 1, 1)
+    bias = bn.bias.detach() - bn.running_mean * scale
+    if conv.bias is not None:
+        bias = bias + conv.bias.detach() * scale
+    return weight, bias
+
+
+def write_tensor(f, tensor):
+    f.write(tensor.detach().cpu().numpy().astype(np.float32).tobytes())
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("checkpoint_dir")
+    parser.add_argument("dst")
+    args = parser.parse_args()
+    model = load_model(args.checkpoint_dir, "cpu")
+    if not isinstance(model, ResNetAZ):
+        raise ValueError("only ResNetAZ is supported")
+    block_depth = model.convs[0].count
+    with open(args.dst, "wb") as f:
+        f.write(b"NCPU")
+        f.write(struct.pack("<7i", FORMAT_VERSION, model.conv1.in_channels, model.conv1.out_channels, len(model.convs),
+                            block_depth, model.p_fc2.out_features, model.v_fc2.out_features))
+        for tensor in fold_bn(model.conv1, model.conv1_bn):
+            write_tensor(f, tensor)
+        for block in model.convs:
+            for i in range(block.count):
+                for tensor in fold_bn(block.layers[i * 2], block.layers[i * 2 + 1]):
+                    write_tensor(f, tensor)
+        for tensor in fold_bn(model.p_conv1, model.p_conv1_bn):
+            write_tensor(f, tensor)
+        write_tensor(f, model.p_fc2.weight)
+        write_tensor(f, model.p_fc2.bias)
+        for tensor in fold_bn(model.v_conv1, model.v_conv1_bn):
+            write_tensor(f, tensor)
+        write_tensor(f, model.v_fc2.weight)
+        write_tensor(f, model.v_fc2.bias)
+        write_tensor(f, model.v_fc3.weight)
+        write_tensor(f, model.v_fc3.bias)
+
+
+if __name__ == '__main__':
+    main()
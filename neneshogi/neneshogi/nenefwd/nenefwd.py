@@ -1,4 +1,4 @@
-# TCPによるプロセス間通信で、探索エンジンから呼ばれてpytorchモデルを実行する
+# TCPまたは共有メモリによるプロセス間通信で、探索エンジンから呼ばれてpytorchモデルを実行する
 
 r"""
 nenefwd.bat バッチファイル例
@@ -7,20 +7,124 @@ nenefwd.bat バッチファイル例
 call C:\Users\foo\Anaconda3\Scripts\activate.bat C:\Users\foo\Anaconda3\envs\neneshogi2020
 python -m neneshogi.nenefwd.nenefwd %*
 
+共有メモリ(Linuxのみ)の場合、エンジンは以下のように起動する。
+nenefwd <checkpoint_dir> <gpu_id> --shm /proc/<pid>/fd/<fd> [--shm-rows /proc/<pid>/fd/<fd>]
+入力がパック形式(エンジンのDNNPackedInputオプション)の場合、TCPでは--packed <ビットで表すチャンネル数>が付く。
+共有メモリではヘッダに書かれている。
 """
 import argparse
+import ctypes
+import mmap
+import os
+import platform
 import struct
 import socket
 
 import numpy as np
-import torch
-from neneshogi.model_loader import load_model
 
 BOARD_SHAPE = (119, 9, 9)
 BOARD_SIZE = 119 * 9 * 9
 MOVE_DIM = 27 * 9 * 9
 
 
+class PackedBoard:
+    """
+    パック形式(エンジンのdnn_converter.hのPackedBoardFormat)の入力を、float32の入力行列に展開する。
+    1局面分は、ビットで表すチャンネルが1チャンネル16バイト(81マス分のビット、リトルエンディアン)、
+    続けて全マス同じ値のチャンネルが1チャンネル1バイトで並び、64バイト単位に揃えてある。
+    """
+
+    def __init__(self, bit_planes):
+        self.bit_planes = bit_planes
+        self.sample_bytes = (bit_planes * 16 + (BOARD_SHAPE[0] - bit_planes) + 63) // 64 * 64
+        self.buf = np.zeros((0,) + BOARD_SHAPE, dtype=np.float32)
+
+    def unpack(self, packed):
+        """
+        packed: (batch_size, sample_bytes)のuint8配列。展開先の配列は次の呼び出しまで有効。
+        """
+        batch_size = len(packed)
+        if len(self.buf) < batch_size:
+            self.buf = np.zeros((batch_size,) + BOARD_SHAPE, dtype=np.float32)
+        out = self.buf[:batch_size].reshape((batch_size, BOARD_SHAPE[0], 81))
+        bp = self.bit_planes
+        planes = packed[:, :bp * 16].reshape((batch_size, bp, 16))
+        out[:, :bp] = np.unpackbits(planes, axis=2, count=81, bitorder="little")
+        out[:, bp:] = packed[:, bp * 16:bp * 16 + BOARD_SHAPE[0] - bp, np.newaxis]
+        return self.buf[:batch_size]
+
+
+class TorchModel:
+    """
+    pytorchモデルを実行し、出力を与えられた配列に書き込む
+    """
+
+    def __init__(self, checkpoint_dir, gpu_id):
+        import torch
+        from neneshogi.model_loader import load_model
+        self.torch = torch
+        self.device = torch.device(f"cuda:{gpu_id}" if gpu_id >= 0 else "cpu")
+        self.model = load_model(checkpoint_dir, self.device)
+        self.bit_shifts = torch.arange(8, dtype=torch.uint8, device=self.device)
+
+    def run(self, board_array, policy_out, value_out):
+        torch = self.torch
+        with torch.no_grad():
+            self._forward(torch.from_numpy(board_array).to(self.device), policy_out, value_out)
+
+    def run_packed(self, packed, packed_board, policy_out, value_out):
+        """
+        パック形式の入力をそのままデバイスへ転送してから展開する(転送量はfloatの入力行列の約1/35)
+        """
+        torch = self.torch
+        with torch.no_grad():
+            packed_t = torch.from_numpy(packed).to(self.device)
+            batch_size = packed_t.shape[0]
+            bp = packed_board.bit_planes
+            n_scalars = BOARD_SHAPE[0] - bp
+            planes = packed_t[:, :bp * 16].reshape((batch_size, bp, 16, 1))
+            bits = ((planes >> self.bit_shifts) & 1).reshape((batch_size, bp, 128))[:, :, :81]
+            scalars = packed_t[:, bp * 16:bp * 16 + n_scalars, None].expand((batch_size, n_scalars, 81))
+            board = torch.cat([bits, scalars], dim=1).float().reshape((batch_size,) + BOARD_SHAPE)
+            self._forward(board, policy_out, value_out)
+
+    def _forward(self, board, policy_out, value_out):
+        predicted = self.model(board)
+        # 出力先の配列(共有メモリ)に直接コピーする
+        self.torch.from_numpy(policy_out).copy_(predicted[0])
+        self.torch.from_numpy(value_out).copy_(predicted[1])
+
+
+class NullModel:
+    """
+    モデルを実行せず、入力を1回読んで0を返す(エンジンのuser dnnxferbenchで、受け渡しの速度を測るため)
+    """
+
+    def __init__(self):
+        self.scratch = np.zeros((0,) + BOARD_SHAPE, dtype=np.float32)
+
+    def run(self, board_array, policy_out, value_out):
+        # GPUへの転送の代わりに、入力を別の領域へコピーする
+        if len(self.scratch) < len(board_array):
+            self.scratch = np.zeros_like(board_array)
+        self.scratch[:len(board_array)] = board_array
+        policy_out[...] = 0
+        value_out[...] = 0
+
+    def run_packed(self, packed, packed_board, policy_out, value_out):
+        self.run(packed_board.unpack(packed), policy_out, value_out)
+
+
+def run_model(model, board_input, packed_board, policy_out, value_out):
+    """
+    board_inputは、packed_boardがNoneならfloat32の入力行列、そうでなければパック形式の(batch_size, sample_bytes)のuint8配列
+    """
+    if packed_board is not None:
+        model.run_packed(board_input, packed_board, policy_out, value_out)
+    else:
+        model.run(board_input, policy_out, value_out)
+
+
 def read_batch_size(sock):
     # バッチサイズを読み取る
     number_len = 4  # sizeof(int32)
@@ -35,27 +139,31 @@ def read_batch_size(sock):
     return struct.unpack("i", buf)[0]  # int32をパース
 
 
-def read_input_array(sock, batch_size):
+def read_input_array(sock, batch_size, packed_board):
     buf = b""
-    total_size = BOARD_SIZE * 4 * batch_size  # float32
+    if packed_board is not None:
+        total_size = packed_board.sample_bytes * batch_size
+    else:
+        total_size = BOARD_SIZE * 4 * batch_size  # float32
     while len(buf) < total_size:
         extbuf = sock.recv(min(4096, total_size - len(buf)))
         if len(extbuf) == 0:
             raise ValueError
         buf += extbuf
+    if packed_board is not None:
+        return np.frombuffer(buf, dtype=np.uint8).reshape((batch_size, packed_board.sample_bytes))
     return np.frombuffer(buf, dtype=np.float32).reshape((batch_size,) + BOARD_SHAPE)
 
 
-def request_loop(device, model, sock):
+def request_loop(model, sock, packed_board):
     while True:
         batch_size = read_batch_size(sock)
         if batch_size == 0:
             return
-        board_array = read_input_array(sock, batch_size)
-        with torch.no_grad():
-            predicted = model(torch.from_numpy(board_array).to(device))
-        policy_data = predicted[0].cpu().numpy()
-        value_data = predicted[1].cpu().numpy()
+        board_input = read_input_array(sock, batch_size, packed_board)
+        policy_data = np.empty((batch_size, MOVE_DIM), dtype=np.float32)
+        value_data = np.empty((batch_size, 2), dtype=np.float32)
+        run_model(model, board_input, packed_board, policy_data, value_data)
         send_data = struct.pack("i", batch_size)
         for i in range(batch_size):
             send_data += policy_data[i].tobytes()
@@ -63,18 +171,183 @@ def request_loop(device, model, sock):
         sock.sendall(send_data)
 
 
+# 共有メモリでの受け渡し(dnn_evaluator_external.cppのExternalShmEvaluator)。
+# チャンネルの先頭のヘッダ(DnnShmHeader)の各フィールドのバイト位置。エンジン側と合わせること。
+SHM_MAGIC = 0x4d53454e
+SHM_VERSION = 2
+H_MAGIC = 0
+H_VERSION = 4
+H_SAMPLE_SIZE = 8
+H_POLICY_SIZE = 12
+H_VALUE_SIZE = 16
+H_MAX_BATCH_SIZE = 20
+H_ENGINE_PID = 24
+H_PACKED_BIT_PLANES = 28
+H_STAGING_OFFSET = 32
+H_POLICY_OFFSET = 40
+H_VALUE_OFFSET = 48
+H_INPUT_BYTES = 56
+H_ATTACHED = 64
+H_REQUEST_SEQ = 128
+H_BATCH_SIZE = 132
+H_INPUT_IN_ROWS = 136
+H_INPUT_OFFSET = 144
+H_RESPONSE_SEQ = 192
+H_STATUS = 196
+H_SIZE = 256
+
+SYS_FUTEX = {"x86_64": 202, "aarch64": 98}.get(platform.machine(), 202)
+FUTEX_WAIT = 0
+FUTEX_WAKE = 1
+# エンジンが終了していないか確認する間隔[秒]
+WAIT_TIMEOUT_SEC = 1
+
+
+class Timespec(ctypes.Structure):
+    _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+
+class ShmChannel:
+    """
+    エンジンと共有するメモリ上で、入力を読み出して出力を書き込む。
+    入力・出力ともに共有メモリをそのままnumpy配列として参照するので、コピーしない。
+    通知はヘッダの通し番号とfutexで行う(numpyでの読み書きに順序の保証はないので、x86の順序保証を前提とする)。
+    """
+
+    def __init__(self, channel_path, rows_path):
+        self.libc = ctypes.CDLL(None, use_errno=True)
+        self.channel = self._map(channel_path)
+        self.header = np.frombuffer(self.channel, dtype=np.uint8, count=H_SIZE)
+        if self._u32(H_MAGIC) != SHM_MAGIC or self._u32(H_VERSION) != SHM_VERSION:
+            raise ValueError("shared memory version mismatch")
+        sample_size = self._u32(H_SAMPLE_SIZE)
+        policy_size = self._u32(H_POLICY_SIZE)
+        value_size = self._u32(H_VALUE_SIZE)
+        max_batch_size = self._u32(H_MAX_BATCH_SIZE)
+        if sample_size != BOARD_SIZE or policy_size != MOVE_DIM or value_size != 2:
+            raise ValueError("shared memory format mismatch")
+        self.engine_pid = self._u32(H_ENGINE_PID)
+        bit_planes = self._u32(H_PACKED_BIT_PLANES)
+        self.packed_board = PackedBoard(bit_planes) if bit_planes > 0 else None
+        self.input_bytes = self._u32(H_INPUT_BYTES)
+        expected_bytes = self.packed_board.sample_bytes if self.packed_board is not None else BOARD_SIZE * 4
+        if self.input_bytes != expected_bytes:
+            raise ValueError("shared memory input format mismatch")
+        # 入力は1局面input_bytesバイトの行として参照し、floatの入力行列ならその形に見直す
+        self.staging = self._input_view(self.channel, max_batch_size * self.input_bytes, self._u64(H_STAGING_OFFSET))
+        self.policy = np.frombuffer(self.channel, dtype=np.float32, count=max_batch_size * policy_size,
+                                    offset=self._u64(H_POLICY_OFFSET)).reshape((max_batch_size, policy_size))
+        self.value = np.frombuffer(self.channel, dtype=np.float32, count=max_batch_size * value_size,
+                                   offset=self._u64(H_VALUE_OFFSET)).reshape((max_batch_size, value_size))
+        self.rows = None
+        if rows_path is not None:
+            # 探索エンジンのDnnBatchBufferの行の領域
+            rows = self._map(rows_path)
+            self.rows = self._input_view(rows, len(rows) // self.input_bytes * self.input_bytes, 0)
+        self.attached_addr = self._addr(H_ATTACHED)
+        self.request_addr = self._addr(H_REQUEST_SEQ)
+        self.response_addr = self._addr(H_RESPONSE_SEQ)
+        self.seq = self._u32(H_REQUEST_SEQ)
+        self._set_u32(H_ATTACHED, 1)
+        self._wake(self.attached_addr)
+
+    def _input_view(self, buffer, size, offset):
+        rows = np.frombuffer(buffer, dtype=np.uint8, count=size, offset=offset).reshape((-1, self.input_bytes))
+        if self.packed_board is not None:
+            return rows
+        return rows.view(np.float32).reshape((-1,) + BOARD_SHAPE)
+
+    @staticmethod
+    def _map(path):
+        with open(path, "r+b") as f:
+            return mmap.mmap(f.fileno(), 0)
+
+    def _u32(self, pos):
+        return int(self.header[pos:pos + 4].view(np.uint32)[0])
+
+    def _u64(self, pos):
+        return int(self.header[pos:pos + 8].view(np.uint64)[0])
+
+    def _set_u32(self, pos, value):
+        self.header[pos:pos + 4].view(np.uint32)[0] = value
+
+    def _addr(self, pos):
+        return ctypes.addressof(ctypes.c_uint32.from_buffer(self.channel, pos))
+
+    def _wake(self, addr):
+        self.libc.syscall(SYS_FUTEX, ctypes.c_void_p(addr), FUTEX_WAKE, 0x7fffffff, None, None, 0)
+
+    def _engine_alive(self):
+        try:
+            os.kill(self.engine_pid, 0)
+        except ProcessLookupError:
+            return False
+        except PermissionError:
+            pass
+        return True
+
+    def wait_request(self):
+        """
+        次の要求を待ち、(バッチサイズ, 入力)を返す。入力はrun_modelのboard_inputの形式。終了要求またはエンジンの終了時は(0, None)。
+        """
+        timeout = Timespec(WAIT_TIMEOUT_SEC, 0)
+        while True:
+            seq = self._u32(H_REQUEST_SEQ)
+            if seq != self.seq:
+                break
+            self.libc.syscall(SYS_FUTEX, ctypes.c_void_p(self.request_addr), FUTEX_WAIT, ctypes.c_uint32(seq),
+                              ctypes.byref(timeout), None, 0)
+            if self._u32(H_REQUEST_SEQ) == seq and not self._engine_alive():
+                return 0, None
+        self.seq = seq
+        batch_size = self._u32(H_BATCH_SIZE)
+        if batch_size == 0:
+            return 0, None
+        if self._u32(H_INPUT_IN_ROWS):
+            first = self._u64(H_INPUT_OFFSET) // self.input_bytes
+            return batch_size, self.rows[first:first + batch_size]
+        return batch_size, self.staging[:batch_size]
+
+    def respond(self, status=0):
+        self._set_u32(H_STATUS, status)
+        self._set_u32(H_RESPONSE_SEQ, self.seq)
+        self._wake(self.response_addr)
+
+
+def shm_request_loop(model, channel):
+    while True:
+        batch_size, board_input = channel.wait_request()
+        if batch_size == 0:
+            return
+        try:
+            run_model(model, board_input, channel.packed_board, channel.policy[:batch_size], channel.value[:batch_size])
+            channel.respond()
+        except Exception:
+            channel.respond(1)
+            raise
+
+
 def main():
     parser = argparse.ArgumentParser()
     parser.add_argument("checkpoint_dir")
     parser.add_argument("gpu_id", type=int)
-    parser.add_argument("hostname")
-    parser.add_argument("port", type=int)
+    parser.add_argument("hostname", nargs="?")
+    parser.add_argument("port", type=int, nargs="?")
+    parser.add_argument("--shm", help="TCPの代わりに用いる共有メモリのチャンネル")
+    parser.add_argument("--shm-rows", help="入力行列の行の共有メモリ(--shmと共に指定)")
+    parser.add_argument("--packed", type=int, default=0, help="TCPで受け取る入力がパック形式の場合、ビットで表すチャンネル数")
+    parser.add_argument("--null-model", action="store_true", help="モデルを実行せず0を返す(受け渡しの速度測定用)")
     args = parser.parse_args()
-    device = torch.device(f"cuda:{args.gpu_id}" if args.gpu_id >= 0 else "cpu")
-    model = load_model(args.checkpoint_dir, device)
-    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-    sock.connect((args.hostname, args.port))
-    request_loop(device, model, sock)
+    if args.null_model:
+        model = NullModel()
+    else:
+        model = TorchModel(args.checkpoint_dir, args.gpu_id)
+    if args.shm:
+        shm_request_loop(model, ShmChannel(args.shm, args.shm_rows))
+    else:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.connect((args.hostname, args.port))
+        request_loop(model, sock, PackedBoard(args.packed) if args.packed > 0 else None)
 
 
 if __name__ == '__main__':
@@ -15,11 +15,13 @@ BUILDDIR=../build/user
 mkdir -p ${BUILDDIR}
 EDITION=USER_ENGINE
 TARGET=YaneuraOu-user-linux-clang
+# DNNの評価方法(tensorrt, cpu)
+DNN_BACKEND=${DNN_BACKEND:-tensorrt}
 declare -A TGTAIL=([avx2]=-avx2)
 for key in ${!TGTAIL[*]}
 do
 	${MAKE} -f ${MAKEFILE} clean YANEURAOU_EDITION=${EDITION}
-	${MAKE} -f ${MAKEFILE} -j${JOBS} ${key} YANEURAOU_EDITION=${EDITION} COMPILER=${COMPILER} 2>&1 | tee $BUILDDIR/${TARGET}${TGTAIL[$key]}.log
+	${MAKE} -f ${MAKEFILE} -j${JOBS} ${key} YANEURAOU_EDITION=${EDITION} COMPILER=${COMPILER} DNN_BACKEND=${DNN_BACKEND} 2>&1 | tee $BUILDDIR/${TARGET}${TGTAIL[$key]}.log
 	cp YaneuraOu-by-gcc ${BUILDDIR}/${TARGET}${TGTAIL[$key]}
 	${MAKE} -f ${MAKEFILE} clean YANEURAOU_EDITION=${EDITION}
 done
@@ -0,0 +1,160 @@
+﻿#include "../../extra/all.h"
+
+#ifdef USER_ENGINE_MCTS
+#include "cpu_int8_calibration.h"
+#include "cpu_resnet.h"
+#include "dnn_converter.h"
+#include <chrono>
+#include <numeric>
+
+// learn.hのPackedSfenValueの大きさ(先頭がPackedSfen)。学習用ビルドでなくても読めるよう、大きさだけを使う。
+static const size_t PACKED_SFEN_VALUE_SIZE = 40;
+
+// 入力行列と、評価の比較に使う合法手のインデックス
+struct CalibrationPositions
+{
+	std::vector<float> inputs;
+	std::vector<std::vector<int>> legal_indices;
+	int count = 0;
+};
+
+// 棋譜のskip局面目から最大count局面を読み、入力行列に変換する。詰んでいる局面は除く。
+static void read_positions(ifstream &ifs, const DNNConverter &cvt, size_t sample_size, int count, CalibrationPositions &dst)
+{
+	Position pos;
+	StateInfo si;
+	char record[PACKED_SFEN_VALUE_SIZE];
+	dst.inputs.reserve(sample_size * count);
+	while (dst.count < count && ifs.read(record, PACKED_SFEN_VALUE_SIZE))
+	{
+		if (pos.set_from_packed_sfen(*reinterpret_cast<const PackedSfen*>(record), &si, Threads.main()) != 0 || pos.is_mated())
+		{
+			continue;
+		}
+		dst.inputs.resize(sample_size * (dst.count + 1));
+		cvt.get_board_array(pos, &dst.inputs[sample_size * dst.count]);
+		std::vector<int> indices;
+		for (auto m : MoveList<LEGAL>(pos))
+		{
+			indices.push_back(cvt.get_move_index(pos, m));
+		}
+		dst.legal_indices.push_back(std::move(indices));
+		dst.count++;
+	}
+}
+
+// batch_size局面ずつ評価したときの1秒あたりの局面数
+static double measure_speed(CpuResNet &net, const CalibrationPositions &positions, int batch_size, CpuWorkerPool &pool)
+{
+	std::vector<float> policy((size_t)net.policy_size() * batch_size), value((size_t)net.value_size() * batch_size);
+	int n_samples = 0, offset = 0;
+	auto start = std::chrono::steady_clock::now();
+	double elapsed = 0.0;
+	// 1秒以上かつバッチ3回以上計測する
+	while (elapsed < 1.0 || n_samples < batch_size * 3)
+	{
+		if (offset + batch_size > positions.count)
+		{
+			offset = 0;
+		}
+		net.forward(batch_size, &positions.inputs[(size_t)offset * net.input_size()], policy.data(), value.data(), pool);
+		offset += batch_size;
+		n_samples += batch_size;
+		elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000000.0;
+	}
+	return n_samples / elapsed;
+}
+
+bool cpu_int8_calibration(const string &evalDir, const string &sfenPath, int n_calib, int n_eval, double percentile,
+	int format_board, int format_move, int n_threads)
+{
+	CpuResNet net;
+	if (!net.load(evalDir + "/model_cpu.bin"))
+	{
+		return false;
+	}
+	DNNConverter cvt(format_board, format_move);
+	auto input_shape = cvt.board_shape();
+	size_t sample_size = accumulate(input_shape.begin(), input_shape.end(), 1, std::multiplies<int>());
+	if ((size_t)net.input_size() != sample_size)
+	{
+		sync_cout << "info string input size mismatch " << net.input_size() << " " << sample_size << " (check DNNFormatBoard)" << sync_endl;
+		return false;
+	}
+	ifstream ifs(sfenPath, ios::binary);
+	if (!ifs)
+	{
+		sync_cout << "info string cannot open " << sfenPath << sync_endl;
+		return false;
+	}
+	CalibrationPositions calib, eval;
+	read_positions(ifs, cvt, sample_size, n_calib, calib);
+	read_positions(ifs, cvt, sample_size, n_eval, eval);
+	if (calib.count == 0 || eval.count == 0)
+	{
+		sync_cout << "info string not enough positions in " << sfenPath << " calib=" << calib.count << " eval=" << eval.count << sync_endl;
+		return false;
+	}
+	CpuWorkerPool pool(n_threads);
+	sync_cout << "info string calibrating with " << calib.count << " positions, evaluating with " << eval.count << " positions, "
+		<< pool.size() << " threads" << sync_endl;
+
+	std::vector<float> policy_fp32((size_t)net.policy_size() * eval.count), value_fp32((size_t)net.value_size() * eval.count);
+	net.forward(eval.count, eval.inputs.data(), policy_fp32.data(), value_fp32.data(), pool);
+
+	net.calibrate(calib.count, calib.inputs.data(), percentile, pool);
+	string calibPath = evalDir + "/model_cpu.calib";
+	if (!net.save_calibration(calibPath))
+	{
+		sync_cout << "info string cannot write " << calibPath << sync_endl;
+		return false;
+	}
+	sync_cout << "info string saved " << calibPath << sync_endl;
+
+	// 精度の比較。方策は合法手内の最大の手、価値はDNNスレッドと同じくtanh(value[0] - value[1])で比べる。
+	std::vector<float> policy_int8(policy_fp32.size()), value_int8(value_fp32.size());
+	net.forward(eval.count, eval.inputs.data(), policy_int8.data(), value_int8.data(), pool);
+	int n_agree = 0;
+	double value_se = 0.0;
+	for (int i = 0; i < eval.count; i++)
+	{
+		const float *p_fp32 = &policy_fp32[(size_t)i * net.policy_size()];
+		const float *p_int8 = &policy_int8[(size_t)i * net.policy_size()];
+		int best_fp32 = -1, best_int8 = -1;
+		for (int index : eval.legal_indices[i])
+		{
+			if (best_fp32 < 0 || p_fp32[index] > p_fp32[best_fp32])
+			{
+				best_fp32 = index;
+			}
+			if (best_int8 < 0 || p_int8[index] > p_int8[best_int8])
+			{
+				best_int8 = index;
+			}
+		}
+		if (best_fp32 == best_int8)
+		{
+			n_agree++;
+		}
+		double v_fp32 = tanh(value_fp32[(size_t)i * 2] - value_fp32[(size_t)i * 2 + 1]);
+		double v_int8 = tanh(value_int8[(size_t)i * 2] - value_int8[(size_t)i * 2 + 1]);
+		value_se += (v_fp32 - v_int8) * (v_fp32 - v_int8);
+	}
+	sync_cout << "info string int8 vs fp32: policy top1 agreement " << n_agree * 100.0 / eval.count << "%, value mse " << value_se / eval.count << sync_endl;
+
+	for (int batch_size : { 1, 4, 16, 64, 256 })
+	{
+		if (batch_size > eval.count)
+		{
+			break;
+		}
+		net.set_int8(false);
+		double fp32_speed = measure_speed(net, eval, batch_size, pool);
+		net.set_int8(true);
+		double int8_speed = measure_speed(net, eval, batch_size, pool);
+		sync_cout << "info string batch " << batch_size << ": fp32 " << (int)fp32_speed << " samples/s, int8 " << (int)int8_speed
+			<< " samples/s, speedup " << int8_speed / fp32_speed << sync_endl;
+	}
+	return true;
+}
+#endif
@@ -0,0 +1,8 @@
+﻿#pragma once
+#include "../../extra/all.h"
+
+// CPUでの評価(DNNBackend=cpu)を8bit化するための較正。
+// PackedSfenValue形式(40バイト/局面)の棋譜の先頭n_calib局面で活性値のスケールを決めてevalDir/model_cpu.calibに保存し、
+// 続くn_eval局面でfloatとの差(合法手内の方策の1位の一致率、価値(勝率)の二乗誤差)とバッチサイズごとの速度比を表示する。
+bool cpu_int8_calibration(const string &evalDir, const string &sfenPath, int n_calib, int n_eval, double percentile,
+	int format_board, int format_move, int n_threads);
@@ -0,0 +1,809 @@
+﻿#include "../../extra/all.h"
+#include "cpu_resnet.h"
+
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
+
+// 畳み込みのカーネルで使うベクトル型。出力チャンネル方向にVLEN要素をまとめて計算する。
+#if defined(USE_AVX512)
+typedef __m512 vfloat;
+static const int VLEN = 16;
+static inline vfloat vzero() { return _mm512_setzero_ps(); }
+static inline vfloat vset1(float x) { return _mm512_set1_ps(x); }
+static inline vfloat vload(const float *p) { return _mm512_loadu_ps(p); }
+static inline void vstore(float *p, vfloat v) { _mm512_storeu_ps(p, v); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm512_add_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm512_max_ps(a, b); }
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return _mm512_fmadd_ps(a, b, c); }
+#elif defined(USE_AVX2)
+typedef __m256 vfloat;
+static const int VLEN = 8;
+static inline vfloat vzero() { return _mm256_setzero_ps(); }
+static inline vfloat vset1(float x) { return _mm256_set1_ps(x); }
+static inline vfloat vload(const float *p) { return _mm256_loadu_ps(p); }
+static inline void vstore(float *p, vfloat v) { _mm256_storeu_ps(p, v); }
+static inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+#ifdef __FMA__
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+// AVX2の対象CPUはFMAを備えているが、-mfmaなしでビルドした場合は乗算と加算に分ける
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+#else
+typedef float vfloat;
+static const int VLEN = 1;
+static inline vfloat vzero() { return 0.0F; }
+static inline vfloat vset1(float x) { return x; }
+static inline vfloat vload(const float *p) { return *p; }
+static inline void vstore(float *p, vfloat v) { *p = v; }
+static inline vfloat vadd(vfloat a, vfloat b) { return a + b; }
+static inline vfloat vmax(vfloat a, vfloat b) { return a > b ? a : b; }
+static inline vfloat vfmadd(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+#endif
+
+// カーネルは1行(9マス)について、出力チャンネルCONV_BLOCK個をまとめて計算する。
+// 累積をレジスタに載せたまま、入力チャンネルごとに重みのベクトルを読み、マスごとの入力値を掛けて足し込む。
+// (ch=128の6ブロックのモデルで1行x3マスより速かった組み合わせ。AVX-512はレジスタが32本あるので3本分)
+#if defined(USE_AVX512)
+static const int CONV_VECS = 3;
+#else
+static const int CONV_VECS = 2;
+#endif
+static const int CONV_BLOCK = VLEN * CONV_VECS;
+// 周囲に1マスずつ0を詰めた盤面の一辺
+static const int PADDED_SIDE = 11;
+static const int PADDED_SQUARES = PADDED_SIDE * PADDED_SIDE;
+
+static const char CPU_WEIGHT_MAGIC[4] = { 'N', 'C', 'P', 'U' };
+static const int CPU_WEIGHT_VERSION = 1;
+static const char CPU_CALIB_MAGIC[4] = { 'N', 'C', 'Q', 'S' };
+static const int CPU_CALIB_VERSION = 1;
+
+// 8bitの活性値・重みの上限。_mm256_maddubs_epi16は隣り合う2つの積の和をint16に飽和させるので、127 * 127 * 2 < 32768に収める。
+static const int QUANT_ACT_MAX = 127;
+static const int QUANT_WEIGHT_MAX = 127;
+// 較正で活性値の分布を集計するヒストグラムの分割数
+static const int CALIB_BINS = 2048;
+
+// 8bitの畳み込みのカーネルで使うベクトル型。32bitの要素ごとに、活性値(符号なし)4個と重み(符号付き)4個の積和を累積する。
+// VNNIがあれば1命令、なければmaddubs(int16への積和) + madd(int32への和)で計算する。
+#if defined(USE_AVX512) && defined(__AVX512BW__)
+typedef __m512i vint;
+static const int QVLEN = 16;
+static const int QVECS = 3;
+static inline vint qzero() { return _mm512_setzero_si512(); }
+static inline vint qset1(int32_t x) { return _mm512_set1_epi32(x); }
+static inline vint qload(const int8_t *p) { return _mm512_loadu_si512((const void*)p); }
+static inline void qstore(int32_t *p, vint v) { _mm512_storeu_si512((void*)p, v); }
+#ifdef __AVX512VNNI__
+static inline vint qdot(vint acc, vint a, vint w) { return _mm512_dpbusd_epi32(acc, a, w); }
+#else
+static inline vint qdot(vint acc, vint a, vint w) { return _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(a, w), _mm512_set1_epi16(1))); }
+#endif
+#elif defined(USE_AVX2)
+typedef __m256i vint;
+// 累積9マス分でレジスタ16本の大半を使うので、出力チャンネルはベクトル1本分
+static const int QVLEN = 8;
+static const int QVECS = 1;
+static inline vint qzero() { return _mm256_setzero_si256(); }
+static inline vint qset1(int32_t x) { return _mm256_set1_epi32(x); }
+static inline vint qload(const int8_t *p) { return _mm256_loadu_si256((const __m256i*)p); }
+static inline void qstore(int32_t *p, vint v) { _mm256_storeu_si256((__m256i*)p, v); }
+#ifdef __AVXVNNI__
+static inline vint qdot(vint acc, vint a, vint w) { return _mm256_dpbusd_avx_epi32(acc, a, w); }
+#else
+static inline vint qdot(vint acc, vint a, vint w) { return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(a, w), _mm256_set1_epi16(1))); }
+#endif
+#else
+typedef int32_t vint;
+static const int QVLEN = 1;
+static const int QVECS = 4;
+static inline vint qzero() { return 0; }
+static inline vint qset1(int32_t x) { return x; }
+static inline vint qload(const int8_t *p) { int32_t v; memcpy(&v, p, 4); return v; }
+static inline void qstore(int32_t *p, vint v) { *p = v; }
+static inline vint qdot(vint acc, vint a, vint w)
+{
+	for (int k = 0; k < 4; k++)
+	{
+		acc += (uint8_t)(a >> (k * 8)) * (int8_t)(w >> (k * 8));
+	}
+	return acc;
+}
+#endif
+// 1行(9マス)について同時に計算する出力チャンネル数。8bitの活性値はマスあたりのチャンネル数をこの倍数(4の倍数)に揃える。
+static const int QBLOCK = QVLEN * QVECS;
+
+static inline int quant_pad(int ch)
+{
+	return (ch + QBLOCK - 1) / QBLOCK * QBLOCK;
+}
+
+static inline int32_t load_u8x4(const uint8_t *p)
+{
+	int32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+// 8bitの3x3畳み込みの1行(9マス)分の累積。出力チャンネルco + jの(y, x)の値をsums[x * QBLOCK + j]に書き出す。
+// weightは[タップ][in_groups][out_pad][4]、inは周囲を0で詰めた形式でマスあたりin_groups * 4要素。
+static void qconv_row(const uint8_t *in, const int8_t *weight, int in_groups, int out_pad, int y, int co, int32_t *sums)
+{
+	const int in_stride = in_groups * 4;
+	vint acc[9][QVECS];
+	for (int x = 0; x < 9; x++)
+	{
+		for (int v = 0; v < QVECS; v++)
+		{
+			acc[x][v] = qzero();
+		}
+	}
+	for (int ky = 0; ky < 3; ky++)
+	{
+		for (int kx = 0; kx < 3; kx++)
+		{
+			const uint8_t *src = in + ((y + ky) * PADDED_SIDE + kx) * in_stride;
+			const int8_t *w = weight + (((size_t)(ky * 3 + kx) * in_groups) * out_pad + co) * 4;
+			for (int g = 0; g < in_groups; g++)
+			{
+				vint wv[QVECS];
+				for (int v = 0; v < QVECS; v++)
+				{
+					wv[v] = qload(w + v * QVLEN * 4);
+				}
+				for (int x = 0; x < 9; x++)
+				{
+					vint a = qset1(load_u8x4(src + x * in_stride + g * 4));
+					for (int v = 0; v < QVECS; v++)
+					{
+						acc[x][v] = qdot(acc[x][v], a, wv[v]);
+					}
+				}
+				w += out_pad * 4;
+			}
+		}
+	}
+	for (int x = 0; x < 9; x++)
+	{
+		for (int v = 0; v < QVECS; v++)
+		{
+			qstore(sums + x * QBLOCK + v * QVLEN, acc[x][v]);
+		}
+	}
+}
+
+CpuWorkerPool::CpuWorkerPool(int n_threads) : _fn(nullptr), _n_tasks(0), _next_task(0), _n_running(0), _generation(0), _quit(false)
+{
+	for (int i = 1; i < n_threads; i++)
+	{
+		_threads.emplace_back(&CpuWorkerPool::worker_main, this, i);
+	}
+}
+
+CpuWorkerPool::~CpuWorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_cond_start.notify_all();
+	for (auto &th : _threads)
+	{
+		th.join();
+	}
+}
+
+void CpuWorkerPool::run(int n_tasks, const std::function<void(int, int)> &fn)
+{
+	if (_threads.empty() || n_tasks <= 1)
+	{
+		for (int i = 0; i < n_tasks; i++)
+		{
+			fn(i, 0);
+		}
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_fn = &fn;
+		_n_tasks = n_tasks;
+		_next_task = 0;
+		_n_running = (int)_threads.size();
+		_generation++;
+	}
+	_cond_start.notify_all();
+	work(0);
+	std::unique_lock<std::mutex> lock(_mutex);
+	_cond_done.wait(lock, [&] { return _n_running == 0; });
+}
+
+void CpuWorkerPool::worker_main(int worker)
+{
+	uint64_t generation = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cond_start.wait(lock, [&] { return _quit || _generation != generation; });
+			if (_quit)
+			{
+				return;
+			}
+			generation = _generation;
+		}
+		work(worker);
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (--_n_running == 0)
+		{
+			_cond_done.notify_one();
+		}
+	}
+}
+
+void CpuWorkerPool::work(int worker)
+{
+	int task;
+	while ((task = _next_task.fetch_add(1)) < _n_tasks)
+	{
+		(*_fn)(task, worker);
+	}
+}
+
+CpuResNet::CpuResNet() : _in_ch(0), _ch(0), _ch_pad(0), _depth(0), _block_depth(0), _move_dim(0), _move_hidden(0), _int8(false), _calib_pass(0)
+{
+}
+
+static bool read_floats(FILE *fp, float *dst, size_t count)
+{
+	return fread(dst, sizeof(float), count, fp) == count;
+}
+
+bool CpuResNet::read_conv(FILE *fp, ConvLayer &layer, int in_ch, int out_ch, int ksize, bool pad_out)
+{
+	layer.in_ch = in_ch;
+	layer.out_ch = out_ch;
+	layer.out_pad = pad_out ? (out_ch + CONV_BLOCK - 1) / CONV_BLOCK * CONV_BLOCK : out_ch;
+	layer.ksize = ksize;
+	int taps = ksize * ksize;
+	// ファイル上は[out_ch][in_ch][ky][kx](PyTorchの並び)
+	std::vector<float> raw((size_t)out_ch * in_ch * taps);
+	layer.bias.assign(layer.out_pad, 0.0F);
+	if (!read_floats(fp, raw.data(), raw.size()) || !read_floats(fp, layer.bias.data(), out_ch))
+	{
+		return false;
+	}
+	// カーネルで出力チャンネル方向に連続して読めるよう、[タップ][in_ch][out_pad]に並べ替える(余りのチャンネルの重みは0)
+	layer.weight.assign((size_t)taps * in_ch * layer.out_pad, 0.0F);
+	for (int co = 0; co < out_ch; co++)
+	{
+		for (int ci = 0; ci < in_ch; ci++)
+		{
+			for (int t = 0; t < taps; t++)
+			{
+				layer.weight[((size_t)t * in_ch + ci) * layer.out_pad + co] = raw[((size_t)co * in_ch + ci) * taps + t];
+			}
+		}
+	}
+	return true;
+}
+
+bool CpuResNet::read_linear(FILE *fp, LinearLayer &layer, int in_size, int out_size)
+{
+	layer.in_size = in_size;
+	layer.out_size = out_size;
+	layer.weight.resize((size_t)in_size * out_size);
+	layer.bias.resize(out_size);
+	return read_floats(fp, layer.weight.data(), layer.weight.size()) && read_floats(fp, layer.bias.data(), out_size);
+}
+
+bool CpuResNet::load(const std::string &path)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+	{
+		sync_cout << "info string failed to open " << path << sync_endl;
+		return false;
+	}
+	char magic[4];
+	int32_t header[7];
+	bool ok = fread(magic, 1, 4, fp) == 4 && memcmp(magic, CPU_WEIGHT_MAGIC, 4) == 0 && fread(header, sizeof(int32_t), 7, fp) == 7 && header[0] == CPU_WEIGHT_VERSION;
+	if (ok)
+	{
+		_in_ch = header[1];
+		_ch = header[2];
+		_depth = header[3];
+		_block_depth = header[4];
+		_move_dim = header[5];
+		_move_hidden = header[6];
+		ok = read_conv(fp, _conv1, _in_ch, _ch, 3, true);
+		_ch_pad = _conv1.out_pad;
+		_block_convs.resize((size_t)_depth * _block_depth);
+		for (auto &layer : _block_convs)
+		{
+			ok = ok && read_conv(fp, layer, _ch, _ch, 3, true);
+		}
+		ok = ok && read_conv(fp, _p_conv1, _ch, 2, 1, false) && read_linear(fp, _p_fc2, 2 * 81, _move_dim)
+			&& read_conv(fp, _v_conv1, _ch, 1, 1, false) && read_linear(fp, _v_fc2, 81, _move_hidden) && read_linear(fp, _v_fc3, _move_hidden, 2);
+	}
+	fclose(fp);
+	if (!ok)
+	{
+		sync_cout << "info string invalid cpu weight file " << path << sync_endl;
+		return false;
+	}
+	sync_cout << "info string loaded " << path << " ch=" << _ch << " blocks=" << _depth << "x" << _block_depth << sync_endl;
+	return true;
+}
+
+void CpuResNet::conv3x3(const ConvLayer &layer, const float *in, int in_stride, const float *residual, bool relu, float *out) const
+{
+	const int in_ch = layer.in_ch;
+	const int out_pad = layer.out_pad;
+	const vfloat zero = vzero();
+	for (int y = 0; y < 9; y++)
+	{
+		for (int co = 0; co < out_pad; co += CONV_BLOCK)
+		{
+			vfloat acc[9][CONV_VECS];
+			for (int x = 0; x < 9; x++)
+			{
+				for (int v = 0; v < CONV_VECS; v++)
+				{
+					acc[x][v] = vload(&layer.bias[co + v * VLEN]);
+				}
+			}
+			for (int ky = 0; ky < 3; ky++)
+			{
+				for (int kx = 0; kx < 3; kx++)
+				{
+					// 出力(y, x)に対する入力は、詰め物込みの座標で(y + ky, x + kx)
+					const float *src = in + ((y + ky) * PADDED_SIDE + kx) * in_stride;
+					const float *w = &layer.weight[((size_t)(ky * 3 + kx) * in_ch) * out_pad + co];
+					for (int ci = 0; ci < in_ch; ci++)
+					{
+						vfloat wv[CONV_VECS];
+						for (int v = 0; v < CONV_VECS; v++)
+						{
+							wv[v] = vload(w + v * VLEN);
+						}
+						for (int x = 0; x < 9; x++)
+						{
+							vfloat s = vset1(src[x * in_stride + ci]);
+							for (int v = 0; v < CONV_VECS; v++)
+							{
+								acc[x][v] = vfmadd(s, wv[v], acc[x][v]);
+							}
+						}
+						w += out_pad;
+					}
+				}
+			}
+			// バイアス(BatchNorm)は累積の初期値で加えてあるので、残差の加算とReLUを行って書き出す
+			for (int x = 0; x < 9; x++)
+			{
+				size_t offset = (size_t)((y + 1) * PADDED_SIDE + x + 1) * out_pad + co;
+				for (int v = 0; v < CONV_VECS; v++)
+				{
+					vfloat r = acc[x][v];
+					if (residual)
+					{
+						r = vadd(r, vload(residual + offset + v * VLEN));
+					}
+					if (relu)
+					{
+						r = vmax(r, zero);
+					}
+					vstore(out + offset + v * VLEN, r);
+				}
+			}
+		}
+	}
+}
+
+void CpuResNet::conv1x1_relu(const ConvLayer &layer, const float *in, int in_stride, float *out) const
+{
+	for (int co = 0; co < layer.out_ch; co++)
+	{
+		const float *w = &layer.weight[co];
+		for (int sq = 0; sq < 81; sq++)
+		{
+			const float *src = in + ((sq / 9 + 1) * PADDED_SIDE + sq % 9 + 1) * in_stride;
+			float sum = layer.bias[co];
+			for (int ci = 0; ci < layer.in_ch; ci++)
+			{
+				sum += src[ci] * w[ci * layer.out_pad];
+			}
+			out[co * 81 + sq] = std::max(sum, 0.0F);
+		}
+	}
+}
+
+void CpuResNet::linear(const LinearLayer &layer, const float *in, bool relu, float *out)
+{
+	for (int o = 0; o < layer.out_size; o++)
+	{
+		const float *w = &layer.weight[(size_t)o * layer.in_size];
+		float sum = 0.0F;
+		for (int i = 0; i < layer.in_size; i++)
+		{
+			sum += w[i] * in[i];
+		}
+		sum += layer.bias[o];
+		out[o] = relu ? std::max(sum, 0.0F) : sum;
+	}
+}
+
+void CpuResNet::forward_one(const float *input, float *policy, float *value, Workspace &ws) const
+{
+	// 入力を[チャンネル][9][9]から、周囲を0で詰めたマスごとの並びに変換する
+	for (int c = 0; c < _in_ch; c++)
+	{
+		for (int sq = 0; sq < 81; sq++)
+		{
+			ws.input[((sq / 9 + 1) * PADDED_SIDE + sq % 9 + 1) * _in_ch + c] = input[c * 81 + sq];
+		}
+	}
+	if (_calib_pass)
+	{
+		record_act(ws, 0, ws.input.data(), _in_ch, _in_ch);
+	}
+	float *h = ws.act[0].data();
+	conv3x3(_conv1, ws.input.data(), _in_ch, nullptr, true, h);
+	if (_calib_pass)
+	{
+		record_act(ws, 1, h, _ch_pad, _ch);
+	}
+	for (int b = 0; b < _depth; b++)
+	{
+		// ブロックの入力hを残差として残し、作業用の2つの領域を交互に使う
+		float *block_in = h;
+		float *bufs[2];
+		int n_bufs = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			if (ws.act[i].data() != block_in)
+			{
+				bufs[n_bufs++] = ws.act[i].data();
+			}
+		}
+		const float *src = block_in;
+		for (int i = 0; i < _block_depth; i++)
+		{
+			bool last = i == _block_depth - 1;
+			float *dst = bufs[i % 2];
+			int layer = b * _block_depth + i;
+			conv3x3(_block_convs[layer], src, _ch_pad, last ? block_in : nullptr, true, dst);
+			if (_calib_pass)
+			{
+				record_act(ws, 2 + layer, dst, _ch_pad, _ch);
+			}
+			src = dst;
+		}
+		h = (float*)src;
+	}
+	heads(h, policy, value, ws);
+}
+
+void CpuResNet::forward_one_int8(const float *input, float *policy, float *value, Workspace &ws) const
+{
+	// 入力を周囲を0で詰めたマスごとの並びにして、8bitに丸める
+	const int in_pad = _qconvs[0].in_pad;
+	const float inv_in_scale = 1.0F / _act_scales[0];
+	for (int c = 0; c < _in_ch; c++)
+	{
+		for (int sq = 0; sq < 81; sq++)
+		{
+			int q = (int)(std::max(input[c * 81 + sq], 0.0F) * inv_in_scale + 0.5F);
+			ws.qinput[((sq / 9 + 1) * PADDED_SIDE + sq % 9 + 1) * in_pad + c] = (uint8_t)std::min(q, QUANT_ACT_MAX);
+		}
+	}
+	// 最後の畳み込みの出力はヘッドに渡すので、丸めずにfloatで書き出す
+	const int n_convs = (int)_qconvs.size();
+	float *h_f = ws.act[0].data();
+	uint8_t *h = ws.qact[0].data();
+	float h_scale = _act_scales[1];
+	qconv3x3(_qconvs[0], ws.qinput.data(), _act_scales[0], nullptr, 0.0F, h_scale, h, n_convs == 1 ? h_f : nullptr);
+	for (int b = 0; b < _depth; b++)
+	{
+		uint8_t *block_in = h;
+		float block_in_scale = h_scale;
+		uint8_t *bufs[2];
+		int n_bufs = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			if (ws.qact[i].data() != block_in)
+			{
+				bufs[n_bufs++] = ws.qact[i].data();
+			}
+		}
+		const uint8_t *src = block_in;
+		float src_scale = block_in_scale;
+		for (int i = 0; i < _block_depth; i++)
+		{
+			bool last = i == _block_depth - 1;
+			int layer = 1 + b * _block_depth + i;
+			uint8_t *dst = bufs[i % 2];
+			qconv3x3(_qconvs[layer], src, src_scale, last ? block_in : nullptr, block_in_scale, _act_scales[1 + layer], dst, layer == n_convs - 1 ? h_f : nullptr);
+			src = dst;
+			src_scale = _act_scales[1 + layer];
+		}
+		h = (uint8_t*)src;
+		h_scale = src_scale;
+	}
+	heads(h_f, policy, value, ws);
+}
+
+void CpuResNet::heads(const float *h, float *policy, float *value, Workspace &ws) const
+{
+	conv1x1_relu(_p_conv1, h, _ch_pad, ws.policy_hidden.data());
+	linear(_p_fc2, ws.policy_hidden.data(), false, policy);
+	conv1x1_relu(_v_conv1, h, _ch_pad, ws.value_hidden.data());
+	linear(_v_fc2, ws.value_hidden.data(), true, ws.value_fc.data());
+	linear(_v_fc3, ws.value_fc.data(), false, value);
+}
+
+void CpuResNet::qconv3x3(const QuantConvLayer &layer, const uint8_t *in, float in_scale, const uint8_t *residual, float residual_scale,
+	float out_scale, uint8_t *out, float *out_f) const
+{
+	const int out_pad = layer.out_pad;
+	const int out_ch = layer.out_ch;
+	const float inv_out_scale = 1.0F / out_scale;
+	alignas(64) int32_t sums[9 * QBLOCK];
+	for (int y = 0; y < 9; y++)
+	{
+		for (int co = 0; co < out_pad; co += QBLOCK)
+		{
+			qconv_row(in, layer.weight.data(), layer.in_pad / 4, out_pad, y, co, sums);
+			// 累積を実数に戻してバイアス(BatchNorm)・残差を加え、ReLUを行って書き出す。積和に比べて計算量が小さいのでスカラーで行う。
+			for (int x = 0; x < 9; x++)
+			{
+				size_t offset = (size_t)((y + 1) * PADDED_SIDE + x + 1) * out_pad + co;
+				for (int j = 0; j < QBLOCK; j++)
+				{
+					float r = sums[x * QBLOCK + j] * (in_scale * layer.weight_scale[co + j]) + layer.bias[co + j];
+					if (residual)
+					{
+						r += residual[offset + j] * residual_scale;
+					}
+					r = std::max(r, 0.0F);
+					if (out_f)
+					{
+						// floatの活性値はマスあたり_ch_pad要素なので、余りのチャンネルは書き出さない
+						if (co + j < out_ch)
+						{
+							out_f[(size_t)((y + 1) * PADDED_SIDE + x + 1) * _ch_pad + co + j] = r;
+						}
+					}
+					else
+					{
+						out[offset + j] = (uint8_t)std::min((int)(r * inv_out_scale + 0.5F), QUANT_ACT_MAX);
+					}
+				}
+			}
+		}
+	}
+}
+
+void CpuResNet::record_act(Workspace &ws, int layer, const float *act, int stride, int n_ch) const
+{
+	// ReLU後の0は多数を占めるので、正の値だけを集計する
+	for (int sq = 0; sq < 81; sq++)
+	{
+		const float *p = act + ((sq / 9 + 1) * PADDED_SIDE + sq % 9 + 1) * stride;
+		for (int c = 0; c < n_ch; c++)
+		{
+			float v = p[c];
+			if (v <= 0.0F)
+			{
+				continue;
+			}
+			if (_calib_pass == 1)
+			{
+				ws.act_max[layer] = std::max(ws.act_max[layer], v);
+			}
+			else
+			{
+				int bin = std::min((int)(v / _calib_range[layer] * CALIB_BINS), CALIB_BINS - 1);
+				ws.act_hist[layer][bin]++;
+			}
+		}
+	}
+}
+
+void CpuResNet::quantize_weights()
+{
+	std::vector<const ConvLayer*> convs{ &_conv1 };
+	for (auto &layer : _block_convs)
+	{
+		convs.push_back(&layer);
+	}
+	_qconvs.clear();
+	for (const ConvLayer *src : convs)
+	{
+		QuantConvLayer q;
+		q.in_ch = src->in_ch;
+		// 入力はconv1なら4の倍数、それ以外は前の層の出力に揃える
+		q.in_pad = src == &_conv1 ? (src->in_ch + 3) / 4 * 4 : quant_pad(src->in_ch);
+		q.out_ch = src->out_ch;
+		q.out_pad = quant_pad(src->out_ch);
+		q.bias = src->bias;
+		q.bias.resize(q.out_pad, 0.0F);
+		q.weight_scale.assign(q.out_pad, 1.0F);
+		q.weight.assign((size_t)9 * q.in_pad * q.out_pad, 0);
+		for (int co = 0; co < src->out_ch; co++)
+		{
+			// 出力チャンネルごとに、絶対値の最大がQUANT_WEIGHT_MAXになるスケールを用いる
+			float w_max = 0.0F;
+			for (int t = 0; t < 9; t++)
+			{
+				for (int ci = 0; ci < src->in_ch; ci++)
+				{
+					w_max = std::max(w_max, std::abs(src->weight[((size_t)t * src->in_ch + ci) * src->out_pad + co]));
+				}
+			}
+			float scale = w_max > 0.0F ? w_max / QUANT_WEIGHT_MAX : 1.0F;
+			q.weight_scale[co] = scale;
+			for (int t = 0; t < 9; t++)
+			{
+				for (int ci = 0; ci < src->in_ch; ci++)
+				{
+					float w = src->weight[((size_t)t * src->in_ch + ci) * src->out_pad + co];
+					q.weight[(((size_t)t * (q.in_pad / 4) + ci / 4) * q.out_pad + co) * 4 + ci % 4] = (int8_t)std::lround(w / scale);
+				}
+			}
+		}
+		_qconvs.push_back(std::move(q));
+	}
+}
+
+void CpuResNet::calibrate(int n_samples, const float *input, double percentile, CpuWorkerPool &pool)
+{
+	const int n_layers = 2 + (int)_block_convs.size();
+	prepare_workspaces(pool.size());
+	// 出力は使わないので、スレッドごとに1局面分の領域に上書きする
+	std::vector<float> policy((size_t)_move_dim * pool.size()), value((size_t)2 * pool.size());
+	auto run_pass = [&](int pass) {
+		_calib_pass = pass;
+		for (auto &ws : _workspaces)
+		{
+			ws.act_max.assign(n_layers, 0.0F);
+			ws.act_hist.assign(pass == 2 ? n_layers : 0, std::vector<uint64_t>(CALIB_BINS, 0));
+		}
+		pool.run(n_samples, [&](int i, int worker) {
+			forward_one(input + (size_t)i * input_size(), &policy[(size_t)worker * _move_dim], &value[(size_t)worker * 2], _workspaces[worker]);
+		});
+	};
+	// 1回目で最大値を求め、2回目で[0, 最大値)のヒストグラムを作る
+	run_pass(1);
+	_calib_range.assign(n_layers, 0.0F);
+	for (auto &ws : _workspaces)
+	{
+		for (int l = 0; l < n_layers; l++)
+		{
+			_calib_range[l] = std::max(_calib_range[l], ws.act_max[l]);
+		}
+	}
+	run_pass(2);
+	_calib_pass = 0;
+
+	_act_scales.assign(n_layers, 1.0F / QUANT_ACT_MAX);
+	for (int l = 0; l < n_layers; l++)
+	{
+		if (_calib_range[l] <= 0.0F)
+		{
+			continue;
+		}
+		std::vector<uint64_t> hist(CALIB_BINS, 0);
+		uint64_t total = 0;
+		for (auto &ws : _workspaces)
+		{
+			for (int bin = 0; bin < CALIB_BINS; bin++)
+			{
+				hist[bin] += ws.act_hist[l][bin];
+				total += ws.act_hist[l][bin];
+			}
+		}
+		uint64_t target = (uint64_t)std::ceil(total * percentile / 100.0);
+		uint64_t cumulative = 0;
+		int bin = 0;
+		for (; bin < CALIB_BINS - 1; bin++)
+		{
+			cumulative += hist[bin];
+			if (cumulative >= target)
+			{
+				break;
+			}
+		}
+		_act_scales[l] = _calib_range[l] * (bin + 1) / CALIB_BINS / QUANT_ACT_MAX;
+	}
+	for (auto &ws : _workspaces)
+	{
+		ws.act_hist.clear();
+	}
+	quantize_weights();
+	_int8 = true;
+}
+
+bool CpuResNet::save_calibration(const std::string &path) const
+{
+	FILE *fp = fopen(path.c_str(), "wb");
+	if (!fp)
+	{
+		return false;
+	}
+	int32_t header[2] = { CPU_CALIB_VERSION, (int32_t)_act_scales.size() };
+	bool ok = fwrite(CPU_CALIB_MAGIC, 1, 4, fp) == 4 && fwrite(header, sizeof(int32_t), 2, fp) == 2
+		&& fwrite(_act_scales.data(), sizeof(float), _act_scales.size(), fp) == _act_scales.size();
+	return fclose(fp) == 0 && ok;
+}
+
+bool CpuResNet::load_calibration(const std::string &path)
+{
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (!fp)
+	{
+		sync_cout << "info string failed to open " << path << sync_endl;
+		return false;
+	}
+	char magic[4];
+	int32_t header[2];
+	std::vector<float> scales(2 + _block_convs.size());
+	bool ok = fread(magic, 1, 4, fp) == 4 && memcmp(magic, CPU_CALIB_MAGIC, 4) == 0 && fread(header, sizeof(int32_t), 2, fp) == 2
+		&& header[0] == CPU_CALIB_VERSION && header[1] == (int32_t)scales.size() && read_floats(fp, scales.data(), scales.size());
+	fclose(fp);
+	if (!ok)
+	{
+		sync_cout << "info string invalid calibration file " << path << " (does not match the model?)" << sync_endl;
+		return false;
+	}
+	_act_scales = scales;
+	quantize_weights();
+	_int8 = true;
+	sync_cout << "info string loaded " << path << ", using int8 inference" << sync_endl;
+	return true;
+}
+
+void CpuResNet::prepare_workspaces(int n_workers)
+{
+	if (_workspaces.size() >= (size_t)n_workers)
+	{
+		return;
+	}
+	_workspaces.resize(n_workers);
+	for (auto &ws : _workspaces)
+	{
+		// 詰め物の部分は0のまま書き換えない
+		ws.input.assign((size_t)PADDED_SQUARES * _in_ch, 0.0F);
+		for (auto &act : ws.act)
+		{
+			act.assign((size_t)PADDED_SQUARES * _ch_pad, 0.0F);
+		}
+		ws.policy_hidden.resize(2 * 81);
+		ws.value_hidden.resize(81);
+		ws.value_fc.resize(_move_hidden);
+		ws.qinput.assign((size_t)PADDED_SQUARES * ((_in_ch + 3) / 4 * 4), 0);
+		for (auto &act : ws.qact)
+		{
+			act.assign((size_t)PADDED_SQUARES * quant_pad(_ch), 0);
+		}
+	}
+}
+
+void CpuResNet::forward(int batch_size, const float *input, float *policy, float *value, CpuWorkerPool &pool)
+{
+	prepare_workspaces(pool.size());
+	// 局面ごとに分担する。重みは全スレッドで共有し、活性値はスレッドごとの作業領域に収まるのでキャッシュに載りやすい。
+	pool.run(batch_size, [&](int i, int worker) {
+		if (_int8)
+		{
+			forward_one_int8(input + (size_t)i * input_size(), policy + (size_t)i * _move_dim, value + (size_t)i * 2, _workspaces[worker]);
+		}
+		else
+		{
+			forward_one(input + (size_t)i * input_size(), policy + (size_t)i * _move_dim, value + (size_t)i * 2, _workspaces[worker]);
+		}
+	});
+}
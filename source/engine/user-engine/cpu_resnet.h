@@ -0,0 +1,151 @@
+﻿#pragma once
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+// GPUを使わずにCPUで方策・価値を評価するための、ResNet(neneshogi.models.ResNetAZ)の推論の実装。
+// 重みはneneshogi/export_cpu_weights.pyで書き出したファイルから読み込む。BatchNormは書き出し時に直前の畳み込みへ畳み込み済みで、
+// 畳み込み・バイアス・(残差の加算)・ReLUを1つのカーネルで行う。
+// 入力は局面ごとに[チャンネル][9][9]、出力はpolicy(局面ごとにmove_dim要素)とvalue(局面ごとに2要素)で、TensorRTの出力と同じ並び。
+// 較正(calibrate)で活性値のスケールを決めると、本体の3x3畳み込みを8bit整数(活性値0~127、重みは出力チャンネルごとのスケールで-127~127)で計算する。
+// 方策・価値のヘッドは計算量が小さいので常にfloatで計算する。
+
+// 計算用の固定スレッドプール
+class CpuWorkerPool
+{
+public:
+	// n_threads: 呼び出し元のスレッドを含む並列度
+	explicit CpuWorkerPool(int n_threads);
+	~CpuWorkerPool();
+
+	// fn(task, worker)をtask = 0..n_tasks-1について呼び出し元とワーカーで分担して実行し、全て終わるまで待つ。
+	// workerは実行したスレッドの番号(0は呼び出し元、0..size()-1)。
+	void run(int n_tasks, const std::function<void(int, int)> &fn);
+
+	int size() const { return (int)_threads.size() + 1; }
+
+	CpuWorkerPool(const CpuWorkerPool&) = delete;
+	CpuWorkerPool& operator=(const CpuWorkerPool&) = delete;
+
+private:
+	void worker_main(int worker);
+	void work(int worker);
+
+	std::vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _cond_start;
+	std::condition_variable _cond_done;
+	const std::function<void(int, int)> *_fn;
+	int _n_tasks;
+	std::atomic<int> _next_task;
+	int _n_running;
+	uint64_t _generation;
+	bool _quit;
+};
+
+class CpuResNet
+{
+public:
+	CpuResNet();
+
+	// 重みファイルを読み込む。失敗したらエラー内容を表示してfalseを返す。
+	bool load(const std::string &path);
+
+	// 1局面の入力・出力の要素数
+	int input_size() const { return _in_ch * 81; }
+	int policy_size() const { return _move_dim; }
+	int value_size() const { return 2; }
+
+	// batch_size局面を評価する。poolのスレッドで局面ごとに分担する。
+	void forward(int batch_size, const float *input, float *policy, float *value, CpuWorkerPool &pool);
+
+	// n_samples局面をfloatで評価して各層の活性値の分布を集計し、正の値のうちpercentile[%]が収まる値を8bitの上限とする。
+	// 重みを量子化し、以降の評価を8bitで行う。
+	void calibrate(int n_samples, const float *input, double percentile, CpuWorkerPool &pool);
+	// 較正結果(活性値のスケール)の保存・読み込み。読み込むと以降の評価を8bitで行う。
+	bool save_calibration(const std::string &path) const;
+	bool load_calibration(const std::string &path);
+	// 較正済みのとき、8bitで評価するかを切り替える
+	void set_int8(bool enable) { _int8 = enable && !_act_scales.empty(); }
+	bool int8() const { return _int8; }
+
+private:
+	// 畳み込み(BatchNorm畳み込み済み)。weightは[タップ(ksize * ksize)][in_ch][out_pad]の順に並べ替えてある。
+	struct ConvLayer
+	{
+		int in_ch, out_ch, out_pad, ksize;
+		std::vector<float> weight;
+		std::vector<float> bias;//out_pad要素
+	};
+	// 全結合層。weightは[out][in]。
+	struct LinearLayer
+	{
+		int in_size, out_size;
+		std::vector<float> weight;
+		std::vector<float> bias;
+	};
+	// 8bitの畳み込み。weightは[タップ][in_pad / 4][out_pad][4](入力チャンネル4個ずつを出力チャンネルごとに並べる)。
+	// 実数の重みはweight * weight_scale[出力チャンネル]。
+	struct QuantConvLayer
+	{
+		int in_ch, in_pad, out_ch, out_pad;
+		std::vector<int8_t> weight;
+		std::vector<float> weight_scale;//out_pad要素
+		std::vector<float> bias;//out_pad要素
+	};
+	// 1スレッドが1局面の評価に使う作業領域
+	struct Workspace
+	{
+		// 周囲に1マスずつ0を詰めた11x11マスの、マスごとにチャンネルが並んだ活性値
+		std::vector<float> input;
+		std::vector<float> act[3];
+		std::vector<float> policy_hidden;
+		std::vector<float> value_hidden;
+		std::vector<float> value_fc;
+		// 8bitで評価する場合の活性値(並びはfloatと同じでチャンネル数はQBLOCKの倍数、実数値は値 * _act_scales[層])
+		std::vector<uint8_t> qinput;
+		std::vector<uint8_t> qact[3];
+		// 較正中の活性値の集計(層ごと)
+		std::vector<float> act_max;
+		std::vector<std::vector<uint64_t>> act_hist;
+	};
+
+	bool read_conv(FILE *fp, ConvLayer &layer, int in_ch, int out_ch, int ksize, bool pad_out);
+	bool read_linear(FILE *fp, LinearLayer &layer, int in_size, int out_size);
+	void forward_one(const float *input, float *policy, float *value, Workspace &ws) const;
+	void forward_one_int8(const float *input, float *policy, float *value, Workspace &ws) const;
+	void heads(const float *h, float *policy, float *value, Workspace &ws) const;
+	void prepare_workspaces(int n_workers);
+	// 較正中に層layerの活性値(周囲を0で詰めた形式、マスあたりstride要素のうち先頭n_ch個)を集計する
+	void record_act(Workspace &ws, int layer, const float *act, int stride, int n_ch) const;
+	void quantize_weights();
+	// 8bitの3x3畳み込み。inの実数値はin * in_scale、residualはresidual * residual_scale(nullptrなら加算しない)。
+	// 出力はReLU後、out_fがnullptrでなければfloatのまま(floatの活性値と同じ並びで)書き出し、そうでなければout_scale単位に丸めてoutに書き出す。
+	void qconv3x3(const QuantConvLayer &layer, const uint8_t *in, float in_scale, const uint8_t *residual, float residual_scale,
+		float out_scale, uint8_t *out, float *out_f) const;
+	// 3x3の畳み込み。in, residual, outは周囲を0で詰めた形式で、マスあたりin_stride, out_pad要素。residualはnullptrなら加算しない。
+	void conv3x3(const ConvLayer &layer, const float *in, int in_stride, const float *residual, bool relu, float *out) const;
+	// 1x1の畳み込みとReLU。出力はチャンネルごとに81マスが並んだ形式(PyTorchのviewと同じ並び)。
+	void conv1x1_relu(const ConvLayer &layer, const float *in, int in_stride, float *out) const;
+	static void linear(const LinearLayer &layer, const float *in, bool relu, float *out);
+
+	int _in_ch, _ch, _ch_pad, _depth, _block_depth, _move_dim, _move_hidden;
+	ConvLayer _conv1;
+	std::vector<ConvLayer> _block_convs;//depth * block_depth個
+	ConvLayer _p_conv1, _v_conv1;
+	LinearLayer _p_fc2, _v_fc2, _v_fc3;
+	std::vector<Workspace> _workspaces;//CpuWorkerPoolのスレッドごと
+	// 8bitでの評価
+	bool _int8;
+	std::vector<QuantConvLayer> _qconvs;//conv1, ブロックの畳み込みの順
+	// 本体の活性値のスケール。[0]が入力、[1 + i]が_qconvs[i]の出力(ReLU後)。
+	std::vector<float> _act_scales;
+	// 較正の段階(0: 較正中でない, 1: 最大値を集計, 2: [0, _calib_range[層])のヒストグラムを集計)
+	int _calib_pass;
+	std::vector<float> _calib_range;
+};
@@ -0,0 +1,115 @@
+﻿#pragma once
+#include <cstdint>
+#include "mpmc_queue.h"
+#include "numa_memory.h"
+#include "shared_memory.h"
+
+class dnn_eval_obj;
+
+// DNN評価の要求を受け付けるリングバッファ。行ごとに1局面分の入力(floatの入力行列またはパック形式、DNNConverter::get_board_input)の領域を持つ。
+// 探索スレッドは行を確保(reserve)して入力を直接書き込み、評価要求と共に公開(commit)する。
+// DNNスレッドは公開済みの連続した行をまとめて取り出し(pop_batch)、入力をコピーせずにそのまま評価器へ渡す。
+// 行の状態の管理と取り出しの待機はMPMCQueueと共通(SeqRing)で、セルの番号がそのまま行の番号になる。
+// 取り出した行は評価後に返却(release_batch)するまで再利用されない。容量が評価待ちの局面数に足りないと、行の確保が待たされる。
+// 外部の評価プロセスが入力を直接読めるよう、行の領域を共有メモリ(SharedMemory)に置くこともできる。
+class DnnBatchBuffer : public SeqRing<dnn_eval_obj*>
+{
+public:
+	// capacityは2のべき乗に切り上げる。row_bytesは1局面の入力のバイト数。
+	// shared_rowsなら行の領域を共有メモリに確保する(確保できなければ通常のメモリに確保する)。
+	DnnBatchBuffer(size_t capacity, size_t row_bytes, bool shared_rows = false)
+		: SeqRing(capacity), _row_bytes(row_bytes)
+	{
+		if (shared_rows && _shared_rows.create(rows_bytes()))
+		{
+			_rows = (char*)_shared_rows.data();
+		}
+		else
+		{
+			_rows = (char*)large_memory_alloc(rows_bytes());
+		}
+	}
+
+	~DnnBatchBuffer()
+	{
+		if (_shared_rows.data() == nullptr)
+		{
+			large_memory_free(_rows, rows_bytes());
+		}
+	}
+
+	// 書き込み可能な行を1つ確保し、その番号を返す。満杯なら空きができるまで待つ。
+	size_t reserve()
+	{
+		size_t ticket;
+		int spin = 0;
+		while (claim_write(ticket, 1) == 0)
+		{
+			backoff(spin);
+		}
+		return ticket;
+	}
+
+	// 番号ticket(reserveまたはpop_batchで得たもの)の行の入力
+	void *row(size_t ticket) const
+	{
+		return _rows + (ticket & (capacity() - 1)) * _row_bytes;
+	}
+
+	// reserveした行に入力を書き込んだ後に呼び、評価要求objと共に読み出しを許可する
+	void commit(size_t ticket, dnn_eval_obj *obj)
+	{
+		cell(ticket).data = obj;
+		publish(ticket);
+		notify_waiters();
+	}
+
+	// 1個以上取り出せるまで待ち、公開済みの連続した最大max_size行を取り出す。先頭の番号をfirstに返す。
+	// リングの末尾で折り返さないので、row(first)から取り出した個数分の入力が連続して並ぶ。
+	size_t pop_batch(size_t &first, size_t max_size)
+	{
+		return wait_pop([&] { return pop_batch_nb(first, max_size); }, nullptr);
+	}
+
+	// 待たずに最大max_size行取り出す
+	size_t pop_batch_nb(size_t &first, size_t max_size)
+	{
+		return claim_read(first, max_size, true);
+	}
+
+	// 取り出した行の評価要求。release_batchの後は参照できない。
+	dnn_eval_obj *item(size_t ticket) const
+	{
+		return cell(ticket).data;
+	}
+
+	// 取り出したn行の入力が不要になったら呼び、1周後の書き込みを許可する
+	void release_batch(size_t first, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			release(first + i);
+		}
+	}
+
+	size_t row_bytes() const
+	{
+		return _row_bytes;
+	}
+
+	// 行の領域を共有メモリに確保した場合はその領域、そうでなければnullptr
+	const SharedMemory *shared_rows() const
+	{
+		return _shared_rows.data() ? &_shared_rows : nullptr;
+	}
+
+private:
+	size_t rows_bytes() const
+	{
+		return capacity() * _row_bytes;
+	}
+
+	size_t _row_bytes;
+	char *_rows;
+	SharedMemory _shared_rows;
+};
@@ -1,6 +1,10 @@
 ﻿#include "dnn_converter.h"
 
-DNNConverter::DNNConverter(int format_board, int format_move) : format_board(format_board), format_move(format_move)
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
+
+DNNConverter::DNNConverter(int format_board, int format_move, bool packed_input) : format_board(format_board), format_move(format_move), packed_input(packed_input)
 {
 }
 
@@ -43,20 +47,151 @@ static void fill_channel_range(float* buf, int ch_begin, int ch_end, float value
 	}
 }
 
+// floatの入力行列に書き込む
+class FloatBoardWriter
+{
+	float *buf;
+	int channels;
+public:
+	FloatBoardWriter(float *buf, int channels) : buf(buf), channels(channels) {}
+	void clear() { fill_channel_range(buf, 0, channels, 0.0F); }
+	void set(int ch, Square sq) { buf[ch * SQ_NB + sq] = 1; }
+	void fill(int ch_begin, int ch_end, float value) { fill_channel_range(buf, ch_begin, ch_end, value); }
+};
+
+// パック形式で書き込む。setはビットで表すチャンネルだけ、fillは全マス同じ値のチャンネル(bit_planes以降)だけに使う。
+class PackedBoardWriter
+{
+	uint64_t *planes;
+	uint8_t *scalars;
+	int bit_planes;
+	size_t bytes;
+public:
+	PackedBoardWriter(uint8_t *buf, const PackedBoardFormat &format)
+		: planes((uint64_t*)buf), scalars(buf + format.bit_planes * 16), bit_planes(format.bit_planes), bytes(format.bytes()) {}
+	void clear() { memset(planes, 0, bytes); }
+	void set(int ch, Square sq) { planes[ch * 2 + (sq >> 6)] |= 1ULL << (sq & 63); }
+	void fill(int ch_begin, int ch_end, float value)
+	{
+		for (int ch = ch_begin; ch < ch_end; ch++)
+		{
+			scalars[ch - bit_planes] = (uint8_t)value;
+		}
+	}
+};
+
+size_t PackedBoardFormat::bytes() const
+{
+	return ((size_t)bit_planes * 16 + (channels - bit_planes) + 63) & ~(size_t)63;
+}
+
+// 1チャンネル分のビット(lo: 0~63マス、hi: 64~80マス)を0/1のfloatに展開する
+static void unpack_plane(uint64_t lo, uint64_t hi, float *dst)
+{
+#if defined(USE_AVX2)
+	// 8マスずつ、ビットを1要素ずつに広げて比較する
+	const __m256i bit_mask = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256 one = _mm256_set1_ps(1.0F);
+	for (int i = 0; i < 10; i++)
+	{
+		uint32_t bits = (uint32_t)((i < 8 ? lo >> (i * 8) : hi >> ((i - 8) * 8)) & 0xff);
+		__m256i v = _mm256_and_si256(_mm256_set1_epi32((int)bits), bit_mask);
+		__m256 set = _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, bit_mask));
+		_mm256_storeu_ps(dst + i * 8, _mm256_and_ps(set, one));
+	}
+	dst[80] = (float)((hi >> 16) & 1);
+#else
+	for (int sq = 0; sq < 64; sq++)
+	{
+		dst[sq] = (float)((lo >> sq) & 1);
+	}
+	for (int sq = 64; sq < SQ_NB; sq++)
+	{
+		dst[sq] = (float)((hi >> (sq - 64)) & 1);
+	}
+#endif
+}
+
+void PackedBoardFormat::unpack(const uint8_t *packed, size_t count, float *buf) const
+{
+	size_t stride = bytes();
+	for (size_t i = 0; i < count; i++)
+	{
+		const uint64_t *planes = (const uint64_t*)(packed + i * stride);
+		const uint8_t *scalars = packed + i * stride + bit_planes * 16;
+		float *dst = buf + i * channels * (size_t)SQ_NB;
+		for (int ch = 0; ch < bit_planes; ch++)
+		{
+			unpack_plane(planes[ch * 2], planes[ch * 2 + 1], dst + ch * SQ_NB);
+		}
+		for (int ch = bit_planes; ch < channels; ch++)
+		{
+			fill_channel(dst, ch, (float)scalars[ch - bit_planes]);
+		}
+	}
+}
+
+PackedBoardFormat DNNConverter::packed_format() const
+{
+	// 持ち駒・王手のチャンネル(末尾57個)以外がビットで表すチャンネル
+	PackedBoardFormat format;
+	format.channels = board_shape()[0];
+	format.bit_planes = format.channels - 57;
+	return format;
+}
+
 void DNNConverter::get_board_array(const Position & pos, float *buf) const
 {
+	FloatBoardWriter writer(buf, board_shape()[0]);
+	switch (format_board)
+	{
+	case 0:
+		write_board_0(pos, writer);
+		break;
+	case 1:
+		write_board_1(pos, writer);
+		break;
+	}
+}
+
+void DNNConverter::get_board_packed(const Position & pos, uint8_t *buf) const
+{
+	PackedBoardWriter writer(buf, packed_format());
 	switch (format_board)
 	{
 	case 0:
-		get_board_array_0(pos, buf);
+		write_board_0(pos, writer);
 		break;
 	case 1:
-		get_board_array_1(pos, buf);
+		write_board_1(pos, writer);
 		break;
 	}
 }
 
-void DNNConverter::get_board_array_0(const Position & pos, float *buf) const
+size_t DNNConverter::input_bytes() const
+{
+	if (packed_input)
+	{
+		return packed_format().bytes();
+	}
+	auto shape = board_shape();
+	return sizeof(float) * shape[0] * shape[1] * shape[2];
+}
+
+void DNNConverter::get_board_input(const Position & pos, void *buf) const
+{
+	if (packed_input)
+	{
+		get_board_packed(pos, (uint8_t*)buf);
+	}
+	else
+	{
+		get_board_array(pos, (float*)buf);
+	}
+}
+
+template <typename Writer>
+void DNNConverter::write_board_0(const Position & pos, Writer &writer) const
 {	/*
 	* Ponanza (SDT5)の資料を参考に作成
 	* 盤上の駒14チャンネル *二人
@@ -66,7 +201,7 @@ void DNNConverter::get_board_array_0(const Position & pos, float *buf) const
 	* 後手番の際は、盤面・駒の所属を反転して先手番の状態にする。
 	* 手数は現在入れていない。Position.set_from_packed_sfenに要素がないため。
 	*/
-	fill_channel_range(buf, 0, 85, 0.0F);
+	writer.clear();
 	if (pos.side_to_move() == BLACK) {
 		for (Square i = SQ_ZERO; i < SQ_NB; i++) {
 			Piece p = pos.piece_on(i);
@@ -80,7 +215,7 @@ void DNNConverter::get_board_array_0(const Position & pos, float *buf) const
 			else {
 				ch = p - W_PAWN + 14;
 			}
-			buf[ch * SQ_NB + i] = 1;
+			writer.set(ch, i);
 		}
 	}
 	else {
@@ -97,7 +232,7 @@ void DNNConverter::get_board_array_0(const Position & pos, float *buf) const
 			else {
 				ch = p - W_PAWN;
 			}
-			buf[ch * SQ_NB + Inv(i)] = 1;
+			writer.set(ch, Inv(i));
 		}
 
 	}
@@ -107,26 +242,27 @@ void DNNConverter::get_board_array_0(const Position & pos, float *buf) const
 	for (int i = 0; i < 2; i++) {
 		Hand hand = hands[i];
 		//歩は最大8枚
-		fill_channel_range(buf, ch_ofs, ch_ofs + (std::min)(hand_count(hand, PAWN), 8), 1.0);
+		writer.fill(ch_ofs, ch_ofs + (std::min)(hand_count(hand, PAWN), 8), 1.0);
 		ch_ofs += 8;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, LANCE), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, LANCE), 1.0);
 		ch_ofs += 4;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, KNIGHT), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, KNIGHT), 1.0);
 		ch_ofs += 4;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, SILVER), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, SILVER), 1.0);
 		ch_ofs += 4;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, BISHOP), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, BISHOP), 1.0);
 		ch_ofs += 2;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, ROOK), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, ROOK), 1.0);
 		ch_ofs += 2;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, GOLD), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, GOLD), 1.0);
 		ch_ofs += 4;
 	}
 
-	fill_channel(buf, 84, (float)pos.in_check());
+	writer.fill(84, 85, (float)pos.in_check());
 }
 
-void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
+template <typename Writer>
+void DNNConverter::write_board_1(const Position & pos, Writer &writer) const
 {
 	/*
 	* dlshogi(201812時点)を参考に作成
@@ -141,7 +277,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 	* 後手番の際は、盤面・駒の所属を反転して先手番の状態にする。
 	* 手数は現在入れていない。Position.set_from_packed_sfenに要素がないため。
 	*/
-	fill_channel_range(buf, 0, 62+57, 0.0F);//ゼロクリア
+	writer.clear();//ゼロクリア
 	if (pos.side_to_move() == BLACK) {
 		for (Square i = SQ_ZERO; i < SQ_NB; i++) {
 			Piece p = pos.piece_on(i);
@@ -153,7 +289,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 				else {
 					ch = p - W_PAWN + 14;
 				}
-				buf[ch * SQ_NB + i] = 1;//駒種 0~27ch
+				writer.set(ch, i);//駒種 0~27ch
 			}
 			// あるマスに効いている駒がある座標を列挙、その駒種に対応したチャンネルを埋める
 			Bitboard attackers = pos.attackers_to(i);
@@ -170,7 +306,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 					ch = pa - W_PAWN + 42;
 					attacker_cnt[1]++;
 				}
-				buf[ch * SQ_NB + i] = 1;//効いている駒種 28~55ch
+				writer.set(ch, i);//効いている駒種 28~55ch
 			}
 			// 手番ごとの利きの数 56~61ch
 			for (int ai = 0; ai < 3; ai++)
@@ -178,7 +314,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 				if (attacker_cnt[0] > ai)
 				{
 					ch = 56 + ai;
-					buf[ch * SQ_NB + i] = 1;
+					writer.set(ch, i);
 				}
 			}
 			for (int ai = 0; ai < 3; ai++)
@@ -186,7 +322,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 				if (attacker_cnt[1] > ai)
 				{
 					ch = 59 + ai;
-					buf[ch * SQ_NB + i] = 1;
+					writer.set(ch, i);
 				}
 			}
 		}
@@ -203,7 +339,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 				else {
 					ch = p - W_PAWN;
 				}
-				buf[ch * SQ_NB + Inv(i)] = 1;//駒種 0~27ch
+				writer.set(ch, Inv(i));//駒種 0~27ch
 			}
 			// あるマスに効いている駒がある座標を列挙、その駒種に対応したチャンネルを埋める
 			Bitboard attackers = pos.attackers_to(i);
@@ -220,7 +356,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 					ch = pa - W_PAWN + 28;
 					attacker_cnt[0]++;
 				}
-				buf[ch * SQ_NB + Inv(i)] = 1;//効いている駒種 28~55ch
+				writer.set(ch, Inv(i));//効いている駒種 28~55ch
 			}
 			// 手番ごとの利きの数 56~61ch
 			for (int ai = 0; ai < 3; ai++)
@@ -228,7 +364,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 				if (attacker_cnt[0] > ai)
 				{
 					ch = 56 + ai;
-					buf[ch * SQ_NB + Inv(i)] = 1;
+					writer.set(ch, Inv(i));
 				}
 			}
 			for (int ai = 0; ai < 3; ai++)
@@ -236,7 +372,7 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 				if (attacker_cnt[1] > ai)
 				{
 					ch = 59 + ai;
-					buf[ch * SQ_NB + Inv(i)] = 1;
+					writer.set(ch, Inv(i));
 				}
 			}
 		}
@@ -248,23 +384,23 @@ void DNNConverter::get_board_array_1(const Position & pos, float *buf) const
 	for (int i = 0; i < 2; i++) {
 		Hand hand = hands[i];
 		//歩は最大8枚
-		fill_channel_range(buf, ch_ofs, ch_ofs + (std::min)(hand_count(hand, PAWN), 8), 1.0);
+		writer.fill(ch_ofs, ch_ofs + (std::min)(hand_count(hand, PAWN), 8), 1.0);
 		ch_ofs += 8;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, LANCE), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, LANCE), 1.0);
 		ch_ofs += 4;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, KNIGHT), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, KNIGHT), 1.0);
 		ch_ofs += 4;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, SILVER), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, SILVER), 1.0);
 		ch_ofs += 4;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, BISHOP), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, BISHOP), 1.0);
 		ch_ofs += 2;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, ROOK), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, ROOK), 1.0);
 		ch_ofs += 2;
-		fill_channel_range(buf, ch_ofs, ch_ofs + hand_count(hand, GOLD), 1.0);
+		writer.fill(ch_ofs, ch_ofs + hand_count(hand, GOLD), 1.0);
 		ch_ofs += 4;
 	}
 
-	fill_channel(buf, 62+56, (float)pos.in_check());
+	writer.fill(62+56, 62+57, (float)pos.in_check());
 }
 
 
@@ -1,19 +1,42 @@
 ﻿#pragma once
 #include "../../extra/all.h"
 
+// 入力行列をビット単位に詰めた形式(パック形式)。探索スレッドからDNNスレッド・評価プロセスへ渡す量を減らすために用いる。
+// 1局面分は、マスごとに値が異なるチャンネル(駒の配置・利き)bit_planes個を1チャンネル16バイト(81マスのビットをuint64_t 2つ、リトルエンディアン)で並べ、
+// 続けて残りの全マス同じ値のチャンネル(持ち駒・王手)の値を1チャンネル1バイトで並べたもの。1局面分を64バイト単位に揃える。
+struct PackedBoardFormat
+{
+	int bit_planes;//ビットで表すチャンネル数
+	int channels;//全チャンネル数
+
+	// 1局面分のバイト数
+	size_t bytes() const;
+	// パック形式のcount局面分(1局面bytes()バイトずつ連続)を、floatの入力行列(1局面channels * 81要素ずつ連続)に展開する
+	void unpack(const uint8_t *packed, size_t count, float *buf) const;
+};
+
 class DNNConverter {
 	int format_board, format_move;
+	bool packed_input;
 	int get_move_index_0(const Position& pos, Move move) const;
 	int get_move_index_1(const Position& pos, Move move) const;
 	Move reverse_move_index_0(const Position& pos, int move_index) const;
 	Move reverse_move_index_1(const Position& pos, int move_index) const;
-	void get_board_array_0(const Position & pos, float *buf) const;
-	void get_board_array_1(const Position & pos, float *buf) const;
+	// 入力行列をWriter(floatの入力行列またはパック形式)に書き込む
+	template <typename Writer> void write_board_0(const Position & pos, Writer &writer) const;
+	template <typename Writer> void write_board_1(const Position & pos, Writer &writer) const;
 public:
-	DNNConverter(int format_board, int format_move);
+	// packed_inputなら、get_board_inputはパック形式で書き込む
+	DNNConverter(int format_board, int format_move, bool packed_input = false);
 	vector<int> board_shape() const;
 	vector<int> move_shape() const;
 	void get_board_array(const Position & pos, float *buf) const;
+	PackedBoardFormat packed_format() const;
+	void get_board_packed(const Position & pos, uint8_t *buf) const;
+	// 探索スレッドがDNNスレッドへ渡す入力(packed_inputならパック形式、そうでなければfloatの入力行列)
+	bool is_packed_input() const { return packed_input; }
+	size_t input_bytes() const;
+	void get_board_input(const Position & pos, void *buf) const;
 	int get_move_index(const Position& pos, Move move) const;
 	Move reverse_move_index(const Position& pos, int move_index) const;
 };
@@ -1,5 +1,6 @@
 ﻿#pragma once
 #include "../../shogi.h"
+#include "mpmc_queue.h"
 
 #ifdef USER_ENGINE_POLICY
 class dnn_table_index
@@ -10,7 +11,7 @@ public:
 #endif
 
 #ifdef USER_ENGINE_MCTS
-#include "mt_queue.h"
+#include "object_pool.h"
 const int MAX_SEARCH_PATH_LENGTH = 64;
 
 class UCTNode;
@@ -21,6 +22,14 @@ public:
 	int path_length;
 	UCTNode* path_indices[MAX_SEARCH_PATH_LENGTH];//path_indices[path_length-1]は新規末端ノード
 	uint16_t path_child_indices[MAX_SEARCH_PATH_LENGTH];//path_child_indices[path_length-1]は無効
+
+	// 使用中の要素だけをコピーする
+	void copy_from(const dnn_table_index &src)
+	{
+		path_length = src.path_length;
+		memcpy(path_indices, src.path_indices, sizeof(path_indices[0]) * src.path_length);
+		memcpy(path_child_indices, src.path_child_indices, sizeof(path_child_indices[0]) * src.path_length);
+	}
 };
 #endif
 
@@ -32,14 +41,30 @@ public:
 	float prob;
 };
 
-class dnn_eval_obj
+class dnn_eval_obj;
+// DNN評価の要求(探索スレッド→DNNスレッド)と結果(DNNスレッド→探索スレッド)を受け渡すキュー
+typedef MPMCQueue<dnn_eval_obj*> DnnEvalQueue;
+
+// DNN評価の要求と結果。探索スレッドごとのプール(DnnEvalObjPool)で使い回す。
+// 入力行列はDNNスレッドへ送るバッチの領域(DnnBatchBufferの行)に直接書き込むので、ここには持たない。
+class alignas(64) dnn_eval_obj
 {
 public:
 	dnn_table_index index;
-	float input_array[119 * 9 * 9];//TODO 盤面表現により変わるので最大サイズでとりあえず確保
 	uint16_t n_moves;
 	dnn_move_index move_indices[MAX_MOVES];
 	float static_value;//局面の静的評価値(-1~1)
-	MTQueue<dnn_eval_obj*> *response_queue;//評価完了時にこのオブジェクトのポインタをputするキュー
+	DnnEvalQueue *response_queue;//評価完了時にこのオブジェクトのポインタをputするキュー
 	bool found_mate;
+#ifdef USER_ENGINE_MCTS
+	// ObjectPoolで管理するためのメンバ
+	dnn_eval_obj *pool_next;
+	ObjectPool<dnn_eval_obj> *pool_owner;
+#endif
 };
+
+#ifdef USER_ENGINE_MCTS
+// dnn_eval_objを確保するプール(探索スレッドごと)。
+// 評価結果は要求したスレッドのresponse_queueに返ってくるので、そのスレッドがbackup後にrecycleで返却する。
+typedef ObjectPool<dnn_eval_obj> DnnEvalObjPool;
+#endif
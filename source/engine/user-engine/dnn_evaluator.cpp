@@ -0,0 +1,67 @@
+﻿#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "dnn_evaluator.h"
+
+struct DnnBackendEntry
+{
+	const char *name;
+	DnnEvaluator *(*create)(const DnnEvaluatorParams &params);
+};
+
+// 先頭がこのビルドでの既定値。TensorRTはDNN_EXTERNAL, DNN_CPUのどちらも定義されていないときだけ組み込まれる。
+static const DnnBackendEntry dnn_backends[] = {
+#if defined(DNN_CPU)
+	{ "cpu", create_cpu_evaluator },
+	{ "external", create_external_evaluator },
+#elif defined(DNN_EXTERNAL)
+	{ "external", create_external_evaluator },
+	{ "cpu", create_cpu_evaluator },
+#else
+	{ "tensorrt", create_tensorrt_evaluator },
+	{ "external", create_external_evaluator },
+	{ "cpu", create_cpu_evaluator },
+#endif
+	{ "mock", create_mock_evaluator },
+};
+
+vector<string> dnn_backend_names()
+{
+	vector<string> names;
+	for (auto &entry : dnn_backends)
+	{
+		names.push_back(entry.name);
+	}
+	return names;
+}
+
+bool dnn_backend_uses_shared_input(const string &backend)
+{
+	return backend == "external" && external_evaluator_uses_shared_memory();
+}
+
+DnnEvaluator *create_dnn_evaluator(const string &backend, const DnnEvaluatorParams &params)
+{
+	for (auto &entry : dnn_backends)
+	{
+		if (backend == entry.name)
+		{
+			return entry.create(params);
+		}
+	}
+	return nullptr;
+}
+
+const float *dnn_input_array(const DnnEvaluatorParams &params, int batch_size, const void *input, std::vector<float> &scratch)
+{
+	if (!params.packed_input)
+	{
+		return (const float*)input;
+	}
+	if (scratch.size() < params.sample_size * batch_size)
+	{
+		scratch.resize(params.sample_size * batch_size);
+	}
+	params.packed_format.unpack((const uint8_t*)input, batch_size, scratch.data());
+	return scratch.data();
+}
+#endif
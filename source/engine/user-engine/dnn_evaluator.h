@@ -0,0 +1,62 @@
+﻿#pragma once
+#include "../../extra/all.h"
+#include "dnn_converter.h"
+
+class SharedMemory;
+
+// DNNスレッドがバッチを評価する方法(評価器)。DNNスレッドごとに1つ作り、そのスレッドからだけ呼ぶ。
+// バッチの受け取り、結果のsoftmax・探索スレッドへの返却はDNNスレッド(dnn_thread.cpp)が共通に行うので、
+// 評価方法を追加するときはこのクラスを実装してcreate_dnn_evaluatorに登録すればよく、探索側の変更は不要。
+class DnnEvaluator
+{
+public:
+	virtual ~DnnEvaluator() {}
+
+	// モデルの読み込み・外部プロセスとの接続等を行う。失敗したら理由を表示してfalseを返す。
+	// DNNスレッドをCPUに固定する前に呼ぶので、子プロセスや計算スレッドを立てる場合はここで立てる(固定を引き継がない)。
+	virtual bool init() = 0;
+
+	// batch_size局面を評価する。inputは1局面input_bytesバイトの入力が連続して並んだもの(DnnEvaluatorParams::packed_inputを参照)。
+	// policyに局面ごとにpolicy_size要素、valueに局面ごとに2要素(勝率=tanh(value[0] - value[1]))を書き出す。失敗したらfalseを返す。
+	virtual bool evaluate(int batch_size, const void *input, float *policy, float *value) = 0;
+
+	// 評価器が出力を自前の領域(共有メモリ等)に書き出す場合は、その領域をpolicy, valueに返してtrueを返す。
+	// 呼び出し側はevaluateのpolicy, valueにその領域を渡し、次のevaluateまでに結果を読み終える。
+	virtual bool output_buffers(float *&policy, float *&value) { return false; }
+};
+
+// 評価器の生成に必要な情報
+struct DnnEvaluatorParams
+{
+	size_t worker_idx;//DNNスレッドの番号
+	int gpu_id;//GPUオプションで指定された番号
+	string eval_dir;
+	size_t sample_size;//1局面の入力行列の要素数(floatに展開したとき)
+	size_t policy_size;//1局面の方策出力の要素数
+	bool packed_input;//入力がパック形式(packed_format)ならtrue、floatの入力行列(sample_size要素)ならfalse
+	PackedBoardFormat packed_format;
+	size_t input_bytes;//1局面の入力のバイト数
+	const SharedMemory *input_memory;//入力の行(DnnBatchBuffer)を共有メモリに置いた場合はその領域、そうでなければnullptr
+};
+
+// このビルドで使える評価方法の名前(DNNBackendオプションの選択肢)。先頭が既定値。
+vector<string> dnn_backend_names();
+// 評価方法backendの評価器が、入力行列の行(DnnBatchBuffer)を共有メモリに置くことを求めるか
+bool dnn_backend_uses_shared_input(const string &backend);
+// 評価方法backendの評価器を作る。backendが使えなければnullptrを返す。
+DnnEvaluator *create_dnn_evaluator(const string &backend, const DnnEvaluatorParams &params);
+// evaluateに渡された入力をfloatの入力行列として返す。パック形式ならscratchに展開する(入力行列を直接読む評価器用)。
+const float *dnn_input_array(const DnnEvaluatorParams &params, int batch_size, const void *input, std::vector<float> &scratch);
+
+// 評価方法ごとの生成関数(dnn_evaluator_*.cpp)
+#if !defined(DNN_EXTERNAL) && !defined(DNN_CPU)
+DnnEvaluator *create_tensorrt_evaluator(const DnnEvaluatorParams &params);
+#endif
+DnnEvaluator *create_external_evaluator(const DnnEvaluatorParams &params);
+bool external_evaluator_uses_shared_memory();
+// 外部プロセスとの入出力の受け渡しにかかる時間を、TCP・共有メモリ(入力をコピー)・共有メモリ(行から直接読む)で、
+// 入力がfloatの入力行列の場合とパック形式の場合について比較する(user dnnxferbench)。
+// 評価プロセスはモデルを実行しない(nenefwd --null-model)ので、GPU・モデルがなくても測定できる。
+void external_transport_bench(const string &evalDir, int gpu_id, int iterations, const vector<int> &batch_sizes);
+DnnEvaluator *create_cpu_evaluator(const DnnEvaluatorParams &params);
+DnnEvaluator *create_mock_evaluator(const DnnEvaluatorParams &params);
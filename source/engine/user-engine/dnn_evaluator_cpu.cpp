@@ -0,0 +1,63 @@
+﻿// GPUを使わず、CPUで評価する。EvalDir/model_cpu.bin(neneshogi/export_cpu_weights.pyで書き出したもの)を読み込む。
+// GPUオプションの要素ごとにDNNスレッドを立て(番号は使わない)、各DNNスレッドがdnn_cpu_threads並列でバッチを評価する。
+// dnn_cpu_int8なら、較正結果EvalDir/model_cpu.calib(user cpucalibで作成)を読み込んで本体の畳み込みを8bitで計算する。
+
+#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "dnn_evaluator.h"
+#include "dnn_thread.h"
+#include "cpu_resnet.h"
+#include <memory>
+
+class CpuEvaluator : public DnnEvaluator
+{
+public:
+	explicit CpuEvaluator(const DnnEvaluatorParams &params) : _params(params)
+	{
+	}
+
+	bool init() override
+	{
+		if (!_net.load(_params.eval_dir + "/model_cpu.bin"))
+		{
+			return false;
+		}
+		if (dnn_cpu_int8 && !_net.load_calibration(_params.eval_dir + "/model_cpu.calib"))
+		{
+			return false;
+		}
+		if ((size_t)_net.input_size() != _params.sample_size || (size_t)_net.policy_size() != _params.policy_size)
+		{
+			sync_cout << "info string model size mismatch input=" << _net.input_size() << " " << _params.sample_size
+				<< " policy=" << _net.policy_size() << " " << _params.policy_size << sync_endl;
+			return false;
+		}
+
+		size_t n_threads = dnn_cpu_threads;
+		if (n_threads == 0)
+		{
+			n_threads = std::max((size_t)std::thread::hardware_concurrency() / std::max(n_gpu_threads, (size_t)1), (size_t)1);
+		}
+		_pool.reset(new CpuWorkerPool((int)n_threads));
+		sync_cout << "info string dnn thread " << _params.worker_idx << " uses " << n_threads << " cpu threads" << sync_endl;
+		return true;
+	}
+
+	bool evaluate(int batch_size, const void *input, float *policy, float *value) override
+	{
+		_net.forward(batch_size, dnn_input_array(_params, batch_size, input, _inputData), policy, value, *_pool);
+		return true;
+	}
+
+private:
+	DnnEvaluatorParams _params;
+	CpuResNet _net;
+	std::unique_ptr<CpuWorkerPool> _pool;
+	std::vector<float> _inputData;//パック形式の入力を展開する領域。バッチをまたいで使い回す
+};
+
+DnnEvaluator *create_cpu_evaluator(const DnnEvaluatorParams &params)
+{
+	return new CpuEvaluator(params);
+}
+#endif
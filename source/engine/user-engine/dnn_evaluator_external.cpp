@@ -0,0 +1,684 @@
+﻿// 外部プロセス(nenefwd)での評価。入出力はソケット(TCP)か、共有メモリ(Linuxのみ)で受け渡す。
+// 入力がパック形式(DNNPackedInput)ならそのまま渡し、nenefwdがfloatの入力行列に展開する。
+
+#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "dnn_evaluator.h"
+#include "dnn_thread.h"
+#include "shared_memory.h"
+#include <chrono>
+#include <memory>
+#include <numeric>
+
+#ifdef _WIN64
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#define SOCKET int
+#define INVALID_SOCKET -1
+#define BOOL int
+#endif
+
+const int port_offset = 25250;
+
+#ifdef _WIN64
+static bool wsa_startup()
+{
+	WSADATA wsaData;
+	int err = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (err != 0)
+	{
+		sync_cout << "info string failed WSAStartup" << sync_endl;
+		return false;
+	}
+	return true;
+}
+#else
+static bool wsa_startup()
+{
+	return true;
+}
+#endif
+
+static SOCKET start_listen(size_t worker_idx, int *port)
+{
+	// portにはポート番号の初期値を設定する。もし使用されていたらインクリメントされ、実際に確保されたポート番号が得られる。
+	SOCKET listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_sock == INVALID_SOCKET)
+	{
+		sync_cout << "info string failed socket worker=" << worker_idx << sync_endl;
+		return INVALID_SOCKET;
+	}
+	// TCP_NODELAYを有効化して、最後のパケットがさっさと出るようにする（効果があるかは不明）
+	int flag = 1;
+	if (setsockopt(listen_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag)) != 0)
+	{
+		sync_cout << "info string failed TCP_NODELAY worker=" << worker_idx << sync_endl;
+		return INVALID_SOCKET;
+	}
+
+	// プロセスを再起動したらすぐポートを再利用できるようにする
+	// -> 生きているプロセスが同じポートをbindしてもエラーにならず、自己対戦に支障
+	//BOOL yes = 1;
+	//setsockopt(listen_sock,
+	//		   SOL_SOCKET, SO_REUSEADDR, (const char *)&yes, sizeof(yes));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+#ifdef _WIN64
+	addr.sin_addr.S_un.S_addr = INADDR_ANY;
+#else
+	addr.sin_addr.s_addr = INADDR_ANY;
+#endif
+	for (int retry = 0; retry < 100; retry++)
+	{
+		addr.sin_port = htons(*port);
+		if (::bind(listen_sock, (struct sockaddr*) & addr, sizeof(addr)) != 0)
+		{
+#ifdef _WIN64
+			int socket_error_code = WSAGetLastError();
+			int addrinuse = WSAEADDRINUSE;
+#else
+			int socket_error_code = errno;
+			int addrinuse = EADDRINUSE;
+#endif
+
+			if (socket_error_code == addrinuse)
+			{
+				// 使用されているポート番号
+				(*port)++;
+				continue;
+			}
+			else
+			{
+				sync_cout << "info string failed bind worker=" << worker_idx << "," << socket_error_code << sync_endl;
+				return INVALID_SOCKET;
+			}
+		}
+
+		if (listen(listen_sock, 1) != 0)
+		{
+#ifdef _WIN64
+			int socket_error_code = WSAGetLastError();
+			int addrinuse = WSAEADDRINUSE;
+#else
+			int socket_error_code = errno;
+			int addrinuse = EADDRINUSE;
+#endif
+
+			if (socket_error_code == addrinuse)
+			{
+				// 使用されているポート番号
+				(*port)++;
+				continue;
+			}
+			else
+			{
+				sync_cout << "info string failed listen worker=" << worker_idx << "," << socket_error_code << sync_endl;
+				return INVALID_SOCKET;
+			}
+		}
+
+		return listen_sock;
+	}
+
+	return INVALID_SOCKET;
+}
+
+static SOCKET do_accept(size_t worker_idx, SOCKET listen_sock)
+{
+	struct sockaddr_in client;
+#ifdef _WIN64
+	int len = sizeof(client);
+#else
+	socklen_t len = sizeof(client);
+#endif
+	SOCKET sock = accept(listen_sock, (struct sockaddr *)&client, &len);
+	if (sock == INVALID_SOCKET)
+	{
+		sync_cout << "info string failed accept worker=" << worker_idx << sync_endl;
+		return INVALID_SOCKET;
+	}
+
+	return sock;
+}
+
+static const int INPUT_COUNT = 119 * 9 * 9;
+static const int INPUT_BYTE_LENGTH = INPUT_COUNT * 4;
+static const int OUTPUT_POLICY_COUNT = 27 * 9 * 9;
+static const int OUTPUT_VALUE_COUNT = 2;
+static const int OUTPUT_COUNT = OUTPUT_POLICY_COUNT + OUTPUT_VALUE_COUNT;
+static const int OUTPUT_BYTE_LENGTH = OUTPUT_COUNT * 4;
+static const int FORMAT_BOARD = 1;
+static const int FORMAT_MOVE = 1;
+
+static bool send_all(SOCKET client_sock, const char *data, int length)
+{
+	int sent_byte_length = 0;
+	while (sent_byte_length < length)
+	{
+		int sent_size = send(client_sock, data + sent_byte_length, length - sent_byte_length, 0);
+		if (sent_size < 0)
+		{
+			return false;
+		}
+		sent_byte_length += sent_size;
+	}
+	return true;
+}
+
+// inputDataはbatch_size局面分の入力(1局面input_bytesバイト)が連続して並んだもの。送信用のバッファにはコピーせず、そのまま送る。
+static bool write_batch(SOCKET client_sock, const void *inputData, size_t input_bytes, int batch_size)
+{
+	if (!send_all(client_sock, (const char *)&batch_size, sizeof(batch_size)))
+	{
+		return false;
+	}
+	return send_all(client_sock, (const char *)inputData, (int)(input_bytes * batch_size));
+}
+
+// 結果は1局面ごとにpolicy(OUTPUT_POLICY_COUNT要素), value(OUTPUT_VALUE_COUNT要素)の順でoutputDataに並べる。
+// outputDataはバッチをまたいで使い回す。
+static bool read_result(SOCKET client_sock, std::vector<float> &outputData)
+{
+	// バッチサイズ取得
+	int batch_size;
+	int batch_size_received_size = 0;
+	// 最悪batch_sizeの4バイトが分割されてしまうこともあるので一応whileで読む
+	while (batch_size_received_size < sizeof(batch_size))
+	{
+		int n = recv(client_sock, ((char *)&batch_size) + batch_size_received_size, sizeof(batch_size) - batch_size_received_size, 0);
+		if (n == 0)
+		{
+			// 正常切断
+			return false;
+		}
+		if (n < 0)
+		{
+			// エラー切断
+			return false;
+		}
+		batch_size_received_size += n;
+	}
+
+	// データを全部バッファに読み込む
+	int expect_byte_length = OUTPUT_BYTE_LENGTH * batch_size;
+	outputData.resize((size_t)OUTPUT_COUNT * batch_size);
+	char *raw_recv_data = (char *)outputData.data();
+	int received_size = 0;
+	while (received_size < expect_byte_length)
+	{
+		int n = recv(client_sock, raw_recv_data + received_size, expect_byte_length - received_size, 0);
+		if (n == 0)
+		{
+			// 正常切断
+			return false;
+		}
+		if (n < 0)
+		{
+			// エラー切断
+			return false;
+		}
+
+		received_size += n;
+	}
+
+	return true;
+}
+
+// ソケットでつながった外部プロセスでの評価
+static bool do_eval(SOCKET client_sock, const void *inputData, size_t input_bytes, int batch_size, std::vector<float> &outputData)
+{
+	if (!write_batch(client_sock, inputData, input_bytes, batch_size))
+	{
+		sync_cout << "info string failed socket write" << sync_endl;
+		return false;
+	}
+	if (!read_result(client_sock, outputData))
+	{
+		sync_cout << "info string failed socket read" << sync_endl;
+		return false;
+	}
+	return true;
+}
+
+static void close_socket(SOCKET sock)
+{
+#ifdef _WIN64
+	closesocket(sock);
+#else
+	close(sock);
+#endif
+}
+
+// 外部プロセスの出力は1局面ごとにpolicy(OUTPUT_POLICY_COUNT要素), value(OUTPUT_VALUE_COUNT要素)で固定
+static bool check_external_format(const DnnEvaluatorParams &params)
+{
+	if (params.policy_size != (size_t)OUTPUT_POLICY_COUNT)
+	{
+		sync_cout << "info string external dnn process supports policy size " << OUTPUT_POLICY_COUNT << " only (DNNFormatMove=1), " << params.policy_size << sync_endl;
+		return false;
+	}
+	return true;
+}
+
+// 入力の形式を指定するnenefwdの引数(パック形式ならビットで表すチャンネル数を渡す)
+static string input_format_args(const DnnEvaluatorParams &params)
+{
+	return params.packed_input ? " --packed " + std::to_string(params.packed_format.bit_planes) : "";
+}
+
+// 評価プロセスを立てる。argsはEvalDir, GPU番号に続くnenefwdの引数。
+// 非常に単純に、system関数を実行するだけのスレッドを立ててしまう。プロセスが終了したらexitedをtrueにする。
+static void spawn_dnn_process(size_t worker_idx, const DnnEvaluatorParams &params, const string &args, std::shared_ptr<std::atomic_bool> exited)
+{
+	string dnn_system_command("");
+#ifdef _WIN64
+	dnn_system_command += "nenefwd";
+#else
+	dnn_system_command += "./nenefwd";
+#endif
+	dnn_system_command += " ";
+	dnn_system_command += params.eval_dir;
+	dnn_system_command += " ";
+	dnn_system_command += std::to_string(params.gpu_id);
+	dnn_system_command += " ";
+	dnn_system_command += args;
+	auto system_thread = std::thread([dnn_system_command, worker_idx, exited] {
+		if (system(dnn_system_command.c_str()) == 0)
+		{
+			sync_cout << "info string exited dnn process " << worker_idx << sync_endl;
+		}
+		else
+		{
+			sync_cout << "info string failed dnn process " << worker_idx << sync_endl;
+		}
+		*exited = true;
+	});
+	system_thread.detach();
+}
+
+class ExternalEvaluator : public DnnEvaluator
+{
+public:
+	// null_modelなら、評価プロセスはモデルを実行せず0を返す(転送速度の測定用)
+	ExternalEvaluator(const DnnEvaluatorParams &params, bool null_model = false)
+		: _params(params), _null_model(null_model), _client_sock(INVALID_SOCKET), _exited(new std::atomic_bool(false))
+	{
+	}
+
+	~ExternalEvaluator()
+	{
+		// 評価プロセスは切断されると終了する
+		if (_client_sock != INVALID_SOCKET)
+		{
+			close_socket(_client_sock);
+		}
+	}
+
+	bool init() override
+	{
+		size_t worker_idx = _params.worker_idx;
+		if (!check_external_format(_params) || !wsa_startup())
+		{
+			return false;
+		}
+
+		// TCP listen開始
+		int port = port_offset + (int)worker_idx;
+		SOCKET listen_sock = start_listen(worker_idx, &port);
+		if (listen_sock == INVALID_SOCKET)
+		{
+			return false;
+		}
+
+		// 子プロセスを立てて接続を待つ
+		spawn_dnn_process(worker_idx, _params, string("127.0.0.1 ") + std::to_string(port) + input_format_args(_params) + (_null_model ? " --null-model" : ""), _exited);
+		_client_sock = do_accept(worker_idx, listen_sock);
+		close_socket(listen_sock);
+		if (_client_sock == INVALID_SOCKET)
+		{
+			return false;
+		}
+		sync_cout << "info string connected from dnn process " << worker_idx << sync_endl;
+		return true;
+	}
+
+	bool evaluate(int batch_size, const void *input, float *policy, float *value) override
+	{
+		if (!do_eval(_client_sock, input, _params.input_bytes, batch_size, _outputData))
+		{
+			return false;
+		}
+		// 局面ごとにpolicy, valueの順で並んでいるのを分ける
+		for (int i = 0; i < batch_size; i++)
+		{
+			const float *output = _outputData.data() + (size_t)i * OUTPUT_COUNT;
+			memcpy(policy + (size_t)i * OUTPUT_POLICY_COUNT, output, sizeof(float) * OUTPUT_POLICY_COUNT);
+			memcpy(value + (size_t)i * OUTPUT_VALUE_COUNT, output + OUTPUT_POLICY_COUNT, sizeof(float) * OUTPUT_VALUE_COUNT);
+		}
+		return true;
+	}
+
+private:
+	DnnEvaluatorParams _params;
+	bool _null_model;
+	SOCKET _client_sock;
+	std::vector<float> _outputData;//バッチをまたいで使い回す
+	std::shared_ptr<std::atomic_bool> _exited;
+};
+
+#ifndef _WIN64
+// 共有メモリでの受け渡し。
+// 評価プロセスごとに、ヘッダ・入力の置き場所・出力の領域からなる共有メモリ(チャンネル)を作り、nenefwdに--shmで渡す。
+// 探索スレッドが入力を書き込む行の領域(DnnBatchBuffer)も共有メモリにあれば--shm-rowsで渡し、評価プロセスはそこから直接読む。
+// 評価プロセスは出力をチャンネルに直接書き込み、DNNスレッドはそこから結果を返す(output_buffers)ので、入出力ともコピーしない。
+// 要求・完了の通知は、ヘッダの通し番号を進めてfutexで起こす。
+static const uint32_t SHM_MAGIC = 0x4d53454e;//"NESM"
+static const uint32_t SHM_VERSION = 2;
+// 共有メモリのチャンネルの先頭に置くヘッダ。nenefwd.py(ShmChannel)と配置を合わせること。
+struct DnnShmHeader
+{
+	uint32_t magic;//SHM_MAGIC
+	uint32_t version;//SHM_VERSION
+	uint32_t sample_size;//1局面の入力行列の要素数(floatに展開したとき)
+	uint32_t policy_size;//1局面の方策出力の要素数
+	uint32_t value_size;//1局面の価値出力の要素数
+	uint32_t max_batch_size;
+	uint32_t engine_pid;//評価プロセスは、このプロセスがなくなったら終了する
+	uint32_t packed_bit_planes;//入力がパック形式ならビットで表すチャンネル数、floatの入力行列なら0
+	uint64_t staging_offset;//入力が行の領域にない場合にコピーする領域(チャンネル先頭からのバイト数)
+	uint64_t policy_offset;//方策の出力の領域
+	uint64_t value_offset;//価値の出力の領域
+	uint32_t input_bytes;//1局面の入力のバイト数
+	uint8_t padding0[4];
+	std::atomic<uint32_t> attached;//評価プロセスがチャンネルを開いたら1にする
+	uint8_t padding1[60];
+	std::atomic<uint32_t> request_seq;//要求を書き込むたびに1進める
+	uint32_t batch_size;//0なら評価プロセスを終了させる
+	uint32_t input_in_rows;//1なら入力は行の領域のinput_offsetバイト目から、0ならstaging_offsetから
+	uint32_t reserved2;
+	uint64_t input_offset;
+	uint8_t padding2[40];
+	std::atomic<uint32_t> response_seq;//評価プロセスが出力を書き込んだら、request_seqと同じ値にする
+	uint32_t status;//0なら成功
+	uint8_t padding3[56];
+};
+static_assert(sizeof(std::atomic<uint32_t>) == 4, "futex word must be 4 bytes");
+static_assert(sizeof(DnnShmHeader) == 256, "DnnShmHeader layout is shared with nenefwd.py");
+
+// 完了を待つ間に空回りする回数(CPUが1つなら空回りせずすぐ眠る)
+static const int SHM_SPIN_COUNT = 4096;
+// 評価プロセスが終了していないか確認する間隔[ms]
+static const int SHM_WAIT_MS = 100;
+
+class ExternalShmEvaluator : public DnnEvaluator
+{
+public:
+	// null_modelなら、評価プロセスはモデルを実行せず0を返す(転送速度の測定用)
+	ExternalShmEvaluator(const DnnEvaluatorParams &params, size_t max_batch_size, bool null_model = false)
+		: _params(params), _max_batch_size(max_batch_size), _null_model(null_model), _header(nullptr), _seq(0), _exited(new std::atomic_bool(false))
+	{
+	}
+
+	~ExternalShmEvaluator()
+	{
+		if (_header && _header->attached.load())
+		{
+			// batch_size = 0の要求で評価プロセスを終了させる(完了は待たない)
+			_header->batch_size = 0;
+			_header->request_seq.store(++_seq, std::memory_order_release);
+			shared_wake(&_header->request_seq);
+		}
+	}
+
+	bool init() override
+	{
+		if (!check_external_format(_params))
+		{
+			return false;
+		}
+		size_t staging_offset = 4096;
+		size_t policy_offset = align_up(staging_offset + _params.input_bytes * _max_batch_size);
+		size_t value_offset = align_up(policy_offset + sizeof(float) * _params.policy_size * _max_batch_size);
+		size_t bytes = align_up(value_offset + sizeof(float) * OUTPUT_VALUE_COUNT * _max_batch_size);
+		if (!_channel.create(bytes))
+		{
+			return false;
+		}
+		_header = new (_channel.data()) DnnShmHeader();
+		_header->magic = SHM_MAGIC;
+		_header->version = SHM_VERSION;
+		_header->sample_size = (uint32_t)_params.sample_size;
+		_header->policy_size = (uint32_t)_params.policy_size;
+		_header->value_size = OUTPUT_VALUE_COUNT;
+		_header->max_batch_size = (uint32_t)_max_batch_size;
+		_header->engine_pid = (uint32_t)getpid();
+		_header->packed_bit_planes = _params.packed_input ? (uint32_t)_params.packed_format.bit_planes : 0;
+		_header->input_bytes = (uint32_t)_params.input_bytes;
+		_header->staging_offset = staging_offset;
+		_header->policy_offset = policy_offset;
+		_header->value_offset = value_offset;
+		_header->attached.store(0);
+		_header->request_seq.store(0);
+		_header->response_seq.store(0);
+		_staging = (char*)_channel.data() + staging_offset;
+		_policy = (float*)((char*)_channel.data() + policy_offset);
+		_value = (float*)((char*)_channel.data() + value_offset);
+
+		string args = "--shm " + _channel.path();
+		if (_params.input_memory)
+		{
+			args += " --shm-rows " + _params.input_memory->path();
+		}
+		if (_null_model)
+		{
+			args += " --null-model";
+		}
+		spawn_dnn_process(_params.worker_idx, _params, args, _exited);
+		if (!wait_for(_header->attached, 1))
+		{
+			sync_cout << "info string dnn process " << _params.worker_idx << " did not attach to shared memory" << sync_endl;
+			return false;
+		}
+		sync_cout << "info string attached dnn process " << _params.worker_idx << " by shared memory"
+			<< (_params.input_memory ? "" : " (input is copied)") << sync_endl;
+		return true;
+	}
+
+	bool output_buffers(float *&policy, float *&value) override
+	{
+		policy = _policy;
+		value = _value;
+		return true;
+	}
+
+	bool evaluate(int batch_size, const void *input, float *policy, float *value) override
+	{
+		if ((size_t)batch_size > _max_batch_size)
+		{
+			sync_cout << "info string batch size " << batch_size << " exceeds shared memory capacity " << _max_batch_size << sync_endl;
+			return false;
+		}
+		size_t input_bytes = _params.input_bytes * batch_size;
+		if (_params.input_memory && _params.input_memory->contains(input, input_bytes))
+		{
+			// 評価プロセスが行の領域から直接読む
+			_header->input_in_rows = 1;
+			_header->input_offset = (uint64_t)((const char*)input - (const char*)_params.input_memory->data());
+		}
+		else
+		{
+			memcpy(_staging, input, input_bytes);
+			_header->input_in_rows = 0;
+			_header->input_offset = 0;
+		}
+		_header->batch_size = (uint32_t)batch_size;
+		uint32_t seq = ++_seq;
+		_header->request_seq.store(seq, std::memory_order_release);
+		shared_wake(&_header->request_seq);
+		if (!wait_for(_header->response_seq, seq))
+		{
+			sync_cout << "info string dnn process " << _params.worker_idx << " exited" << sync_endl;
+			return false;
+		}
+		if (_header->status != 0)
+		{
+			sync_cout << "info string dnn process " << _params.worker_idx << " failed to evaluate, status=" << _header->status << sync_endl;
+			return false;
+		}
+		if (policy != _policy)
+		{
+			memcpy(policy, _policy, sizeof(float) * _params.policy_size * batch_size);
+		}
+		if (value != _value)
+		{
+			memcpy(value, _value, sizeof(float) * OUTPUT_VALUE_COUNT * batch_size);
+		}
+		return true;
+	}
+
+private:
+	static size_t align_up(size_t offset)
+	{
+		return (offset + 63) & ~(size_t)63;
+	}
+
+	// wordがexpectedになるまで待つ。評価プロセスが終了したらfalseを返す。
+	bool wait_for(std::atomic<uint32_t> &word, uint32_t expected)
+	{
+		static const bool multi_core = std::thread::hardware_concurrency() > 1;
+		int spin_count = multi_core ? SHM_SPIN_COUNT : 0;
+		for (int spin = 0; spin < spin_count; spin++)
+		{
+			if (word.load(std::memory_order_acquire) == expected)
+			{
+				return true;
+			}
+		}
+		while (true)
+		{
+			uint32_t current = word.load(std::memory_order_acquire);
+			if (current == expected)
+			{
+				return true;
+			}
+			if (*_exited)
+			{
+				return false;
+			}
+			shared_wait(&word, current, SHM_WAIT_MS);
+		}
+	}
+
+	DnnEvaluatorParams _params;
+	size_t _max_batch_size;
+	bool _null_model;
+	SharedMemory _channel;
+	DnnShmHeader *_header;
+	char *_staging;
+	float *_policy;
+	float *_value;
+	uint32_t _seq;
+	std::shared_ptr<std::atomic_bool> _exited;
+};
+#endif
+
+bool external_evaluator_uses_shared_memory()
+{
+	return dnn_external_shm && SharedMemory::supported();
+}
+
+DnnEvaluator *create_external_evaluator(const DnnEvaluatorParams &params)
+{
+#ifndef _WIN64
+	if (external_evaluator_uses_shared_memory())
+	{
+		return new ExternalShmEvaluator(params, batch_size);
+	}
+#endif
+	return new ExternalEvaluator(params);
+}
+
+// evaluatorでbatch_sizes[i]局面の評価をiterations回ずつ行い、1バッチの往復時間と転送速度を表示する
+static void transport_bench_run(const string &name, DnnEvaluator *evaluator, const void *input, size_t input_bytes, int iterations, const vector<int> &batch_sizes)
+{
+	std::unique_ptr<DnnEvaluator> ev(evaluator);
+	if (!ev->init())
+	{
+		sync_cout << "info string dnnxferbench " << name << " failed to initialize" << sync_endl;
+		return;
+	}
+	int max_batch_size = *std::max_element(batch_sizes.begin(), batch_sizes.end());
+	std::vector<float> policyData((size_t)OUTPUT_POLICY_COUNT * max_batch_size);
+	std::vector<float> valueData((size_t)OUTPUT_VALUE_COUNT * max_batch_size);
+	float *policy = policyData.data(), *value = valueData.data();
+	ev->output_buffers(policy, value);
+	for (int bs : batch_sizes)
+	{
+		// 最初の数回は除く
+		for (int i = 0; i < 3; i++)
+		{
+			ev->evaluate(bs, input, policy, value);
+		}
+		std::vector<double> elapsed_us;
+		for (int i = 0; i < iterations; i++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			if (!ev->evaluate(bs, input, policy, value))
+			{
+				return;
+			}
+			elapsed_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+		}
+		double mean_us = std::accumulate(elapsed_us.begin(), elapsed_us.end(), 0.0) / elapsed_us.size();
+		std::sort(elapsed_us.begin(), elapsed_us.end());
+		double bytes = (double)bs * (input_bytes + sizeof(float) * OUTPUT_COUNT);
+		sync_cout << "info string dnnxferbench " << name << " batch " << bs << " latency " << mean_us << "us (median " << elapsed_us[elapsed_us.size() / 2]
+			<< "us) " << bytes / mean_us << "MB/s" << sync_endl;
+	}
+}
+
+void external_transport_bench(const string &evalDir, int gpu_id, int iterations, const vector<int> &batch_sizes)
+{
+	if (batch_sizes.empty() || iterations <= 0)
+	{
+		return;
+	}
+	int max_batch_size = *std::max_element(batch_sizes.begin(), batch_sizes.end());
+	// 入力はfloatの入力行列とパック形式の両方で測る。パック形式では評価プロセスが展開する時間も含む。
+	DNNConverter converter(FORMAT_BOARD, FORMAT_MOVE);
+	for (int packed = 0; packed < 2; packed++)
+	{
+		DnnEvaluatorParams params;
+		params.worker_idx = 0;
+		params.gpu_id = gpu_id;
+		params.eval_dir = evalDir;
+		params.sample_size = INPUT_COUNT;
+		params.policy_size = OUTPUT_POLICY_COUNT;
+		params.packed_input = packed != 0;
+		params.packed_format = converter.packed_format();
+		params.input_bytes = packed ? params.packed_format.bytes() : INPUT_BYTE_LENGTH;
+		params.input_memory = nullptr;
+		string suffix = packed ? "-packed" : "";
+		std::vector<uint8_t> input(params.input_bytes * max_batch_size);
+		transport_bench_run("tcp" + suffix, new ExternalEvaluator(params, true), input.data(), params.input_bytes, iterations, batch_sizes);
+#ifndef _WIN64
+		// 入力をチャンネルにコピーする場合と、探索スレッドが書き込んだ共有メモリの行から直接読む場合
+		transport_bench_run("shm-copy" + suffix, new ExternalShmEvaluator(params, max_batch_size, true), input.data(), params.input_bytes, iterations, batch_sizes);
+		SharedMemory rows;
+		if (rows.create(input.size()))
+		{
+			params.input_memory = &rows;
+			transport_bench_run("shm" + suffix, new ExternalShmEvaluator(params, max_batch_size, true), rows.data(), params.input_bytes, iterations, batch_sizes);
+		}
+#endif
+	}
+}
+#endif
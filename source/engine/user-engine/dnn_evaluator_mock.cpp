@@ -0,0 +1,82 @@
+﻿// モデルを使わない評価(探索部のベンチマーク・回帰テスト用)。
+// 入力(入力行列またはパック形式)のハッシュを種にした乱数を方策・価値として返すので、同じ局面には常に同じ結果を返す。
+// 1バッチあたりdnn_mock_batch_latency_us + 局面数 * dnn_mock_sample_latency_us[us]かけて評価したように振る舞う。
+
+#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "dnn_evaluator.h"
+#include "dnn_thread.h"
+#include <chrono>
+
+// 方策の出力(ロジット)の範囲は[0, MOCK_POLICY_RANGE)
+static const float MOCK_POLICY_RANGE = 4.0F;
+// 待機の終わりはこれだけ前からsleepせずに待ち、指定された時間に近づける
+static const std::chrono::microseconds MOCK_SPIN_TIME(100);
+
+// 入力(1局面分)のハッシュ。手番・持ち駒を含む局面全体がわかるので、同じ局面なら同じ値になる。
+// パック形式なら展開せずにそのまま計算する。
+static uint64_t hash_input(const void *input, size_t input_bytes)
+{
+	// FNV-1aを4バイト単位で計算する
+	uint64_t h = 14695981039346656037ULL;
+	const uint32_t *words = (const uint32_t *)input;
+	for (size_t i = 0; i < input_bytes / sizeof(uint32_t); i++)
+	{
+		h = (h ^ words[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+// [0, 1)の一様乱数
+static float uniform(PRNG &rng)
+{
+	return (float)(rng.rand<uint64_t>() >> 40) * (1.0F / (float)(1 << 24));
+}
+
+class MockEvaluator : public DnnEvaluator
+{
+public:
+	explicit MockEvaluator(const DnnEvaluatorParams &params) : _params(params)
+	{
+	}
+
+	bool init() override
+	{
+		sync_cout << "info string dnn thread " << _params.worker_idx << " uses mock evaluator latency=" << dnn_mock_batch_latency_us
+			<< "+" << dnn_mock_sample_latency_us << "*n us" << sync_endl;
+		return true;
+	}
+
+	bool evaluate(int batch_size, const void *input, float *policy, float *value) override
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(dnn_mock_batch_latency_us + dnn_mock_sample_latency_us * batch_size);
+		for (int i = 0; i < batch_size; i++)
+		{
+			PRNG rng(hash_input((const uint8_t *)input + (size_t)i * _params.input_bytes, _params.input_bytes) | 1);
+			float *p = policy + (size_t)i * _params.policy_size;
+			for (size_t j = 0; j < _params.policy_size; j++)
+			{
+				p[j] = uniform(rng) * MOCK_POLICY_RANGE;
+			}
+			value[i * 2] = uniform(rng) * 2.0F - 1.0F;
+			value[i * 2 + 1] = 0.0F;
+		}
+
+		// sleepは精度が粗いので、最後は他のスレッドに譲りながら待つ
+		std::this_thread::sleep_until(deadline - MOCK_SPIN_TIME);
+		while (std::chrono::steady_clock::now() < deadline)
+		{
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+private:
+	DnnEvaluatorParams _params;
+};
+
+DnnEvaluator *create_mock_evaluator(const DnnEvaluatorParams &params)
+{
+	return new MockEvaluator(params);
+}
+#endif
@@ -0,0 +1,266 @@
+﻿// TensorRTでGPU評価する。EvalDir/engine.bin, info.bin(user tensorrt_engine_builderで作成)を読み込む。
+
+#include "../../extra/all.h"
+#if defined(USER_ENGINE_MCTS) && !defined(DNN_EXTERNAL) && !defined(DNN_CPU)
+#include "dnn_evaluator.h"
+
+#include "NvInfer.h"
+#include "NvOnnxConfig.h"
+#include "NvOnnxParser.h"
+#include <cuda_runtime_api.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <atomic>
+#include <chrono>
+
+#include "tensorrt/common.h"
+#include "tensorrt/buffers.h"
+#include "dnn_engine_info.h"
+
+static std::string addProfileSuffix(const std::string &name, int profile)
+{
+	std::ostringstream oss;
+	oss << name;
+	if (profile > 0)
+	{
+		oss << " [profile " << profile << "]";
+	}
+
+	return oss.str();
+}
+
+
+class ShogiOnnxExec
+{
+	template <typename T>
+	using SampleUniquePtr = std::unique_ptr<T, samplesCommon::InferDeleter>;
+
+public:
+	DNNEngineInfo engineInfo;
+	ShogiOnnxExec()
+		: mEngine(nullptr)
+	{
+	}
+
+	//!
+	//! \brief Function deserialize the network engine from file
+	//!
+	bool load(const char *evalDir);
+
+	//!
+	//! \brief Runs the TensorRT inference engine for this sample
+	//!
+	//! packedがnullptrでなければ、inputDataはパック形式で、ホスト側の入力バッファに展開してから転送する
+	//!
+	bool infer(int batchSize, const void *inputData, const PackedBoardFormat *packed, float *outputPolicyData, float *outputValueData);
+
+private:
+	std::shared_ptr<nvinfer1::ICudaEngine> mEngine; //!< The TensorRT engine used to run the network
+	std::map<int, std::shared_ptr<nvinfer1::IExecutionContext>> mContextForProfile;
+	nvinfer1::Dims mInputDims;		  //!< The dimensions of the input to the network.
+	nvinfer1::Dims mOutputPolicyDims; //!< The dimensions of the output to the network.
+	nvinfer1::Dims mOutputValueDims;  //!< The dimensions of the output to the network.
+
+	bool processInput(const samplesCommon::BufferManager &buffers, int batchSize, const void *inputData, const PackedBoardFormat *packed);
+	bool processOutput(const samplesCommon::BufferManager &buffers, int batchSize, float *outputPolicyData, float *outputValueData);
+};
+
+bool ShogiOnnxExec::load(const char *evalDir)
+{
+	string engineInfoPath(evalDir);
+	engineInfoPath.append("/info.bin");
+	ifstream engineInfoFile(engineInfoPath, ios::in | ios::binary);
+	engineInfoFile.read((char *)&engineInfo, sizeof(engineInfo));
+	if (!engineInfoFile)
+	{
+		return false;
+	}
+
+	string enginePath(evalDir);
+	enginePath.append("/engine.bin");
+	ifstream serializedModelFile(enginePath, ios::in | ios::binary);
+	std::vector<char> fdata(engineInfo.serializedEngineSize);
+	serializedModelFile.read((char *)fdata.data(), engineInfo.serializedEngineSize);
+	if (!serializedModelFile)
+	{
+		return false;
+	}
+
+	auto runtime = createInferRuntime(gLogger);
+	mEngine = std::shared_ptr<nvinfer1::ICudaEngine>(runtime->deserializeCudaEngine(fdata.data(), engineInfo.serializedEngineSize, nullptr), samplesCommon::InferDeleter());
+
+	mInputDims = Dims4{engineInfo.inputDims[0], engineInfo.inputDims[1], engineInfo.inputDims[2], engineInfo.inputDims[3]};
+	mOutputPolicyDims = Dims2{engineInfo.outputPolicyDims[0], engineInfo.outputPolicyDims[1]};
+	mOutputValueDims = Dims2{engineInfo.outputValueDims[0], engineInfo.outputValueDims[1]};
+
+	// different context for each profile is needed (switching causes error on setBindingDimensions)
+	for (int i = 0; i < mEngine->getNbOptimizationProfiles(); i++)
+	{
+		auto ctx = std::shared_ptr<nvinfer1::IExecutionContext>(mEngine->createExecutionContext(), samplesCommon::InferDeleter());
+		if (!ctx)
+		{
+			return false;
+		}
+		ctx->setOptimizationProfile(i);
+		mContextForProfile[i] = ctx;
+	}
+
+	return true;
+}
+
+//!
+//! \brief Runs the TensorRT inference engine for this sample
+//!
+//! \details This function is the main execution function of the sample. It allocates the buffer,
+//!          sets inputs and executes the engine.
+//!
+bool ShogiOnnxExec::infer(int batchSize, const void *inputData, const PackedBoardFormat *packed, float *outputPolicyData, float *outputValueData)
+{
+	auto mContext = mContextForProfile.at(engineInfo.profileForBatchSize[batchSize]);
+	std::string inputBindingName = addProfileSuffix(engineInfo.inputTensorName, engineInfo.profileForBatchSize[batchSize]);
+	int bidx = mEngine->getBindingIndex(inputBindingName.c_str());
+	mContext->setBindingDimensions(bidx, Dims4{batchSize, engineInfo.inputDims[1], engineInfo.inputDims[2], engineInfo.inputDims[3]});
+	// Create RAII buffer manager object
+	samplesCommon::BufferManager buffers(mEngine, batchSize, mContext.get());
+
+	// Read the input data into the managed buffers
+	if (!processInput(buffers, batchSize, inputData, packed))
+	{
+		return false;
+	}
+
+	// Memcpy from host input buffers to device input buffers
+	buffers.copyInputToDevice();
+
+	bool status = mContext->executeV2(buffers.getDeviceBindings().data());
+	if (!status)
+	{
+		return false;
+	}
+
+	// Memcpy from device output buffers to host output buffers
+	buffers.copyOutputToHost();
+
+	// Read results
+	if (!processOutput(buffers, batchSize, outputPolicyData, outputValueData))
+	{
+		return false;
+	}
+
+	return true;
+}
+
+//!
+//! \brief Reads the input and stores the result in a managed buffer
+//!
+bool ShogiOnnxExec::processInput(const samplesCommon::BufferManager &buffers, int batchSize, const void *inputData, const PackedBoardFormat *packed)
+{
+	std::string inputName = addProfileSuffix(engineInfo.inputTensorName, engineInfo.profileForBatchSize[batchSize]);
+	float *hostDataBuffer = static_cast<float *>(buffers.getHostBuffer(inputName));
+	if (packed)
+	{
+		packed->unpack((const uint8_t *)inputData, batchSize, hostDataBuffer);
+	}
+	else
+	{
+		memcpy(hostDataBuffer, inputData, engineInfo.inputSizePerSample * sizeof(float) * batchSize);
+	}
+	return true;
+}
+
+bool ShogiOnnxExec::processOutput(const samplesCommon::BufferManager &buffers, int batchSize, float *outputPolicyData, float *outputValueData)
+{
+	std::string outputPName = addProfileSuffix(engineInfo.outputPolicyTensorName, engineInfo.profileForBatchSize[batchSize]);
+	float *outputPolicy = static_cast<float *>(buffers.getHostBuffer(outputPName));
+	memcpy(outputPolicyData, outputPolicy, engineInfo.outputPolicySizePerSample * sizeof(float) * batchSize);
+	std::string outputVName = addProfileSuffix(engineInfo.outputValueTensorName, engineInfo.profileForBatchSize[batchSize]);
+	float *outputValue = static_cast<float *>(buffers.getHostBuffer(outputVName));
+	memcpy(outputValueData, outputValue, engineInfo.outputValueSizePerSample * sizeof(float) * batchSize);
+	return true;
+}
+
+// 同じGPUを使うDNNスレッドは、1つのエンジンを排他して使う
+struct TensorRTDevice
+{
+	std::mutex mutex;//同じGPUに対する操作のロック
+	ShogiOnnxExec *runner = nullptr;
+};
+static std::mutex devices_mutex;
+static std::map<int, TensorRTDevice *> devices;
+
+class TensorRTEvaluator : public DnnEvaluator
+{
+public:
+	explicit TensorRTEvaluator(const DnnEvaluatorParams &params) : _params(params), _device(nullptr)
+	{
+	}
+
+	bool init() override
+	{
+		int gpu_id = _params.gpu_id;
+		{
+			std::lock_guard<std::mutex> lock(devices_mutex);
+			// TensorRTから発生するメッセージを抑制(gLogError << "")
+			setReportableSeverity(Logger::Severity::kINTERNAL_ERROR);
+			if (devices.find(gpu_id) == devices.end())
+			{
+				devices[gpu_id] = new TensorRTDevice();
+			}
+			_device = devices[gpu_id];
+		}
+
+		if (cudaSetDevice(gpu_id) != cudaSuccess)
+		{
+			sync_cout << "info string cudaSetDevice failed" << sync_endl;
+			return false;
+		}
+
+		// 最初に初期化したスレッドがエンジンを読み込み、同じGPUの他のスレッドはそれを使う
+		std::lock_guard<std::mutex> lock(_device->mutex);
+		if (_device->runner == nullptr)
+		{
+			ShogiOnnxExec *pRunner = new ShogiOnnxExec();
+			if (!pRunner->load(_params.eval_dir.c_str()))
+			{
+				sync_cout << "info string load failed" << sync_endl;
+				delete pRunner;
+				return false;
+			}
+			_device->runner = pRunner;
+			sync_cout << "info string dnn for gpu " << gpu_id << " initialize ok" << sync_endl;
+		}
+		const DNNEngineInfo &info = _device->runner->engineInfo;
+		if ((size_t)info.inputSizePerSample != _params.sample_size || (size_t)info.outputPolicySizePerSample != _params.policy_size || info.outputValueSizePerSample != 2)
+		{
+			sync_cout << "info string model size mismatch input=" << info.inputSizePerSample << " " << _params.sample_size
+				<< " policy=" << info.outputPolicySizePerSample << " " << _params.policy_size
+				<< " value=" << info.outputValueSizePerSample << sync_endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool evaluate(int batch_size, const void *input, float *policy, float *value) override
+	{
+		std::lock_guard<std::mutex> lock(_device->mutex);
+		return _device->runner->infer(batch_size, input, _params.packed_input ? &_params.packed_format : nullptr, policy, value);
+	}
+
+private:
+	DnnEvaluatorParams _params;
+	TensorRTDevice *_device;
+};
+
+DnnEvaluator *create_tensorrt_evaluator(const DnnEvaluatorParams &params)
+{
+	return new TensorRTEvaluator(params);
+}
+#endif
@@ -2,12 +2,13 @@
 #include "../../extra/all.h"
 #include "dnn_converter.h"
 #include "dnn_eval_obj.h"
+#include "dnn_batch_buffer.h"
 #include <numeric>
 #include <atomic>
 #include <vector>
 #include <functional>
 
-extern vector<MTQueue<dnn_eval_obj*>*> request_queues;
+extern vector<DnnBatchBuffer*> request_queues;
 extern float policy_temperature;
 extern float value_temperature;
 extern float value_scale;
@@ -16,4 +17,14 @@ extern size_t n_gpu_threads;//GPUスレッドの数(GPU数と必ずしも一致
 extern DNNConverter *cvt;
 extern std::atomic_int n_dnn_evaled_samples;
 extern std::atomic_int n_dnn_evaled_batches;
-void start_dnn_threads(string& evalDir, int format_board, int format_move, vector<int>& gpuIds);
+extern std::atomic<uint64_t> n_dnn_busy_us;//DNNスレッドがバッチを受け取ってから結果を返し終わるまでの時間の合計[us]
+extern size_t dnn_cpu_threads;//CPUで評価する場合(DNNBackend=cpu)の、DNNスレッド1つあたりの計算スレッド数(0なら論理CPU数/DNNスレッド数)
+extern bool dnn_cpu_int8;//CPUで評価する場合(DNNBackend=cpu)に、EvalDir/model_cpu.calibを読み込んで8bitで評価するか
+extern int dnn_mock_batch_latency_us;//DNNBackend=mockで、1バッチの評価にかける時間[us]
+extern int dnn_mock_sample_latency_us;//DNNBackend=mockで、1局面ごとに追加でかける時間[us]
+extern bool dnn_external_shm;//外部プロセスで評価する場合(DNNBackend=external)に、TCPではなく共有メモリで入出力を受け渡すか(Linuxのみ)
+extern bool dnn_packed_input;//探索スレッドからDNNスレッド・評価プロセスへ、入力行列をビット単位に詰めた形式(PackedBoardFormat)で渡すか
+// backend(DNNBackendオプション、dnn_evaluator.h)の評価器でDNNスレッドをgpuIdsの要素数だけ立て、初期化が終わるまで待つ
+void start_dnn_threads(const string& backend, string& evalDir, int format_board, int format_move, vector<int>& gpuIds);
+// 評価結果のキュー(DnnEvalQueue)の容量。batch_size, n_gpu_threadsの決定後に呼ぶ。
+size_t dnn_queue_capacity();
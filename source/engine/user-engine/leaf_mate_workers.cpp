@@ -0,0 +1,138 @@
+﻿#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "mcts.h"
+#include "leaf_mate_workers.h"
+#include "numa_memory.h"
+
+LeafMateWorkers::LeafMateWorkers(MCTS *mcts, int n_threads, int max_depth, size_t queue_capacity)
+	: n_submitted(0), n_found(0), n_rejected(0), n_discarded(0), n_busy_us(0),
+	_mcts(mcts), _jobs(queue_capacity), _search_id(0), _n_running(0)
+{
+	for (int i = 0; i < n_threads; i++)
+	{
+		auto ms = new MateEngine::MateSearchForMCTS();
+		// 置換表は詰み探索スレッドのノードに確保する
+		run_on_thread_node(i, [&] { ms->init(16, max_depth); });
+		_searchers.push_back(ms);
+	}
+	for (int i = 0; i < n_threads; i++)
+	{
+		_threads.emplace_back(&LeafMateWorkers::worker_main, this, i);
+	}
+}
+
+LeafMateWorkers::~LeafMateWorkers()
+{
+	// 終了要求を各スレッドに1つずつ積む
+	Job quit_job;
+	quit_job.node = nullptr;
+	for (size_t i = 0; i < _threads.size(); i++)
+	{
+		_jobs.push(quit_job);
+	}
+	for (auto &th : _threads)
+	{
+		th.join();
+	}
+	for (auto ms : _searchers)
+	{
+		delete ms;
+	}
+}
+
+bool LeafMateWorkers::submit(Position &pos, const Move *moves, int n_moves, UCTNode *node)
+{
+	uint32_t search_id = _search_id.load(std::memory_order_relaxed);
+	if (!(search_id & 1) || n_moves > MAX_SEARCH_PATH_LENGTH)
+	{
+		n_rejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	Job job;
+	job.node = node;
+	job.thread = pos.this_thread();
+	job.key = pos.key();
+	job.search_id = search_id;
+	job.n_moves = n_moves;
+	memcpy(job.moves, moves, sizeof(Move) * n_moves);
+	if (!_jobs.try_push(job))
+	{
+		n_rejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	n_submitted.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void LeafMateWorkers::begin_search(const Position &root)
+{
+	n_submitted = 0;
+	n_found = 0;
+	n_rejected = 0;
+	n_discarded = 0;
+	n_busy_us = 0;
+	_root_sfen = root.sfen();
+	_search_id.fetch_add(1);
+}
+
+void LeafMateWorkers::end_search()
+{
+	_search_id.fetch_add(1);
+	// 未処理のジョブのノードは、次の思考までにGCで移動・解放されうるので捨てる
+	Job job;
+	while (_jobs.pop_nb(job))
+	{
+		n_discarded.fetch_add(1, std::memory_order_relaxed);
+	}
+	// 取り出し済みのジョブは、_n_runningを増やした後で_search_idを確認するので、
+	// ここで_n_runningが0なら以後ノードに書き込まれることはない
+	while (_n_running.load() > 0)
+	{
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+void LeafMateWorkers::worker_main(int worker_idx)
+{
+	bind_thread_by_role(THREAD_ROLE_MATE, worker_idx);
+	MateEngine::MateSearchForMCTS *searcher = _searchers[worker_idx];
+	Position pos;
+	StateInfo states[MAX_SEARCH_PATH_LENGTH + 1];
+	std::vector<Move> moves;
+	Job job;
+	while (true)
+	{
+		_jobs.pop(job);
+		if (job.node == nullptr)
+		{
+			break;
+		}
+		_n_running.fetch_add(1);
+		if (_search_id.load() != job.search_id)
+		{
+			// 終了した探索のジョブ
+			n_discarded.fetch_add(1, std::memory_order_relaxed);
+			_n_running.fetch_sub(1);
+			continue;
+		}
+
+		auto job_start = std::chrono::steady_clock::now();
+		pos.set(_root_sfen, &states[0], job.thread);
+		for (int i = 0; i < job.n_moves; i++)
+		{
+			pos.do_move(job.moves[i], states[i + 1]);
+		}
+		moves.clear();
+		// 指し手列が再現できていなければ、別の局面のノードに詰みを書き込まないよう捨てる
+		if (pos.key() == job.key && searcher->dfpn(pos, &moves))
+		{
+			// end_searchは処理中のジョブの完了を待つので、ここではノードはまだ有効
+			_mcts->set_leaf_mate(job.node);
+			n_found.fetch_add(1, std::memory_order_relaxed);
+		}
+		n_busy_us.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - job_start).count(), std::memory_order_relaxed);
+		_n_running.fetch_sub(1);
+	}
+}
+
+#endif // USER_ENGINE_MCTS
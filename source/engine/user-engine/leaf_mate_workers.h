@@ -0,0 +1,74 @@
+﻿#pragma once
+#include "../../shogi.h"
+#ifdef USER_ENGINE_MCTS
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "../../position.h"
+#include "dnn_eval_obj.h"
+#include "mpmc_queue.h"
+
+class MCTS;
+class UCTNode;
+namespace MateEngine { class MateSearchForMCTS; }
+
+// 探索木の末端局面の詰み探索を、探索スレッドとは別の専用スレッドで非同期に行う。
+// 探索スレッドはsubmitで局面を投入するだけで、詰み探索の完了を待たずに探索を続ける。
+// 詰みが見つかったらMCTS::set_leaf_mateでノードを勝ち確定にする。DNN評価の前後どちらに完了してもよい。
+// ジョブのキューは有界で、満杯のときは投入せずに捨てる(詰み探索は補助なので、探索を遅らせない)。
+// 局面はルート局面からの指し手列として固定長のジョブに詰めてロックフリーのキューに積むので、投入時にヒープ確保やmutexは不要。
+// 詰み探索スレッドが眠っているときだけ起こすので、忙しい間は投入側で通知のコストもかからない。
+class LeafMateWorkers
+{
+public:
+	// n_threads: 詰み探索スレッド数, max_depth: 詰み探索の深さ, queue_capacity: キューに積める局面数の上限
+	LeafMateWorkers(MCTS *mcts, int n_threads, int max_depth, size_t queue_capacity);
+	~LeafMateWorkers();
+
+	// 探索スレッドから呼ぶ。posはbegin_searchに渡したルート局面からmoves[0..n_moves)を指した局面で、nodeはそのノード。
+	// キューが満杯か探索中でなければ投入せずfalseを返す。
+	bool submit(Position &pos, const Move *moves, int n_moves, UCTNode *node);
+	// 探索開始時(探索スレッドの起動前)に呼ぶ。rootはこの探索のルート局面。
+	void begin_search(const Position &root);
+	// 探索終了時(全探索スレッドの停止後)に呼ぶ。未処理のジョブを捨て、処理中のジョブの完了を待つ。
+	// 戻った後はノードへの書き込みが起こらないので、置換表のGC等を行ってよい。
+	void end_search();
+
+	// 統計(begin_searchでリセット)
+	std::atomic<uint64_t> n_submitted;//投入したジョブ数
+	std::atomic<uint64_t> n_found;//詰みが見つかったジョブ数
+	std::atomic<uint64_t> n_rejected;//キューが満杯で投入できなかった数
+	std::atomic<uint64_t> n_discarded;//探索終了時に未処理のまま捨てた数
+	std::atomic<uint64_t> n_busy_us;//詰み探索に要した時間の合計[us]
+
+	LeafMateWorkers(const LeafMateWorkers&) = delete;
+	LeafMateWorkers& operator=(const LeafMateWorkers&) = delete;
+
+private:
+	struct Job
+	{
+		// ルート局面からの指し手列で局面を表す(PackedSfenは駒が40枚揃っている局面しか扱えないため)
+		UCTNode *node;//nullptrなら終了要求
+		Thread *thread;//局面を進める際のノード数の加算先(投入した探索スレッド)
+		Key key;//指し手列を再現した局面の検証用
+		uint32_t search_id;//投入時の_search_id。一致しなければ前の探索のジョブなので捨てる
+		int n_moves;
+		Move moves[MAX_SEARCH_PATH_LENGTH];
+	};
+
+	void worker_main(int worker_idx);
+
+	MCTS *_mcts;
+	std::vector<MateEngine::MateSearchForMCTS *> _searchers;
+	std::vector<std::thread> _threads;
+	MPMCQueue<Job> _jobs;
+	// 探索ごとのルート局面(探索中は書き換えない)
+	std::string _root_sfen;
+	// begin_search, end_searchでそれぞれ1増やす。奇数なら探索中
+	std::atomic<uint32_t> _search_id;
+	std::atomic<int> _n_running;//処理中のジョブ数
+};
+
+#endif
@@ -72,9 +72,13 @@ namespace MateEngine
 	static const constexpr char* kMorePreciseMatePv = "MorePreciseMatePv";
 
 
+	bool MateSearchForMCTS::aborted() const {
+		return Threads.stop.load(std::memory_order_relaxed) || (abort_flag && abort_flag->load(std::memory_order_relaxed));
+	}
+
 	// TODO(tanuki-): ネガマックス法的な書き方に変更する
 	void MateSearchForMCTS::DFPNwithTCA(Position& n, uint32_t thpn, uint32_t thdn, bool inc_flag, bool or_node, uint16_t depth, Color root_color) {
-		if (Threads.stop.load(std::memory_order_relaxed)) {
+		if (aborted()) {
 			return;
 		}
 
@@ -83,12 +87,12 @@ namespace MateEngine
 		//	sync_cout << "info string nodes_searched=" << nodes_searched << sync_endl;
 		//}
 
-		auto& entry = transposition_table.LookUp(n, root_color);
+		auto& entry = table().LookUp(n, root_color);
 
 		if (depth > max_depth) {
 			entry.pn = kInfinitePnDn;
 			entry.dn = 0;
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			return;
 		}
 
@@ -98,7 +102,7 @@ namespace MateEngine
 		if (or_node && !n.in_check() && n.mate1ply()) {
 			entry.pn = 0;
 			entry.dn = kInfinitePnDn;
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			return;
 		}
 
@@ -118,12 +122,12 @@ namespace MateEngine
 				// ここは通らないはず
 				entry.pn = 0;
 				entry.dn = kInfinitePnDn;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			}
 			else {
 				entry.pn = kInfinitePnDn;
 				entry.dn = 0;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			}
 			return;
 
@@ -132,13 +136,13 @@ namespace MateEngine
 			if (or_node) {
 				entry.pn = kInfinitePnDn;
 				entry.dn = 0;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			}
 			else {
 				// ここは通らないはず
 				entry.pn = 0;
 				entry.dn = kInfinitePnDn;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			}
 			return;
 
@@ -147,7 +151,7 @@ namespace MateEngine
 			// ここは通らないはず
 			entry.pn = kInfinitePnDn;
 			entry.dn = 0;
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			return;
 
 		default:
@@ -169,16 +173,20 @@ namespace MateEngine
 				entry.dn = kInfinitePnDn;
 			}
 
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
 			return;
 		}
 
 		// minimum distanceを保存する
 		// TODO(nodchip): このタイミングでminimum distanceを保存するのが正しいか確かめる
-		entry.minimum_distance = std::min(entry.minimum_distance, depth);
+		entry.minimum_distance = std::min<uint16_t>(entry.minimum_distance, depth);
+
+		// 最善・次善の子ノードを選ぶ際に手を調べる順序。同点なら先に調べた手が選ばれるので、スレッドごとにずらす。
+		const size_t num_moves = move_picker.size();
+		const size_t move_offset = search_order_seed ? (size_t)((n.key() ^ search_order_seed) % num_moves) : 0;
 
 		bool first_time = true;
-		while (!Threads.stop.load(std::memory_order_relaxed)) {
+		while (!aborted()) {
 			++entry.num_searched;
 
 			// determine whether thpn and thdn are increased.
@@ -191,7 +199,7 @@ namespace MateEngine
 			for (const auto& move : move_picker) {
 				// unproven old childの定義はminimum distanceがこのノードよりも小さいノードだと理解しているのだけど、
 				// 合っているか自信ない
-				const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+				const auto& child_entry = table().LookUpChildEntry(n, move, root_color);
 				if (entry.minimum_distance > child_entry.minimum_distance &&
 					child_entry.pn != kInfinitePnDn &&
 					child_entry.dn != kInfinitePnDn) {
@@ -205,21 +213,21 @@ namespace MateEngine
 				entry.pn = kInfinitePnDn;
 				entry.dn = 0;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
-					entry.pn = std::min(entry.pn, child_entry.pn);
+					const auto& child_entry = table().LookUpChildEntry(n, move, root_color);
+					entry.pn = std::min<uint32_t>(entry.pn, child_entry.pn);
 					entry.dn += child_entry.dn;
 				}
-				entry.dn = std::min(entry.dn, kInfinitePnDn);
+				entry.dn = std::min<uint32_t>(entry.dn, kInfinitePnDn);
 			}
 			else {
 				entry.pn = 0;
 				entry.dn = kInfinitePnDn;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+					const auto& child_entry = table().LookUpChildEntry(n, move, root_color);
 					entry.pn += child_entry.pn;
-					entry.dn = std::min(entry.dn, child_entry.dn);
+					entry.dn = std::min<uint32_t>(entry.dn, child_entry.dn);
 				}
-				entry.pn = std::min(entry.pn, kInfinitePnDn);
+				entry.pn = std::min<uint32_t>(entry.pn, kInfinitePnDn);
 			}
 
 			// if (first time && inc flag) {
@@ -260,8 +268,9 @@ namespace MateEngine
 				uint32_t second_best_pn = kInfinitePnDn;
 				uint32_t best_dn = 0;
 				uint32_t best_num_search = UINT32_MAX;
-				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+				for (size_t i = 0; i < num_moves; ++i) {
+					const auto& move = move_picker.begin()[(i + move_offset) % num_moves];
+					const auto& child_entry = table().LookUpChildEntry(n, move, root_color);
 					if (child_entry.pn < best_pn ||
 						(child_entry.pn == best_pn && best_num_search > child_entry.num_searched)) {
 						second_best_pn = best_pn;
@@ -284,8 +293,9 @@ namespace MateEngine
 				uint32_t second_best_dn = kInfinitePnDn;
 				uint32_t best_pn = 0;
 				uint32_t best_num_search = UINT32_MAX;
-				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+				for (size_t i = 0; i < num_moves; ++i) {
+					const auto& move = move_picker.begin()[(i + move_offset) % num_moves];
+					const auto& child_entry = table().LookUpChildEntry(n, move, root_color);
 					if (child_entry.dn < best_dn ||
 						(child_entry.dn == best_dn && best_num_search > child_entry.num_searched)) {
 						second_best_dn = best_dn;
@@ -336,10 +346,10 @@ namespace MateEngine
 			return true;
 		}
 
-		const auto& entry = transposition_table.LookUp(pos, root_color);
+		const auto& entry = table().LookUp(pos, root_color);
 
 		for (const auto& move : move_picker) {
-			const auto& child_entry = transposition_table.LookUpChildEntry(pos, move, root_color);
+			const auto& child_entry = table().LookUpChildEntry(pos, move, root_color);
 			if (child_entry.pn != 0) {
 				continue;
 			}
@@ -419,10 +429,10 @@ namespace MateEngine
 
 		auto best_num_moves_to_mate = or_node ? INT_MAX : INT_MIN;
 		auto best_move_to_mate = Move::MOVE_NONE;
-		const auto& entry = transposition_table.LookUp(pos, root_color);
+		const auto& entry = table().LookUp(pos, root_color);
 
 		for (const auto& move : move_picker) {
-			const auto& child_entry = transposition_table.LookUpChildEntry(pos, move, root_color);
+			const auto& child_entry = table().LookUpChildEntry(pos, move, root_color);
 			if (child_entry.pn != 0) {
 				continue;
 			}
@@ -463,6 +473,60 @@ namespace MateEngine
 		}
 	}
 
+	// 置換表で証明済み(pn == 0)の王手を手がかりに、詰みを指し手生成で確かめる。
+	// 共有置換表はロックせずにフィールド単位で書き込まれるので、別の局面の値が混ざったエントリが誤った証明に見えることがある。
+	// 攻め側はいずれかの王手で、受け側はすべての応手で詰むことを確認する。
+	// memo 確認中(0)・詰み(1)・不詰または確認失敗(2)を局面のキーごとに記録する
+	bool MateSearchForMCTS::VerifyMate(bool or_node, Position& pos, std::unordered_map<Key, int>& memo, int depth) {
+		auto key = pos.key();
+		auto it = memo.find(key);
+		if (it != memo.end()) {
+			// 確認中の局面に戻った場合はループなので詰みとしない
+			return it->second == 1;
+		}
+		if (depth >= MAX_PLY) {
+			return false;
+		}
+		memo[key] = 0;
+
+		bool mated;
+		if (or_node) {
+			mated = !pos.in_check() && pos.mate1ply() != MOVE_NONE;
+			if (!mated) {
+				Color root_color = pos.side_to_move();
+				MovePicker move_picker(pos, true);
+				for (const auto& move : move_picker) {
+					if (table().LookUpChildEntry(pos, move, root_color).pn != 0) {
+						continue;
+					}
+					StateInfo state_info;
+					pos.do_move(move, state_info);
+					mated = VerifyMate(false, pos, memo, depth + 1);
+					pos.undo_move(move);
+					if (mated) {
+						break;
+					}
+				}
+			}
+		}
+		else {
+			// 応手がなければ詰み
+			mated = true;
+			MovePicker move_picker(pos, false);
+			for (const auto& move : move_picker) {
+				StateInfo state_info;
+				pos.do_move(move, state_info);
+				mated = VerifyMate(true, pos, memo, depth + 1);
+				pos.undo_move(move);
+				if (!mated) {
+					break;
+				}
+			}
+		}
+		memo[key] = mated ? 1 : 2;
+		return mated;
+	}
+
 	void MateSearchForMCTS::get_pv_from_search(Position &pos, std::unordered_map<Key, MateState>& memo, vector<Move> &moves)
 	{
 		// 局面におけるbestmoveで進め、再帰的に詰みまでの筋を収集する
@@ -485,13 +549,25 @@ namespace MateEngine
 			return false;
 		}
 
-		// キャッシュの世代を進める
-		transposition_table.NewSearch();
+		// キャッシュの世代を進める(共有置換表の場合は呼び出し側で進めてある)
+		if (!shared_table) {
+			transposition_table.NewSearch();
+		}
 
 
 		Color root_color = r.side_to_move();
 		DFPNwithTCA(r, kInfinitePnDn, kInfinitePnDn, false, true, 0, root_color);
-		const auto& entry = transposition_table.LookUp(r, root_color);
+		const auto& entry = table().LookUp(r, root_color);
+
+		if (shared_table) {
+			if (aborted() || entry.pn != 0) {
+				return false;
+			}
+			std::unordered_map<Key, int> verified;
+			if (!VerifyMate(true, r, verified, 0)) {
+				return false;
+			}
+		}
 
 #if 1
 		// SearchMatePvMorePreciseを使う版
@@ -519,6 +595,13 @@ namespace MateEngine
 		transposition_table.Resize(hash_size_mb);
 		this->max_depth = max_depth;
 	}
+
+	void MateSearchForMCTS::init_shared(TranspositionTable *table, int max_depth, uint64_t search_order_seed, const std::atomic<bool> *abort_flag) {
+		this->shared_table = table;
+		this->max_depth = max_depth;
+		this->search_order_seed = search_order_seed;
+		this->abort_flag = abort_flag;
+	}
 }
 
 
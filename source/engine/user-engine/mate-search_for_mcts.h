@@ -35,6 +35,10 @@ namespace MateEngine
 			return moves == endMoves;
 		}
 
+		size_t size() const {
+			return endMoves - moves;
+		}
+
 		ExtMove* begin() { return moves; }
 		ExtMove* end() { return endMoves; }
 		const ExtMove* begin() const { return moves; }
@@ -56,25 +60,40 @@ namespace MateEngine
 		// CPUのcache line(1回のメモリアクセスでこのサイズまでCPU cacheに載る)
 		static const constexpr int CacheLineSize = 64;
 
+		// 複数スレッドで共有する置換表では、同じエントリがロックなしで同時に読み書きされる。
+		// データ競合(未定義動作)にならないよう、各フィールドをrelaxedなatomic操作で読み書きする(x86では通常の読み書きと同じ命令になる)。
+		// フィールドごとの読み書きなので、1つのエントリの中に別の局面の値が混ざることはありうる。
+		template <typename T>
+		struct RelaxedAtomic
+		{
+			std::atomic<T> value;
+
+			operator T() const { return value.load(std::memory_order_relaxed); }
+			RelaxedAtomic& operator=(T v) { value.store(v, std::memory_order_relaxed); return *this; }
+			// 読み出しと書き込みが分かれているので、同時に加算すると一方が失われうる(探索ノード数などの目安にしか使わない)
+			RelaxedAtomic& operator+=(T v) { return *this = (T)(*this + v); }
+			RelaxedAtomic& operator++() { return *this += 1; }
+		};
+
 		// 置換表のEntry
 		struct TTEntry
 		{
 			// ハッシュの上位32ビット
-			uint32_t hash_high; // 初期値 : 0
+			RelaxedAtomic<uint32_t> hash_high; // 初期値 : 0
 
 			// TTEntryのインスタンスを作成したタイミングで先端ノードを表すよう1で初期化する
-			uint32_t pn; // 初期値 : 1
-			uint32_t dn; // 初期値 : 1
+			RelaxedAtomic<uint32_t> pn; // 初期値 : 1
+			RelaxedAtomic<uint32_t> dn; // 初期値 : 1
 
 			// このTTEntryに関して探索したnode数(桁数足りてる？)
-			uint32_t num_searched; // 初期値 : 0
+			RelaxedAtomic<uint32_t> num_searched; // 初期値 : 0
 
 			// ルートノードからの最短距離
 			// 初期値を∞として全てのノードより最短距離が長いとみなす
-			uint16_t minimum_distance; // 初期値 : kInfiniteDepth
+			RelaxedAtomic<uint16_t> minimum_distance; // 初期値 : kInfiniteDepth
 
 			// 置換表世代
-			uint16_t generation;
+			RelaxedAtomic<uint16_t> generation;
 
 			// TODO(nodchip): 指し手が1手しかない場合の手を追加する
 
@@ -251,13 +270,26 @@ namespace MateEngine
 	{
 		int max_depth;
 		TranspositionTable transposition_table;
+		// 複数スレッドで共有する置換表(nullptrなら自前のtransposition_tableを使う)
+		TranspositionTable *shared_table = nullptr;
+		// 0以外なら、子ノードの選択で同点の手を調べる順序を局面ごとにずらし、共有置換表を使う他スレッドと別の筋を読む
+		uint64_t search_order_seed = 0;
+		// 他スレッドが詰みを証明した場合に探索を打ち切るためのフラグ(nullptrならThreads.stopのみ見る)
+		const std::atomic<bool> *abort_flag = nullptr;
+		TranspositionTable& table() { return shared_table ? *shared_table : transposition_table; }
+		bool aborted() const;
 		void DFPNwithTCA(Position& n, uint32_t thpn, uint32_t thdn, bool inc_flag, bool or_node, uint16_t depth, Color root_color);
 		bool SearchMatePvFast(bool or_node, Color root_color, Position& pos, std::vector<Move>& moves, std::unordered_set<Key>& visited);
 		int SearchMatePvMorePrecise(bool or_node, Color root_color, Position& pos, std::unordered_map<Key, MateState>& memo);
 		void get_pv_from_search(Position &pos, std::unordered_map<Key, MateState>& memo, vector<Move> &moves);
+		bool VerifyMate(bool or_node, Position& pos, std::unordered_map<Key, int>& memo, int depth);
 	public:
 		bool dfpn(Position& r, std::vector<Move> *moves);
 		void init(int64_t hash_size_mb, int max_depth);
+		// 置換表を複数スレッドで共有して同じ局面を探索する場合の初期化。
+		// 置換表はロックせずにフィールド単位で読み書きするので、詰みを見つけたら指し手生成で確かめてから返す。
+		// 置換表の世代(NewSearch)は、探索開始前に呼び出し側で1回だけ進めること。
+		void init_shared(TranspositionTable *table, int max_depth, uint64_t search_order_seed, const std::atomic<bool> *abort_flag);
 	};
 } // end of namespace
 
@@ -1,25 +1,76 @@
 ﻿#include "../../extra/all.h"
 #ifdef USER_ENGINE_MCTS
 #include "mcts.h"
+#include "numa_memory.h"
+#include "leaf_mate_workers.h"
 
-MCTSTT::MCTSTT(size_t uct_hash_size) :_uct_hash_size(uct_hash_size), _used(0), _obsolete_game_ply(0)
+MCTSTT::MCTSTT(size_t uct_hash_size, size_t children_capacity) :_uct_hash_size(uct_hash_size), _generation(0), _used(0), _obsolete_game_ply(0),
+_children_capacity(children_capacity), _children_used(0)
 {
 	_uct_hash_mask = _uct_hash_size - 1;
+	_max_used = _uct_hash_size / 8 * UCT_HASH_MAX_LOAD_8TH;
 	if (_uct_hash_mask & _uct_hash_size)
 	{
 		// error: cannot use 'throw' with exceptions disabled (linux build)
 		// throw runtime_error("uct_hash_size must be power of 2");
 	}
-	entries = new NodeHashEntry[_uct_hash_size];
-	nodes = new UCTNode[_uct_hash_size];
+	// entries, nodes, 子ノード格納領域を1つのブロックにまとめて確保し、各配列の先頭をキャッシュラインに揃える。
+	// 子ノードの要素数をUCT_CHILDREN_ALIGNの2倍の倍数にしておけば、後ろに並べる各配列の先頭も64バイト境界になる。
+	_children_capacity = (_children_capacity + UCT_CHILDREN_ALIGN * 2 - 1) / (UCT_CHILDREN_ALIGN * 2) * (UCT_CHILDREN_ALIGN * 2);
+	size_t entries_bytes = (sizeof(NodeHashEntry) * _uct_hash_size + 63) & ~(size_t)63;
+	size_t nodes_bytes = (sizeof(UCTNode) * _uct_hash_size + 63) & ~(size_t)63;
+	size_t children_bytes = _children_capacity * child_bytes;
+	_memory_bytes = entries_bytes + nodes_bytes + children_bytes;
+	_memory = large_memory_alloc(_memory_bytes);
+	if (_memory == nullptr)
+	{
+		sync_cout << "info string Error : Failed to allocate " << (_memory_bytes >> 20) << "MB for MCTS hash" << sync_endl;
+		my_exit();
+	}
+	// 確保直後の領域はゼロだが、ページの割り当てとNUMAノードへの配置を探索開始前に済ませておく
+	parallel_first_touch_clear(_memory, _memory_bytes);
+	entries = (NodeHashEntry*)_memory;
+	nodes = (UCTNode*)((char*)_memory + entries_bytes);
+	_value_w = (double*)((char*)_memory + entries_bytes + nodes_bytes);
+	_value_n = (uint32_t*)(_value_w + _children_capacity);
+	_value_vloss = _value_n + _children_capacity;
+	_value_p = (float*)(_value_vloss + _children_capacity);
+	_move_list = (uint16_t*)(_value_p + _children_capacity);
+	_proof = (uint8_t*)(_move_list + _children_capacity);
 	clear();
 }
 
 void MCTSTT::clear()
 {
+	// 世代を進めることで全エントリを未使用とみなす。ノードはエントリ作成時に、子ノード領域は割り当て時に初期化する。
 	_used = 0;
-	memset(entries, 0, sizeof(NodeHashEntry)*_uct_hash_size);
-	memset(nodes, 0, sizeof(UCTNode)*_uct_hash_size);
+	_children_used = 0;
+	_generation++;
+	if (_generation >= NODE_ENTRY_GENERATION_MAX)
+	{
+		// 世代が一周するので、古い世代のエントリが現在の世代と誤認されないようゼロクリアする
+		parallel_first_touch_clear(entries, sizeof(NodeHashEntry) * _uct_hash_size);
+		_generation = 1;
+	}
+}
+
+bool MCTSTT::alloc_children(UCTNode * node, int n_children)
+{
+	size_t alloc_size = ((size_t)n_children + UCT_CHILDREN_ALIGN - 1) / UCT_CHILDREN_ALIGN * UCT_CHILDREN_ALIGN;
+	size_t offset = _children_used.fetch_add(alloc_size);
+	if (offset + alloc_size > _children_capacity)
+	{
+		// 領域不足。_children_usedは容量を超えたままになるが、以降の割り当ても失敗するだけなので問題ない。
+		return false;
+	}
+	// SIMDで割り当て単位ごとに読み込むので、末尾の未使用分も含めて初期化する
+	memset(&_value_n[offset], 0, sizeof(uint32_t) * alloc_size);
+	memset(&_value_vloss[offset], 0, sizeof(uint32_t) * alloc_size);
+	memset(&_value_w[offset], 0, sizeof(double) * alloc_size);
+	memset(&_value_p[offset + n_children], 0, sizeof(float) * (alloc_size - n_children));
+	memset(&_proof[offset], EDGE_PROOF_NONE, sizeof(uint8_t) * alloc_size);
+	node->children_offset = offset;
+	return true;
 }
 
 UCTNode * MCTSTT::find_or_create_entry(const Position & pos, bool & created)
@@ -29,23 +80,61 @@ UCTNode * MCTSTT::find_or_create_entry(const Position & pos, bool & created)
 
 UCTNode * MCTSTT::find_or_create_entry(Key key, int game_ply, bool & created)
 {
+	// 置換表全体のロックなしで複数スレッドから呼ばれてもよいよう、
+	// エントリの確保はflagのCASで行う。
 	size_t orig_index = (size_t)key & _uct_hash_mask;
 	size_t index = orig_index;
 	while (true)
 	{
 		NodeHashEntry *nhe = &entries[index];
-		if (nhe->flag)
+		int flag = nhe->flag.load(std::memory_order_acquire);
+		int state = entry_state(flag);
+		if (state == NODE_ENTRY_EMPTY)
 		{
-			if (nhe->game_ply < _obsolete_game_ply)
+			if (_used >= _max_used)
+			{
+				// 使用率の上限に達しているので新規作成しない
+				return nullptr;
+			}
+			if (nhe->flag.compare_exchange_strong(flag, entry_flag(NODE_ENTRY_WRITING), std::memory_order_acq_rel))
 			{
-				// ここを上書きする
 				nhe->key = key;
 				nhe->game_ply = game_ply;
-
-				created = true;
+				// 以前の世代のノードが残っている可能性があるので初期化
 				memset(&nodes[index], 0, sizeof(UCTNode));
+				nhe->flag.store(entry_flag(NODE_ENTRY_USED), std::memory_order_release);
+				_used++;
+				created = true;
 				return &nodes[index];
 			}
+			// 他スレッドに先に確保された。flagには現在の値が入っている。
+			state = entry_state(flag);
+		}
+		while (state == NODE_ENTRY_WRITING)
+		{
+			// 他スレッドがkeyを書き込み終わるのを待つ
+			std::this_thread::yield();
+			flag = nhe->flag.load(std::memory_order_acquire);
+			state = entry_state(flag);
+		}
+		if (state == NODE_ENTRY_USED)
+		{
+			if (nhe->game_ply < _obsolete_game_ply)
+			{
+				// ここを上書きする
+				if (nhe->flag.compare_exchange_strong(flag, entry_flag(NODE_ENTRY_WRITING), std::memory_order_acq_rel))
+				{
+					nhe->key = key;
+					nhe->game_ply = game_ply;
+					memset(&nodes[index], 0, sizeof(UCTNode));
+					nhe->flag.store(entry_flag(NODE_ENTRY_USED), std::memory_order_release);
+
+					created = true;
+					return &nodes[index];
+				}
+				// 他スレッドが上書き中なので、同じエントリを調べなおす
+				continue;
+			}
 			if (nhe->key == key && nhe->game_ply == game_ply)
 			{
 				created = false;
@@ -53,15 +142,6 @@ UCTNode * MCTSTT::find_or_create_entry(Key key, int game_ply, bool & created)
 			}
 
 		}
-		else
-		{
-			nhe->key = key;
-			nhe->game_ply = game_ply;
-			nhe->flag = true;
-			_used++;
-			created = true;
-			return &nodes[index];
-		}
 		index = (index + 1) & _uct_hash_mask;
 		if (index == orig_index)
 		{
@@ -83,7 +163,13 @@ UCTNode * MCTSTT::find_entry(Key key, int game_ply)
 	while (true)
 	{
 		NodeHashEntry *nhe = &entries[index];
-		if (nhe->flag)
+		int state = entry_state(nhe->flag.load(std::memory_order_acquire));
+		while (state == NODE_ENTRY_WRITING)
+		{
+			std::this_thread::yield();
+			state = entry_state(nhe->flag.load(std::memory_order_acquire));
+		}
+		if (state == NODE_ENTRY_USED)
 		{
 			if (nhe->key == key && nhe->game_ply == game_ply)
 			{
@@ -106,24 +192,150 @@ UCTNode * MCTSTT::find_entry(Key key, int game_ply)
 
 int MCTSTT::get_hashfull() const
 {
-	return (int)(_used * 1000 / _uct_hash_size);
+	int node_full = (int)(std::min((size_t)_used, _max_used) * 1000 / _max_used);
+	int children_full = (int)(std::min((size_t)_children_used, _children_capacity) * 1000 / _children_capacity);
+	return std::max(node_full, children_full);
+}
+
+void MCTSTT::calc_uct_hash_size(int max_size_mb, int max_children, size_t &uct_hash_size, size_t &children_capacity)
+{
+	// 1ノードあたり平均してこの数だけ子ノード領域を使うと想定してノード数を決め、残りを子ノード領域とする。
+	size_t expected_children = (std::min(max_children, EXPECTED_UCT_CHILDREN) + UCT_CHILDREN_ALIGN - 1) / UCT_CHILDREN_ALIGN * UCT_CHILDREN_ALIGN;
+	size_t max_size = (size_t)max_size_mb * 1024 * 1024;
+	uct_hash_size = (size_t)1 << MSB64(max_size / (sizeof(NodeHashEntry) + sizeof(UCTNode) + expected_children * child_bytes));
+	children_capacity = (max_size - uct_hash_size * (sizeof(NodeHashEntry) + sizeof(UCTNode))) / child_bytes;
+}
+
+void MCTSTT::mark_reachable(Position & pos, UCTNode * node, std::vector<bool>& marked)
+{
+	size_t index = node - nodes;
+	if (marked[index])
+	{
+		// 合流により既に到達済み
+		return;
+	}
+	marked[index] = true;
+	UCTChildren ch = children(node);
+	for (int i = 0; i < node->n_children; i++)
+	{
+		Move m = (Move)ch.move_list[i];
+		StateInfo si;
+		pos.do_move(m, si);
+		UCTNode *child_node = find_entry(pos);
+		if (child_node)
+		{
+			mark_reachable(pos, child_node, marked);
+		}
+		pos.undo_move(m);
+	}
 }
 
-size_t MCTSTT::calc_uct_hash_size(int max_size_mb)
+size_t MCTSTT::collect_garbage(Position & pos)
 {
-	size_t hash_size = (size_t)1 << MSB64(((unsigned long long)max_size_mb * 1024 * 1024) / (sizeof(NodeHashEntry) + sizeof(UCTNode)));
-	return hash_size;
+	size_t used_before = _used;
+	UCTNode *root = find_entry(pos);
+	if (root == nullptr)
+	{
+		clear();
+		return used_before;
+	}
+
+	// ルートから到達できるノードに印をつける
+	std::vector<bool> marked(_uct_hash_size);
+	mark_reachable(pos, root, marked);
+
+	// 線形探索の連なりは解放前の空きエントリをまたがないので、後で詰める際はそこを起点にする。
+	// 使用率の上限があるので必ず空きがある。
+	size_t start = 0;
+	while (entry_state(entries[start].flag) == NODE_ENTRY_USED)
+	{
+		start++;
+	}
+
+	// 印のないノードを解放
+	size_t used = 0;
+	for (size_t i = 0; i < _uct_hash_size; i++)
+	{
+		if (entry_state(entries[i].flag) == NODE_ENTRY_USED && !marked[i])
+		{
+			// ノードはエントリ作成時に初期化されるので、エントリを空にするだけでよい
+			entries[i].flag = NODE_ENTRY_EMPTY;
+		}
+		else if (entry_state(entries[i].flag) == NODE_ENTRY_USED)
+		{
+			used++;
+		}
+	}
+
+	// 線形探索の途中に空きができたので、解放前から空きだったエントリの直後から1周して、各エントリを探索開始位置に近い空きへ詰める。
+	// どの連なりもstartをまたがないので、探索開始位置から現在位置までは処理済みの範囲にあり、正しい位置はその間の最初の空きになる。
+	// 移動で空いた位置は、処理済みのエントリの連なりより後ろなので、それらの探索を途切れさせない。
+	// (解放後の最初の空きを起点にすると、末尾から先頭へ回り込む連なりのエントリが処理済みの連なりの途中を空けてしまう)
+	for (size_t step = 1; step < _uct_hash_size; step++)
+	{
+		size_t index = (start + step) & _uct_hash_mask;
+		if (entry_state(entries[index].flag) != NODE_ENTRY_USED)
+		{
+			continue;
+		}
+		for (size_t dst = (size_t)entries[index].key & _uct_hash_mask; dst != index; dst = (dst + 1) & _uct_hash_mask)
+		{
+			if (entry_state(entries[dst].flag) == NODE_ENTRY_EMPTY)
+			{
+				entries[dst].key = entries[index].key;
+				entries[dst].game_ply = entries[index].game_ply;
+				entries[dst].flag = entry_flag(NODE_ENTRY_USED);
+				entries[index].flag = NODE_ENTRY_EMPTY;
+				memcpy(&nodes[dst], &nodes[index], sizeof(UCTNode));
+				break;
+			}
+		}
+	}
+
+	// 子ノード領域を、開始位置の順に前へ詰める。移動先は移動元より前なので、順に処理すれば上書きされない。
+	std::vector<std::pair<size_t, UCTNode*>> alloced;
+	for (size_t i = 0; i < _uct_hash_size; i++)
+	{
+		if (entry_state(entries[i].flag) == NODE_ENTRY_USED && nodes[i].n_children > 0)
+		{
+			alloced.push_back(std::make_pair(nodes[i].children_offset, &nodes[i]));
+		}
+	}
+	std::sort(alloced.begin(), alloced.end());
+	size_t children_used = 0;
+	for (auto &item : alloced)
+	{
+		UCTNode *node = item.second;
+		size_t src = node->children_offset;
+		// 末尾の未使用分も初期化済みの値を保つよう、割り当て単位で移動する
+		size_t n = ((size_t)node->n_children + UCT_CHILDREN_ALIGN - 1) / UCT_CHILDREN_ALIGN * UCT_CHILDREN_ALIGN;
+		if (src != children_used)
+		{
+			memmove(&_move_list[children_used], &_move_list[src], sizeof(uint16_t) * n);
+			memmove(&_value_n[children_used], &_value_n[src], sizeof(uint32_t) * n);
+			memmove(&_value_vloss[children_used], &_value_vloss[src], sizeof(uint32_t) * n);
+			memmove(&_value_w[children_used], &_value_w[src], sizeof(double) * n);
+			memmove(&_value_p[children_used], &_value_p[src], sizeof(float) * n);
+			memmove(&_proof[children_used], &_proof[src], sizeof(uint8_t) * n);
+			node->children_offset = children_used;
+		}
+		children_used += n;
+	}
+
+	_used = used;
+	_children_used = children_used;
+	return used_before - used;
 }
 
 MCTSTT::~MCTSTT()
 {
-	delete[] entries;
-	delete[] nodes;
+	large_memory_free(_memory, _memory_bytes);
 }
 
-MCTS::MCTS(size_t uct_hash_size) :c_puct(1.0), virtual_loss(1)
+MCTS::MCTS(size_t uct_hash_size, size_t children_capacity) :c_puct(1.0), virtual_loss(1), concurrent_tree(true), max_children(MAX_UCT_CHILDREN), n_expand_failed(0),
+measure_lock(false), n_lock_measured(0), lock_wait_ns(0), lock_hold_ns(0)
 {
-	tt = new MCTSTT(uct_hash_size);
+	tt = new MCTSTT(uct_hash_size, children_capacity);
 }
 
 MCTS::~MCTS()
@@ -133,21 +345,111 @@ MCTS::~MCTS()
 
 void MCTS::search(UCTNode * root, Position & pos, MCTSSearchInfo & sei, dnn_eval_obj *eval_info)
 {
-	sei.put_dnn_eval = false;
-	sei.leaf_dup = false;
-	sei.leaf_mate_search_found = false;
-	mutex_.lock();
-	sei.has_tt_lock = true;
-	eval_info->index.path_length = 1;
-	eval_info->index.path_indices[0] = root;
-	search_recursive(root, pos, sei, eval_info);
-	if (sei.has_tt_lock)
+	SearchPathState ps;
+	descend(root, pos, sei, eval_info, ps);
+	ps.rewind(pos, 0);
+}
+
+int MCTS::search_batch(UCTNode * root, Position & pos, MCTSSearchInfo & sei, dnn_eval_obj ** eval_infos, int k)
+{
+	SearchPathState ps;
+	int n_put = 0;
+	sei.n_leaf_dup = 0;
+	sei.n_leaf_mate_search_found = 0;
+	for (int i = 0; i < k; i++)
 	{
-		sei.has_tt_lock = false;
+		descend(root, pos, sei, eval_infos[n_put], ps);
+		if (sei.put_dnn_eval)
+		{
+			n_put++;
+			if (sei.leaf_mate_search_found)
+			{
+				sei.n_leaf_mate_search_found++;
+			}
+		}
+		else if (sei.leaf_dup)
+		{
+			sei.n_leaf_dup++;
+		}
+	}
+	ps.rewind(pos, 0);
+	return n_put;
+}
+
+void MCTS::lock_tree()
+{
+	if (!concurrent_tree)
+	{
+		if (measure_lock)
+		{
+			auto wait_start = std::chrono::steady_clock::now();
+			mutex_.lock();
+			lock_acquired(wait_start);
+		}
+		else
+		{
+			mutex_.lock();
+		}
+	}
+}
+
+void MCTS::unlock_tree()
+{
+	if (!concurrent_tree)
+	{
+		if (measure_lock)
+		{
+			lock_releasing();
+		}
 		mutex_.unlock();
 	}
 }
 
+void MCTS::lock_node(UCTNode * node)
+{
+	if (concurrent_tree)
+	{
+		if (measure_lock)
+		{
+			auto wait_start = std::chrono::steady_clock::now();
+			node->lock.lock();
+			lock_acquired(wait_start);
+		}
+		else
+		{
+			node->lock.lock();
+		}
+	}
+}
+
+void MCTS::unlock_node(UCTNode * node)
+{
+	if (concurrent_tree)
+	{
+		if (measure_lock)
+		{
+			lock_releasing();
+		}
+		node->lock.unlock();
+	}
+}
+
+// ロックの保持を開始した時刻。実際にロックするのは置換表全体かノードの一方だけで、入れ子にはならないので1つでよい。
+static thread_local std::chrono::steady_clock::time_point lock_acquired_at;
+
+void MCTS::lock_acquired(std::chrono::steady_clock::time_point wait_start)
+{
+	lock_acquired_at = std::chrono::steady_clock::now();
+	n_lock_measured.fetch_add(1, std::memory_order_relaxed);
+	lock_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(lock_acquired_at - wait_start).count(), std::memory_order_relaxed);
+}
+
+void MCTS::lock_releasing()
+{
+	auto now = std::chrono::steady_clock::now();
+	lock_hold_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - lock_acquired_at).count(), std::memory_order_relaxed);
+}
+
 
 bool operator<(const dnn_move_index& left, const dnn_move_index& right) {
 	// 確率で降順ソート用
@@ -156,57 +458,98 @@ bool operator<(const dnn_move_index& left, const dnn_move_index& right) {
 
 void MCTS::backup_dnn(dnn_eval_obj * eval_info, bool do_backup)
 {
-	mutex_.lock();//ここはunique_lockを使ってもいい
+	lock_tree();
 	dnn_table_index &path = eval_info->index;
 	// 末端ノードの評価を記録
 	UCTNode &leaf_node = *path.path_indices[path.path_length - 1];
-	leaf_node.evaled = true;
-	// 事前確率でソートし、上位 MAX_UCT_CHILDREN だけ記録
+	// 事前確率でソートし、上位 max_children だけ記録
 	int n_moves_use = eval_info->n_moves;
-	if (n_moves_use > MAX_UCT_CHILDREN)
+	if (n_moves_use > max_children)
 	{
 		std::sort(&eval_info->move_indices[0], &eval_info->move_indices[eval_info->n_moves]);
-		n_moves_use = MAX_UCT_CHILDREN;
+		n_moves_use = max_children;
+	}
+	// 子ノード領域が足りない場合は子ノードなしとし、探索時には静的評価値だけを使う
+	if (!tt->alloc_children(&leaf_node, n_moves_use))
+	{
+		n_moves_use = 0;
 	}
+	float score = eval_info->static_value; // [-1.0, 1.0]
+	lock_node(&leaf_node);
+	UCTChildren ch = tt->children(&leaf_node);
 	for (int i = 0; i < n_moves_use; i++)
 	{
 		dnn_move_index &dmi = eval_info->move_indices[i];
-		leaf_node.move_list[i] = (Move)dmi.move;
-		leaf_node.value_p[i] = dmi.prob;
-		// n, w, qは0初期化されている
+		ch.move_list[i] = dmi.move;
+		ch.value_p[i] = dmi.prob;
+		// n, wは割り当て時に0初期化されている
 	}
 	leaf_node.n_children = n_moves_use;
-	float score = eval_info->static_value; // [-1.0, 1.0]
-	if (eval_info->found_mate)
+	leaf_node.all_children = n_moves_use == eval_info->n_moves;
+	// 非同期の詰み探索が評価より先に詰みを見つけていれば、terminalが立っている
+	bool found_mate = eval_info->found_mate || leaf_node.terminal;
+	if (found_mate)
 	{
 		// この局面からの詰みが見つかっているため、DNNの評価に優先させる
 		leaf_node.terminal = true;
 		score = 1.0;//自分が攻め側
 	}
 	leaf_node.score = score;
+	leaf_node.evaled = true;
+	// 評価待ちの間に到達した経路を取り外す。以降に到達したスレッドは評価済みとして扱う。
+	DupEvalChain *dec = leaf_node.dup_eval_chain;
+	leaf_node.dup_eval_chain = nullptr;
+	unlock_node(&leaf_node);
 
 	if (do_backup)
 	{
-		backup_tree(path, score);
+		backup_tree(path, score, found_mate);
 	}
-	DupEvalChain *dec = leaf_node.dup_eval_chain;
 	while (dec != nullptr)
 	{
 		if (do_backup)
 		{
-			backup_tree(dec->path, score);
+			backup_tree(dec->path, score, found_mate);
 		}
 		DupEvalChain *dec_next = dec->next;
-		delete dec;
+		DupEvalChainPool::release(dec);
 		dec = dec_next;
 	}
-	mutex_.unlock();
+	unlock_tree();
+}
+
+void MCTS::set_leaf_mate(UCTNode * node)
+{
+	lock_tree();
+	lock_node(node);
+	// 既に勝敗が確定していれば、そちらを優先する
+	if (!node->terminal)
+	{
+		node->terminal = true;
+		node->score = 1.0;//自分が攻め側
+	}
+	unlock_node(node);
+	unlock_tree();
 }
 
 UCTNode * MCTS::make_root(Position & pos, MCTSSearchInfo & sei, dnn_eval_obj * eval_info, bool &created)
 {
-	mutex_.lock();
+	lock_tree();
 	UCTNode* root = tt->find_or_create_entry(pos, created);
+	if (root == nullptr)
+	{
+		// NodeGCHashfullでの解放が行われなかったか足りず、置換表が満杯
+		size_t n_freed = tt->collect_garbage(pos);
+		root = tt->find_or_create_entry(pos, created);
+		bool cleared = root == nullptr;
+		if (cleared)
+		{
+			// ルートから到達できるノードだけで満杯
+			tt->clear();
+			root = tt->find_or_create_entry(pos, created);
+		}
+		sync_cout << "info string hash full at root, freed " << n_freed << " nodes" << (cleared ? " and cleared" : "") << sync_endl;
+	}
 	eval_info->index.path_indices[0] = root;
 	eval_info->index.path_length = 1;
 	sei.put_dnn_eval = false;
@@ -225,28 +568,30 @@ UCTNode * MCTS::make_root(Position & pos, MCTSSearchInfo & sei, dnn_eval_obj * e
 		}
 		else
 		{
-			// 詰んでいて評価対象にならない
-			// ルートなのでbackupは不要
-			// TODO
+			// 詰みか宣言勝ちで評価対象にならない
+			// ルートなのでbackupは不要で、勝敗確定とする
+			root->evaled = true;
+			root->terminal = true;
+			root->score = mate_score;
 		}
 	}
 	else
 	{
 		// すでにあったのでそれを返す
 	}
-	mutex_.unlock();
+	unlock_tree();
 	return root;
 }
 
 UCTNode * MCTS::make_root_with_children(Position & pos, MCTSSearchInfo & sei, int &n_put, int max_put)
 {
-	mutex_.lock();
+	lock_tree();
 	for (int i = 0; i < 5; i++)
 	{
 		make_root_with_children_recursive(i, pos, sei, n_put, max_put);
 	}
 	UCTNode* root = tt->find_entry(pos);
-	mutex_.unlock();
+	unlock_tree();
 	return root;
 }
 
@@ -265,7 +610,7 @@ void MCTS::make_root_with_children_recursive(int depth, Position & pos, MCTSSear
 		{
 			// 新規子ノードなので、評価
 			float mate_score;
-			dnn_eval_obj *eval_info = new dnn_eval_obj();
+			dnn_eval_obj *eval_info = sei.eval_obj_pool->alloc();
 			eval_info->index.path_length = 1;
 			eval_info->index.path_indices[0] = node;
 			bool not_mate = enqueue_pos(pos, sei, eval_info, mate_score);
@@ -278,7 +623,7 @@ void MCTS::make_root_with_children_recursive(int depth, Position & pos, MCTSSear
 			else
 			{
 				// 詰んでいて評価対象にならない
-				delete eval_info;
+				sei.eval_obj_pool->recycle(eval_info);
 			}
 		}
 		else
@@ -305,32 +650,55 @@ UCTNode * MCTS::get_root(const Position & pos)
 	return tt->find_entry(pos);
 }
 
+size_t MCTS::collect_garbage(Position & pos)
+{
+	lock_tree();
+	size_t n_freed = tt->collect_garbage(pos);
+	unlock_tree();
+	return n_freed;
+}
+
 Move MCTS::get_bestmove(UCTNode * root, Position & pos, bool policy_only)
 {
-	Move bestMove = MOVE_RESIGN;
-	float bestScore = -1;
-	for (size_t i = 0; i < root->n_children; i++)
+	int best_i = best_child(root, policy_only);
+	return best_i >= 0 ? (Move)tt->children(root).move_list[best_i] : MOVE_RESIGN;
+}
+
+int MCTS::best_child(UCTNode * node, bool policy_only)
+{
+	UCTChildren ch = tt->children(node);
+	int best_i = -1;
+	bool best_lost = true;
+	double best_score = -1;
+	for (int i = 0; i < node->n_children; i++)
 	{
+		if (ch.proof[i] == EDGE_PROOF_WIN)
+		{
+			return i;
+		}
 		// 訪問回数で選択。それで決まらない場合は事前確率(0~1)で決める。
-		float score = policy_only ? root->value_p[i] : root->value_n[i] + root->value_p[i];
-		if (score > bestScore)
+		bool lost = ch.proof[i] == EDGE_PROOF_LOSS;
+		double score = policy_only ? ch.value_p[i] : (double)ch.value_n[i] + ch.value_p[i];
+		if ((best_lost && !lost) || (lost == best_lost && score > best_score))
 		{
-			bestScore = score;
-			bestMove = root->move_list[i];
+			best_i = i;
+			best_lost = lost;
+			best_score = score;
 		}
 	}
-	return bestMove;
+	return best_i;
 }
 
 void MCTS::get_pv(UCTNode * root, Position & pos, std::vector<Move>& pv, float &winrate)
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	lock_tree();
 	get_pv_recursive(root, pos, pv, winrate, true);
+	unlock_tree();
 }
 
 int MCTS::get_hashfull()
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	// 使用エントリ数はatomicなのでロック不要
 	return tt->get_hashfull();
 }
 
@@ -339,190 +707,325 @@ void MCTS::clear()
 	tt->clear();
 }
 
-void MCTS::search_recursive(UCTNode * node, Position & pos, MCTSSearchInfo & sei, dnn_eval_obj *eval_info)
+void MCTS::descend(UCTNode * root, Position & pos, MCTSSearchInfo & sei, dnn_eval_obj *eval_info, SearchPathState &ps)
 {
-	if (eval_info->index.path_length >= MAX_SEARCH_PATH_LENGTH)
-	{
-		// 千日手模様の筋などで起こるかもしれないので一応対策
-		// 引き分けとみなして終了する
-		update_on_terminal(eval_info->index, 0.0);
-		return;
-	}
+	sei.put_dnn_eval = false;
+	sei.leaf_dup = false;
+	sei.leaf_mate_search_found = false;
+	lock_tree();
+	sei.has_tt_lock = !concurrent_tree;
+	dnn_table_index &path = eval_info->index;
+	path.path_length = 1;
+	path.path_indices[0] = root;
+	ps.nodes[0] = root;
 
-	if (node->terminal)
+	// 不変条件: levelのノードに着いた時点で、ps.moves[0..level)はこの経路の手と一致し、ps.depth >= level。
+	// ps.depth > levelのときは前回の選択と共通の経路上にいて、posはこのノードより先まで進んでいる。
+	UCTNode *node = root;
+	while (true)
 	{
-		// 詰みノード
-		// 評価は不要で、親へ評価値を再度伝播する
-		update_on_terminal(eval_info->index, node->score);
-		return;
-	}
+		int level = path.path_length - 1;
+		if (path.path_length >= MAX_SEARCH_PATH_LENGTH)
+		{
+			// 千日手模様の筋などで起こるかもしれないので一応対策
+			// 引き分けとみなして終了する
+			update_on_terminal(path, 0.0);
+			break;
+		}
 
-	if (eval_info->index.path_length > 1) // ルートノード自体を千日手とは判定しない
-	{
-		// 千日手判定。パスに依存するので、ノードには書き込まない。
-		RepetitionState rep_state = pos.is_repetition(pos.game_ply() - eval_info->index.path_length);
-		if (rep_state != RepetitionState::REPETITION_NONE)
+		// 以降、子ノードの選択まではノードのロックを保持する
+		lock_node(node);
+		if (node->terminal)
 		{
-			float score;
-			switch (rep_state)
+			// 勝敗が確定したノード
+			// 評価は不要で、親へ評価値を再度伝播する
+			float score = node->score;
+			unlock_node(node);
+			update_on_terminal(path, score, true);
+			break;
+		}
+
+		// ルートノード自体を千日手とは判定しない
+		// 前回と共通の経路上のノードは、前回の通過時に千日手でないことを確認済み(経路が同じなので結果も同じ)
+		if (level > 0 && ps.depth == level)
+		{
+			// 千日手判定。パスに依存するので、ノードには書き込まない。
+			RepetitionState rep_state = pos.is_repetition(pos.game_ply() - path.path_length);
+			if (rep_state != RepetitionState::REPETITION_NONE)
 			{
-			case REPETITION_WIN:
-			case REPETITION_SUPERIOR:
-				score = 1.0;
-				break;
-			case REPETITION_LOSE:
-			case REPETITION_INFERIOR:
-				score = -1.0;
-				break;
-			default:
-				score = 0.0;
+				unlock_node(node);
+				float score;
+				switch (rep_state)
+				{
+				case REPETITION_WIN:
+				case REPETITION_SUPERIOR:
+					score = 1.0;
+					break;
+				case REPETITION_LOSE:
+				case REPETITION_INFERIOR:
+					score = -1.0;
+					break;
+				default:
+					score = 0.0;
+					break;
+				}
+
+				update_on_terminal(path, score);
 				break;
 			}
+		}
 
-			update_on_terminal(eval_info->index, score);
-			return;
+		if (!node->evaled)
+		{
+			// ノードが評価中だった場合
+			// virtual lossがあるので、評価が終わったときに追加でbackupを呼ぶようにする
+			// link listにつなぐ
+			DupEvalChain *dec = sei.dup_eval_pool->alloc();
+			dec->path.copy_from(path);
+			dec->next = node->dup_eval_chain;
+			node->dup_eval_chain = dec;
+			unlock_node(node);
+			sei.leaf_dup = true;
+			break;
 		}
-	}
 
-	if (!node->evaled)
-	{
-		// ノードが評価中だった場合
-		// virtual lossがあるので、評価が終わったときに追加でbackupを呼ぶようにする
-		// link listにつなぐ
-		DupEvalChain *dec = new DupEvalChain();
-		memcpy(&dec->path, &eval_info->index, sizeof(dnn_table_index));
-		dec->next = node->dup_eval_chain;
-		node->dup_eval_chain = dec;
-		sei.leaf_dup = true;
-		return;
-	}
+		if (node->n_children == 0)
+		{
+			// 子ノード領域の不足で展開できなかったノード
+			// 静的評価値を末端の値として親へ伝播する
+			float score = node->score;
+			unlock_node(node);
+			update_on_terminal(path, score);
+			break;
+		}
 
-	// エッジ選択
-	size_t edge = select_edge(node);
+		// エッジ選択
+		size_t edge = select_edge(node);
 
-	// virtual loss加算
-	node->value_n[edge] += virtual_loss;
-	node->value_n_sum += virtual_loss;
-	node->value_w[edge] -= virtual_loss;
+		// virtual loss加算(回数だけ数え、選択時にvirtual_lossを掛けて反映する)
+		UCTChildren ch = tt->children(node);
+		ch.value_vloss[edge]++;
+		node->vloss_sum++;
 
-	Move m = node->move_list[edge];
-	StateInfo si;
-	pos.do_move(m, si);
+		Move m = (Move)ch.move_list[edge];
+		unlock_node(node);
 
-	// 子ノードを選択するか生成
-	bool created;
-	UCTNode* child_node = tt->find_or_create_entry(pos, created);
-	eval_info->index.path_child_indices[eval_info->index.path_length - 1] = (uint16_t)edge;
-	eval_info->index.path_indices[eval_info->index.path_length] = child_node;
-	eval_info->index.path_length++;
+		// 子ノードを選択するか生成
+		bool created = false;
+		UCTNode* child_node;
+		if (ps.depth > level && ps.moves[level] == m)
+		{
+			// 前回と同じ手なので、局面は進めてあり、子ノードも検索済み
+			child_node = ps.nodes[level + 1];
+		}
+		else
+		{
+			ps.rewind(pos, level);
+			pos.do_move(m, ps.states[level]);
+			ps.moves[level] = m;
+			ps.depth = level + 1;
+			child_node = tt->find_or_create_entry(pos, created);
+			ps.nodes[level + 1] = child_node;
+		}
+		path.path_child_indices[level] = (uint16_t)edge;
+		path.path_indices[level + 1] = child_node;
+		path.path_length++;
 
-	if (created)
-	{
-		// 新規子ノードなので、評価
-		float mate_score;
-		// 行列作成前に置換表ロック開放
-		sei.has_tt_lock = false;
-		mutex_.unlock();
-		bool not_mate = enqueue_pos(pos, sei, eval_info, mate_score);
-		if (not_mate)
+		if (child_node == nullptr)
 		{
-			// 評価待ち
-			// 非同期に処理される
-			sei.put_dnn_eval = true;
+			// 置換表が満杯で子ノードを作成できない
+			// 展開はせず、このエッジのこれまでの平均値(未訪問なら親の静的評価値)を末端の値としてbackupし、既存の木の精度を上げ続ける
+			lock_node(node);
+			uint32_t edge_n = ch.value_n[edge];
+			float edge_q = edge_n > 0 ? (float)(ch.value_w[edge] / edge_n) : node->score;
+			unlock_node(node);
+			n_expand_failed.fetch_add(1, std::memory_order_relaxed);
+			update_on_terminal(path, -edge_q);
+			break;
+		}
 
-			// 詰みがないか探索
-			if (sei.mate_searcher)
+		if (created)
+		{
+			// 新規子ノードなので、評価
+			// 新規作成した直後なので、posはこのノードの局面まで進んでいる
+			float mate_score;
+			// 行列作成前に置換表ロック開放
+			if (sei.has_tt_lock)
+			{
+				sei.has_tt_lock = false;
+				unlock_tree();
+			}
+			bool not_mate = enqueue_pos(pos, sei, eval_info, mate_score);
+			if (not_mate)
 			{
-				std::vector<Move> moves;
-				if (sei.mate_searcher->dfpn(pos, &moves))
+				// 評価待ち
+				// 非同期に処理される
+				sei.put_dnn_eval = true;
+
+				// 詰みがないか探索
+				if (sei.mate_workers)
+				{
+					// 専用スレッドに任せ、結果はset_leaf_mateでノードに反映される
+					sei.mate_workers->submit(pos, ps.moves, ps.depth, child_node);
+				}
+				else if (sei.mate_searcher)
 				{
-					// 詰みがある
-					// DNNの結果の代わりに詰みであるという情報を入れることにする
-					eval_info->found_mate = true;
-					sei.leaf_mate_search_found = true;
+					std::vector<Move> moves;
+					if (sei.mate_searcher->dfpn(pos, &moves))
+					{
+						// 詰みがある
+						// DNNの結果の代わりに詰みであるという情報を入れることにする
+						eval_info->found_mate = true;
+						sei.leaf_mate_search_found = true;
+					}
 				}
 			}
+			else
+			{
+				// 詰んでいて評価対象にならない
+				// 再度置換表をロックし直ちにbackup
+				lock_tree();
+				sei.has_tt_lock = !concurrent_tree;
+				update_on_mate(path, mate_score);
+			}
+			break;
 		}
-		else
-		{
-			// 詰んでいて評価対象にならない
-			// 再度置換表をロックし直ちにbackup
-			mutex_.lock();
-			sei.has_tt_lock = true;
-			update_on_mate(eval_info->index, mate_score);
-		}
+
+		// 子ノードへ進む
+		node = child_node;
 	}
-	else
+
+	if (sei.has_tt_lock)
 	{
-		// 再帰的に探索
-		search_recursive(child_node, pos, sei, eval_info);
+		sei.has_tt_lock = false;
+		unlock_tree();
 	}
-
-	pos.undo_move(m);
 }
 
-void MCTS::backup_tree(dnn_table_index & path, float leaf_score)
+void MCTS::backup_tree(dnn_table_index & path, float leaf_score, bool leaf_proven)
 {
 	float score = leaf_score;
+	bool proven = leaf_proven;//直前に更新した子ノードの勝敗が確定しているか
+	// 直前に更新した子ノードの確定した値(子ノードの手番から見た値)。
+	// 経路の途中のノードが既に確定していれば、この経路のscoreではなくそのノードの値を伝播する。
+	float proven_score = leaf_score;
 
 	// treeをたどり値を更新
 	for (int i = path.path_length - 2; i >= 0; i--)
 	{
 		//score = -score;
 		score = score * -0.99F;//逃げる時はより長い詰み筋、追うときは短い詰み筋を選ぶよう調整
+		proven_score = proven_score * -0.99F;
 		UCTNode &inner_node = *path.path_indices[i];
 		uint16_t edge = path.path_child_indices[i];
-		float new_value_n = inner_node.value_n[edge] + 1 - virtual_loss;
-		inner_node.value_n[edge] = new_value_n;
-		float new_value_w = inner_node.value_w[edge] + score + virtual_loss;
-		inner_node.value_w[edge] = new_value_w;
-		// inner_node.vloss_ctr[edge]--;
-		// inner_node.value_q[edge] = new_value_w / new_value_n;
-		inner_node.value_n_sum += 1 - virtual_loss;
+		lock_node(&inner_node);
+		UCTChildren ch = tt->children(&inner_node);
+		ch.value_n[edge]++;
+		ch.value_w[edge] += score;
+		ch.value_vloss[edge]--;
+		inner_node.value_n_sum++;
+		inner_node.vloss_sum--;
+		if (proven && inner_node.terminal)
+		{
+			// 他の経路で既に勝敗が確定していた。この経路の子ノードの結果によらず、確定済みの値を親へ伝播する。
+			proven_score = inner_node.score;
+		}
+		else if (proven)
+		{
+			// 子ノードの勝敗が確定したので、エッジに記録してこのノードの勝敗が確定するか調べる。
+			// proven_scoreはこのノードの手番から見た値で、勝ちなら正。
+			if (proven_score > 0)
+			{
+				// 勝ちの手が1つあれば勝ち
+				ch.proof[edge] = EDGE_PROOF_WIN;
+				inner_node.terminal = true;
+				inner_node.score = proven_score;
+			}
+			else
+			{
+				// 全合法手が負けなら負け
+				ch.proof[edge] = EDGE_PROOF_LOSS;
+				bool all_lost = inner_node.all_children;
+				for (int j = 0; j < inner_node.n_children && all_lost; j++)
+				{
+					all_lost = ch.proof[j] == EDGE_PROOF_LOSS;
+				}
+				if (all_lost)
+				{
+					inner_node.terminal = true;
+					inner_node.score = proven_score;
+				}
+				else
+				{
+					proven = false;
+				}
+			}
+		}
+		unlock_node(&inner_node);
 	}
 }
 
-void MCTS::update_on_terminal(dnn_table_index & path, float leaf_score)
+void MCTS::update_on_terminal(dnn_table_index & path, float leaf_score, bool leaf_proven)
 {
-	backup_tree(path, leaf_score);
+	backup_tree(path, leaf_score, leaf_proven);
 }
 
 void MCTS::update_on_mate(dnn_table_index & path, float mate_score)
 {
 	// 新規展開ノードがmateだったときの処理
 	UCTNode &leaf_node = *path.path_indices[path.path_length - 1];
+	lock_node(&leaf_node);
 	leaf_node.evaled = true;
 	leaf_node.terminal = true;
 	leaf_node.score = mate_score;
-	backup_tree(path, mate_score);
-
 	// 末端ノードの詰み判定の最中に置換表ロックが外れるので、その間にdup_eval_chainにくっつけられる可能性がある
 	DupEvalChain *dec = leaf_node.dup_eval_chain;
+	leaf_node.dup_eval_chain = nullptr;
+	unlock_node(&leaf_node);
+	backup_tree(path, mate_score, true);
+
 	while (dec != nullptr)
 	{
-		backup_tree(dec->path, mate_score);
+		backup_tree(dec->path, mate_score, true);
 		DupEvalChain *dec_next = dec->next;
-		delete dec;
+		DupEvalChainPool::release(dec);
 		dec = dec_next;
 	}
 }
 
 size_t MCTS::select_edge(UCTNode * node)
 {
-	float n_sum_sqrt = sqrt((float)node->value_n_sum) + 0.001F;//完全に0だと最初の1手が事前確率に沿わなくなる
+	UCTChildren ch = tt->children(node);
+#ifdef USE_AVX2
+	return puct_select_avx2(ch, node->n_children, node->value_n_sum, node->vloss_sum, c_puct, virtual_loss);
+#else
+	return puct_select_scalar(ch, node->n_children, node->value_n_sum, node->vloss_sum, c_puct, virtual_loss);
+#endif
+}
+
+size_t puct_select_scalar(const UCTChildren &ch, int n_children, uint64_t value_n_sum, uint32_t vloss_sum, float c_puct, float virtual_loss)
+{
+	// virtual lossは、評価待ちの回数だけ負けたものとして訪問回数と勝ち数に反映する
+	float n_sum = (float)value_n_sum + vloss_sum * virtual_loss;
+	float n_sum_sqrt = sqrt(n_sum) + 0.001F;//完全に0だと最初の1手が事前確率に沿わなくなる
 	size_t best_index = 0;
 	float best_value = -100.0F;
-	float w_sum = 0.0F;
-	for (size_t i = 0; i < node->n_children; i++)
+	double w_sum = 0.0;
+	for (int i = 0; i < n_children; i++)
 	{
-		w_sum += node->value_w[i];
+		w_sum += ch.value_w[i];
 	}
-	float mean_w = w_sum / node->value_n_sum;//1度も探索してないノードの評価値替わり
-	for (size_t i = 0; i < node->n_children; i++)
+	float mean_w = (float)((w_sum - vloss_sum * virtual_loss) / n_sum);//1度も探索してないノードの評価値替わり
+	for (int i = 0; i < n_children; i++)
 	{
-		float value_n = node->value_n[i];
-		float value_u = node->value_p[i] / (value_n + 1) * c_puct * n_sum_sqrt;
-		float value_q = value_n > 0 ? node->value_w[i] / value_n : mean_w;
+		if (ch.proof[i] == EDGE_PROOF_LOSS)
+		{
+			continue;
+		}
+		float vloss = ch.value_vloss[i] * virtual_loss;
+		float value_n = ch.value_n[i] + vloss;
+		float value_u = ch.value_p[i] / (value_n + 1) * c_puct * n_sum_sqrt;
+		float value_q = value_n > 0 ? (float)((ch.value_w[i] - vloss) / value_n) : mean_w;
 		float value_sum = value_q + value_u;
 		if (value_sum > best_value)
 		{
@@ -534,6 +1037,69 @@ size_t MCTS::select_edge(UCTNode * node)
 	return best_index;
 }
 
+#ifdef USE_AVX2
+size_t puct_select_avx2(const UCTChildren &ch, int n_children, uint64_t value_n_sum, uint32_t vloss_sum, float c_puct, float virtual_loss)
+{
+	// puct_select_scalarと同じ計算を8要素ずつ行う。
+	// 子ノード領域は先頭が揃っていて割り当て単位(UCT_CHILDREN_ALIGN)の末尾まで0初期化されているので、
+	// n_childrenを超えたレーンも読み込んでよく、負けが確定したエッジと同様に選択の対象外とするだけでよい。
+	float n_sum = (float)value_n_sum + vloss_sum * virtual_loss;
+	float n_sum_sqrt = sqrt(n_sum) + 0.001F;//完全に0だと最初の1手が事前確率に沿わなくなる
+
+	// Wの合計(未使用レーンは0なので割り当て単位まで足してよい)
+	__m256d w_acc0 = _mm256_setzero_pd();
+	__m256d w_acc1 = _mm256_setzero_pd();
+	for (int base = 0; base < n_children; base += 8)
+	{
+		w_acc0 = _mm256_add_pd(w_acc0, _mm256_load_pd(&ch.value_w[base]));
+		w_acc1 = _mm256_add_pd(w_acc1, _mm256_load_pd(&ch.value_w[base + 4]));
+	}
+	__m256d w_acc = _mm256_add_pd(w_acc0, w_acc1);
+	__m128d w_acc2 = _mm_add_pd(_mm256_castpd256_pd128(w_acc), _mm256_extractf128_pd(w_acc, 1));
+	double w_sum = _mm_cvtsd_f64(_mm_add_sd(w_acc2, _mm_unpackhi_pd(w_acc2, w_acc2)));
+	float mean_w = (float)((w_sum - vloss_sum * virtual_loss) / n_sum);//1度も探索してないノードの評価値替わり
+
+	const __m256 v_vl = _mm256_set1_ps(virtual_loss);
+	const __m256 v_cu = _mm256_set1_ps(c_puct * n_sum_sqrt);
+	const __m256 v_mean_w = _mm256_set1_ps(mean_w);
+	const __m256 v_one = _mm256_set1_ps(1.0F);
+	const __m256 v_zero = _mm256_setzero_ps();
+	const __m256i v_n_children = _mm256_set1_epi32(n_children);
+	const __m256i v_eight = _mm256_set1_epi32(8);
+	const __m256i v_proof_loss = _mm256_set1_epi32(EDGE_PROOF_LOSS);
+	__m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	// レーンごとの最大値とそのインデックス。同値なら先に現れたものを残す。
+	__m256 best_v = _mm256_set1_ps(-100.0F);
+	__m256i best_i = _mm256_setzero_si256();
+	for (int base = 0; base < n_children; base += 8)
+	{
+		__m256 vloss = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_load_si256((const __m256i*)&ch.value_vloss[base])), v_vl);
+		__m256 value_n = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_load_si256((const __m256i*)&ch.value_n[base])), vloss);
+		__m256 value_w = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_load_pd(&ch.value_w[base + 4])), _mm256_cvtpd_ps(_mm256_load_pd(&ch.value_w[base])));
+		__m256 value_u = _mm256_mul_ps(_mm256_div_ps(_mm256_load_ps(&ch.value_p[base]), _mm256_add_ps(value_n, v_one)), v_cu);
+		__m256 value_q = _mm256_div_ps(_mm256_sub_ps(value_w, vloss), value_n);
+		value_q = _mm256_blendv_ps(v_mean_w, value_q, _mm256_cmp_ps(value_n, v_zero, _CMP_GT_OQ));
+		__m256 value_sum = _mm256_add_ps(value_q, value_u);
+		__m256i lost = _mm256_cmpeq_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&ch.proof[base])), v_proof_loss);
+		__m256 valid = _mm256_castsi256_ps(_mm256_andnot_si256(lost, _mm256_cmpgt_epi32(v_n_children, idx)));
+		__m256 better = _mm256_and_ps(_mm256_cmp_ps(value_sum, best_v, _CMP_GT_OQ), valid);
+		best_v = _mm256_blendv_ps(best_v, value_sum, better);
+		best_i = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(best_i), _mm256_castsi256_ps(idx), better));
+		idx = _mm256_add_epi32(idx, v_eight);
+	}
+
+	// レーン間で最大値を求め、最大値を持つレーンのうちインデックスの最小のものを選ぶ
+	__m256 max_v = _mm256_max_ps(best_v, _mm256_permute2f128_ps(best_v, best_v, 1));
+	max_v = _mm256_max_ps(max_v, _mm256_shuffle_ps(max_v, max_v, _MM_SHUFFLE(1, 0, 3, 2)));
+	max_v = _mm256_max_ps(max_v, _mm256_shuffle_ps(max_v, max_v, _MM_SHUFFLE(2, 3, 0, 1)));
+	__m256i min_i = _mm256_blendv_epi8(_mm256_set1_epi32(INT32_MAX), best_i, _mm256_castps_si256(_mm256_cmp_ps(best_v, max_v, _CMP_EQ_OQ)));
+	min_i = _mm256_min_epi32(min_i, _mm256_permute2x128_si256(min_i, min_i, 1));
+	min_i = _mm256_min_epi32(min_i, _mm256_shuffle_epi32(min_i, _MM_SHUFFLE(1, 0, 3, 2)));
+	min_i = _mm256_min_epi32(min_i, _mm256_shuffle_epi32(min_i, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (size_t)_mm256_cvtsi256_si32(min_i);
+}
+#endif
+
 bool MCTS::enqueue_pos(const Position & pos, MCTSSearchInfo & sei, dnn_eval_obj *eval_info, float & score)
 {
 	if (pos.DeclarationWin() != MOVE_NONE)
@@ -567,9 +1133,12 @@ bool MCTS::enqueue_pos(const Position & pos, MCTSSearchInfo & sei, dnn_eval_obj
 	{
 		eval_info->found_mate = false;
 		eval_info->n_moves = m_i;
-		sei.cvt->get_board_array(pos, eval_info->input_array);
 		eval_info->response_queue = sei.response_queue;
-		sei.request_queue->push(eval_info);
+		// DNNスレッドへ渡すバッチの行を確保して直接書き込む。
+		// 行を確保したまま待つとDNNスレッドがその先のバッチを取り出せないので、書き込んだらすぐに公開する。
+		size_t ticket = sei.request_queue->reserve();
+		sei.cvt->get_board_input(pos, sei.request_queue->row(ticket));
+		sei.request_queue->commit(ticket, eval_info);
 		score = 0.0; //dummy
 		return true;
 	}
@@ -583,26 +1152,22 @@ bool MCTS::enqueue_pos(const Position & pos, MCTSSearchInfo & sei, dnn_eval_obj
 
 void MCTS::get_pv_recursive(UCTNode * node, Position & pos, std::vector<Move>& pv, float & winrate, bool root)
 {
-	if (node->terminal)
+	lock_node(node);
+	UCTChildren ch = tt->children(node);
+	int best_child_i = best_child(node, false);
+	if (root)
 	{
-		if (root)
-		{
-			winrate = node->score;
-		}
-		return;
+		winrate = node->terminal || best_child_i < 0 ? node->score : (float)(ch.value_w[best_child_i] / ch.value_n[best_child_i]);
 	}
-	float best_n = -1;
-	Move bestMove = MOVE_RESIGN;
-	int best_child_i = 0;
-	for (int i = 0; i < node->n_children; i++)
+	// 勝敗が確定したノードでは、子ノードから確定した場合だけ読み筋を続ける(勝ちなら勝ちの手、負けなら訪問回数の多い手)。
+	// ルートでは指し手を決めるため、常に読み筋を続ける。
+	if (best_child_i < 0 || (node->terminal && !root && ch.proof[best_child_i] == EDGE_PROOF_NONE))
 	{
-		if (node->value_n[i] > best_n)
-		{
-			best_n = node->value_n[i];
-			bestMove = node->move_list[i];
-			best_child_i = i;
-		}
+		unlock_node(node);
+		return;
 	}
+	Move bestMove = (Move)ch.move_list[best_child_i];
+	unlock_node(node);
 	if (pos.pseudo_legal(bestMove) && pos.legal(bestMove))
 	{
 		pv.push_back(bestMove);
@@ -620,28 +1185,30 @@ void MCTS::get_pv_recursive(UCTNode * node, Position & pos, std::vector<Move>& p
 		}
 		pos.undo_move(bestMove);
 	}
-	if (root)
-	{
-		winrate = node->value_w[best_child_i] / node->value_n[best_child_i];
-	}
 }
 
-void UCTNode::pprint()
+void MCTS::pprint(UCTNode *node)
 {
+	UCTChildren ch = tt->children(node);
 	sync_cout << "info string node ";
-	if (terminal)
+	if (node->terminal)
 	{
 		cout << "terminal ";
 	}
-	if (!evaled)
+	if (!node->evaled)
 	{
 		cout << "not_evaled ";
 	}
-	cout << "visited " << value_n_sum << " ";
-	cout << "score " << score << " ";
-	for (int i = 0; i < n_children; i++)
+	cout << "visited " << node->value_n_sum << " ";
+	cout << "score " << node->score << " ";
+	for (int i = 0; i < node->n_children; i++)
 	{
-		cout << move_list[i] << " " << value_n[i] << "," << value_w[i] << "," << value_p[i] << " ";
+		cout << (Move)ch.move_list[i] << " " << ch.value_n[i] << "," << ch.value_w[i] << "," << ch.value_p[i];
+		if (ch.proof[i] != EDGE_PROOF_NONE)
+		{
+			cout << (ch.proof[i] == EDGE_PROOF_WIN ? ",win" : ",loss");
+		}
+		cout << " ";
 	}
 	cout << sync_endl;
 }
@@ -1,22 +1,64 @@
-﻿
+﻿#pragma once
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include "../../extra/all.h"
 #include "dnn_eval_obj.h"
+#include "dnn_batch_buffer.h"
 #include "dnn_converter.h"
 #include "mt_queue.h"
 #include "mate-search_for_mcts.h"
+#include "object_pool.h"
 
-// 1ノードに対する探索回数(value_n_sum)の上限値。
-// 勝敗をfloatに蓄積するので、16777216を超えるとインクリメントしても増えなくなる問題が生じ、
-// むしろ探索結果が悪化してしまう。
-#define NODES_LIMIT_MAX 10000000
+class LeafMateWorkers;
+
+// NodeHashEntry::flagの状態(下位2bit)
+const int NODE_ENTRY_EMPTY = 0;//未使用
+const int NODE_ENTRY_WRITING = 1;//他スレッドがkey等を書き込み中
+const int NODE_ENTRY_USED = 2;//使用中
+// NodeHashEntry::flagの上位bitは世代で、置換表の現在の世代と異なるエントリは未使用とみなす。
+const int NODE_ENTRY_STATE_BITS = 2;
+const int NODE_ENTRY_STATE_MASK = (1 << NODE_ENTRY_STATE_BITS) - 1;
+// 世代がこの値に達したら、エントリ全体をゼロクリアして世代1からやり直す
+const int NODE_ENTRY_GENERATION_MAX = 1 << 28;
 
 class NodeHashEntry
 {
 public:
 	Key key;
 	int game_ply;
-	bool flag;
+	std::atomic<int> flag;
+};
+
+// ノード単位のスピンロック。ゼロクリアされた状態が未ロック。
+// 置換表全体をロックしないモードで、ノードの読み書きを保護するのに用いる。
+class NodeSpinLock
+{
+public:
+	void lock()
+	{
+		while (locked_.exchange(true, std::memory_order_acquire))
+		{
+			// ロック保持時間は非常に短いので、しばらく空回りしてから譲る
+			int spin = 0;
+			while (locked_.load(std::memory_order_relaxed))
+			{
+				if (++spin >= 64)
+				{
+					std::this_thread::yield();
+					spin = 0;
+				}
+			}
+		}
+	}
+
+	void unlock()
+	{
+		locked_.store(false, std::memory_order_release);
+	}
+
+private:
+	std::atomic<bool> locked_;
 };
 
 class DupEvalChain
@@ -24,50 +66,151 @@ class DupEvalChain
 public:
 	dnn_table_index path;
 	DupEvalChain *next;
+	// ObjectPoolで管理するためのメンバ
+	DupEvalChain *pool_next;
+	ObjectPool<DupEvalChain> *pool_owner;
 };
 
+// DupEvalChainを確保するプール(探索スレッドごと)
+typedef ObjectPool<DupEvalChain> DupEvalChainPool;
+
 class UCTNode
 {
 public:
-	float value_n_sum;
-	bool terminal;
+	NodeSpinLock lock;//concurrent_treeモードでのみ使用
+	uint64_t value_n_sum;//backup済みの探索回数の合計(virtual lossを含まない)
+	uint32_t vloss_sum;//評価待ちでvirtual lossを加えている回数の合計
+	bool terminal;//勝敗が確定している(scoreはその値)。末端の詰みのほか、子ノードの勝敗から確定した場合も含む。
 	bool evaled;
+	bool all_children;//全合法手を子ノードとして記録している(全子ノードの負けが確定すればこのノードの負けが確定する)
 	DupEvalChain *dup_eval_chain;//複数回評価が呼ばれたとき、ここにリストをつなげて各経路でbackupする。
 	float score;
 	int n_children;
-	Move move_list[MAX_UCT_CHILDREN];
-	float value_n[MAX_UCT_CHILDREN];
-	float value_w[MAX_UCT_CHILDREN];
-	float value_p[MAX_UCT_CHILDREN];
+	size_t children_offset;//子ノード情報の、MCTSTTの子ノード格納領域内での開始位置
+};
 
-	void pprint();
+// ノードの子ノード(エッジ)情報へのアクセス用。
+// 子ノード格納領域はSoA形式で、各配列のchildren_offsetからn_children個がそのノードの子ノード。
+// 訪問回数は整数で持ち、virtual lossはvalue_n/value_wに混ぜずに別に数える。
+struct UCTChildren
+{
+	uint16_t *move_list;
+	uint32_t *value_n;
+	uint32_t *value_vloss;
+	double *value_w;
+	float *value_p;
+	uint8_t *proof;//EDGE_PROOF_*
 };
 
+// 子ノード(エッジ)の勝敗の確定状態。子ノードの勝敗が確定したときにbackupで記録する。
+const uint8_t EDGE_PROOF_NONE = 0;//未確定
+const uint8_t EDGE_PROOF_WIN = 1;//この手で勝ち(子ノードの手番側の負けが確定)
+const uint8_t EDGE_PROOF_LOSS = 2;//この手で負け(子ノードの手番側の勝ちが確定)。選択の対象外とする。
+
+// 子ノード格納領域で、各ノードの先頭位置をこの要素数の倍数に揃える(float配列でキャッシュライン単位になる)
+// 割り当てもこの単位で行い、n_childrenを超える末尾は0で初期化しておく(SIMDでまとめて読むため)
+const size_t UCT_CHILDREN_ALIGN = 16;
+
+// PUCTに従い次に探索する子ノードのインデックスを選択する(MCTS::select_edgeの実装)。
+// ベンチマークで比較するため、スカラー版とAVX2版を公開している。
+size_t puct_select_scalar(const UCTChildren &ch, int n_children, uint64_t value_n_sum, uint32_t vloss_sum, float c_puct, float virtual_loss);
+#ifdef USE_AVX2
+size_t puct_select_avx2(const UCTChildren &ch, int n_children, uint64_t value_n_sum, uint32_t vloss_sum, float c_puct, float virtual_loss);
+#endif
+// 置換表サイズ決定時に想定する、1ノードあたりの子ノード数
+const int EXPECTED_UCT_CHILDREN = 16;
+// 新規ノードを作成する使用率の上限(分数の分子、分母は8)。線形探索が長くなりすぎないよう、満杯になる手前で作成を止める。
+const size_t UCT_HASH_MAX_LOAD_8TH = 7;
+
 // MCTS用置換表
 class MCTSTT
 {
 public:
-	MCTSTT(size_t uct_hash_size);
+	MCTSTT(size_t uct_hash_size, size_t children_capacity);
 	~MCTSTT();
 	void clear();
 	UCTNode* find_or_create_entry(const Position &pos, bool &created);
 	UCTNode* find_or_create_entry(Key key, int game_ply, bool &created);
 	UCTNode* find_entry(const Position &pos);
 	UCTNode* find_entry(Key key, int game_ply);
-	// ハッシュの使用率を千分率で返す
+	// ノードにn_children個の子ノード領域を割り当てる。領域が足りない場合はfalseを返す。
+	bool alloc_children(UCTNode *node, int n_children);
+	UCTChildren children(const UCTNode *node) const
+	{
+		size_t offset = node->children_offset;
+		return UCTChildren{ &_move_list[offset], &_value_n[offset], &_value_vloss[offset], &_value_w[offset], &_value_p[offset], &_proof[offset] };
+	}
+	// ハッシュの使用率を千分率で返す(ノードと子ノード領域のうち使用率が高いほう)
+	// ノードは新規作成できる上限に対する割合なので、1000のときはそれ以上展開できない。
 	int get_hashfull() const;
-	// max_size_mbで与えた上限を超えない範囲で、2のべき乗のハッシュサイズを決定する。
-	static size_t calc_uct_hash_size(int max_size_mb);
+	// posから到達できるノードだけを残して、それ以外のノードと子ノード領域を解放する。
+	// ノードの位置が移動するので、探索スレッドが停止していて、評価待ちのノードがないときに呼ぶこと。
+	// posのノードがなければ全体をクリアする。解放したノード数を返す。
+	size_t collect_garbage(Position &pos);
+	// max_size_mbで与えた上限を超えない範囲で、2のべき乗のハッシュサイズと子ノード領域の要素数を決定する。
+	static void calc_uct_hash_size(int max_size_mb, int max_children, size_t &uct_hash_size, size_t &children_capacity);
+	// 子ノード1個あたりのバイト数
+	static const size_t child_bytes = sizeof(uint16_t) + sizeof(uint32_t) * 2 + sizeof(double) + sizeof(float) + sizeof(uint8_t);
 
 private:
 	size_t _uct_hash_size;
 	size_t _uct_hash_mask;
+	// 現在の世代。clear()で進める。
+	int _generation;
 	// 使用中のエントリ数
-	size_t _used;
+	std::atomic_size_t _used;
+	// 新規作成できるエントリ数の上限
+	size_t _max_used;
 	//この値未満の手数のエントリーはもう使われないとみなし、新規ノード作成時に上書きできる
 	int _obsolete_game_ply;
 	NodeHashEntry *entries;
 	UCTNode *nodes;
+	// 子ノード格納領域
+	size_t _children_capacity;
+	std::atomic_size_t _children_used;
+	// entries, nodes, 子ノード格納領域をまとめて確保したメモリ
+	void *_memory;
+	size_t _memory_bytes;
+	uint16_t *_move_list;
+	uint32_t *_value_n;
+	uint32_t *_value_vloss;
+	double *_value_w;
+	float *_value_p;
+	uint8_t *_proof;
+
+	void mark_reachable(Position &pos, UCTNode *node, std::vector<bool> &marked);
+	// flagの値から、現在の世代でのエントリの状態を得る
+	int entry_state(int flag) const
+	{
+		return (flag >> NODE_ENTRY_STATE_BITS) == _generation ? (flag & NODE_ENTRY_STATE_MASK) : NODE_ENTRY_EMPTY;
+	}
+	// 現在の世代で、指定した状態を表すflagの値
+	int entry_flag(int state) const
+	{
+		return (_generation << NODE_ENTRY_STATE_BITS) | state;
+	}
+};
+
+// 探索経路上の局面の状態。
+// 連続する探索で前回と共通の経路を通る間は、前回のdo_moveの結果と子ノードの検索結果をそのまま使う。
+struct SearchPathState
+{
+	int depth;//posに適用済みの手数
+	Move moves[MAX_SEARCH_PATH_LENGTH];
+	UCTNode *nodes[MAX_SEARCH_PATH_LENGTH + 1];//nodes[i+1]はmoves[i]を指した後のノード
+	StateInfo states[MAX_SEARCH_PATH_LENGTH];
+
+	SearchPathState() : depth(0) {}
+
+	// posに適用済みの手をto_depth手目まで戻す
+	void rewind(Position &pos, int to_depth)
+	{
+		while (depth > to_depth)
+		{
+			depth--;
+			pos.undo_move(moves[depth]);
+		}
+	}
 };
 
 class MCTSSearchInfo
@@ -81,13 +224,22 @@ public:
 	bool leaf_dup;
 	// 末端での詰み探索の結果、詰みだった（局面そのものが詰んでいるのとは異なる）
 	bool leaf_mate_search_found;
+	// search_batchでの、leaf_dup, leaf_mate_search_foundとなった探索の回数
+	int n_leaf_dup;
+	int n_leaf_mate_search_found;
 	DNNConverter *cvt;
-	MTQueue<dnn_eval_obj*> *request_queue;
-	MTQueue<dnn_eval_obj*> *response_queue;
+	DnnBatchBuffer *request_queue;
+	DnnEvalQueue *response_queue;
 	MateEngine::MateSearchForMCTS *mate_searcher;
+	// 末端の詰み探索を非同期に行う場合の投入先。指定時はmate_searcherより優先する。
+	LeafMateWorkers *mate_workers;
+	// 評価待ちのノードに到達した経路を記録するDupEvalChainの確保元。探索(search)を行う場合は必須。
+	DupEvalChainPool *dup_eval_pool;
+	// MCTS内部でdnn_eval_objを確保する場合(make_root_with_children)の確保元
+	DnnEvalObjPool *eval_obj_pool;
 
-	MCTSSearchInfo(DNNConverter *cvt, MTQueue<dnn_eval_obj*> *request_queue, MTQueue<dnn_eval_obj*> *response_queue, MateEngine::MateSearchForMCTS *mate_searcher)
-		: cvt(cvt), request_queue(request_queue), response_queue(response_queue), has_tt_lock(false), put_dnn_eval(false), leaf_dup(false), mate_searcher(mate_searcher)
+	MCTSSearchInfo(DNNConverter *cvt, DnnBatchBuffer *request_queue, DnnEvalQueue *response_queue, MateEngine::MateSearchForMCTS *mate_searcher, DupEvalChainPool *dup_eval_pool = nullptr, DnnEvalObjPool *eval_obj_pool = nullptr, LeafMateWorkers *mate_workers = nullptr)
+		: cvt(cvt), request_queue(request_queue), response_queue(response_queue), has_tt_lock(false), put_dnn_eval(false), leaf_dup(false), n_leaf_dup(0), n_leaf_mate_search_found(0), mate_searcher(mate_searcher), mate_workers(mate_workers), dup_eval_pool(dup_eval_pool), eval_obj_pool(eval_obj_pool)
 	{
 	}
 };
@@ -96,37 +248,77 @@ public:
 class MCTS
 {
 public:
-	MCTS(size_t uct_hash_size);
+	MCTS(size_t uct_hash_size, size_t children_capacity);
 	~MCTS();
 	void search(UCTNode *root, Position &pos, MCTSSearchInfo &sei, dnn_eval_obj *eval_info);
+	// rootからの選択をk回まとめて行い、DNN評価が必要な末端局面を評価に回す。
+	// eval_infosにはk個のオブジェクトを与える。評価に回したものは先頭に詰められ、その個数を返す。残りは未使用。
+	// 前回の選択と共通の経路は、局面の進め直しと置換表の検索を省略する。
+	int search_batch(UCTNode *root, Position &pos, MCTSSearchInfo &sei, dnn_eval_obj **eval_infos, int k);
 	// DNNの結果が得られた際のbackup処理
 	void backup_dnn(dnn_eval_obj *eval_info, bool do_backup=true);
+	// 非同期の詰み探索(LeafMateWorkers)でnodeの局面から詰みが見つかった場合に、ノードを勝ち確定にする。
+	// DNN評価の前後どちらでもよく、以降にこのノードへ到達した探索が親へ勝敗の確定を伝播する。
+	void set_leaf_mate(UCTNode *node);
+	// ルートノードを作る(既にあればそれを返す)。置換表が満杯で作れなければ、到達できないノードを解放し、それでも足りなければ全体をクリアして作り直すので、nullptrは返さない。
+	// collect_garbageと同じく、探索スレッドが停止していて、評価待ちのノードがないときに呼ぶこと。
 	UCTNode* make_root(Position &pos, MCTSSearchInfo &sei, dnn_eval_obj *eval_info, bool &created);
 	UCTNode * make_root_with_children(Position & pos, MCTSSearchInfo & sei, int &n_put, int max_put);
 	UCTNode* get_root(const Position &pos);
+	// ルート局面から到達できないノードを解放する(MCTSTT::collect_garbage参照)
+	size_t collect_garbage(Position &pos);
 	Move get_bestmove(UCTNode *root, Position &pos, bool policy_only=false);
 	void get_pv(UCTNode *root, Position &pos, std::vector<Move> &pv, float &winrate);
 	// ハッシュの使用率を千分率で返す
 	int get_hashfull();
 	// 初期化(コンストラクタ直後に呼ぶ必要はない)
 	void clear();
+	UCTChildren children(const UCTNode *node) const { return tt->children(node); }
+	void pprint(UCTNode *node);
 
 	float c_puct;
 	float virtual_loss;
+	// trueのとき、置換表全体のmutexを使わず、ノード単位のロックで並列に探索する。
+	// falseのときは従来通りmutex_で置換表全体をロックする(A/B比較用)。
+	bool concurrent_tree;
+	// 1ノードに記録する子ノード数の最大値。DNN評価時に事前確率の高い順にこの数だけ残す。
+	int max_children;
+	// 置換表が満杯で子ノードを作成できず、既存の値でbackupした回数
+	std::atomic<uint64_t> n_expand_failed;
+	// trueのとき、置換表・ノードのロックの待ち時間と保持時間を計測する(探索トレース用。計測のぶん遅くなる)
+	bool measure_lock;
+	std::atomic<uint64_t> n_lock_measured;
+	std::atomic<uint64_t> lock_wait_ns;
+	std::atomic<uint64_t> lock_hold_ns;
 private:
-	void search_recursive(UCTNode *root, Position &pos, MCTSSearchInfo &sei, dnn_eval_obj *eval_info);
-	// treeのbackup操作。
-	void backup_tree(dnn_table_index &path, float leaf_score);
+	// rootから末端まで1回選択する。psは直前の選択での局面の状態で、posは末端局面まで進んだ状態で返る。
+	// DNN評価が必要な場合はeval_infoを作成するが、キューには入れない。
+	void descend(UCTNode *root, Position &pos, MCTSSearchInfo &sei, dnn_eval_obj *eval_info, SearchPathState &ps);
+	// treeのbackup操作。leaf_provenがtrueなら末端ノードの勝敗は確定しており、経路上のノードへ勝敗の確定を伝播する。
+	void backup_tree(dnn_table_index &path, float leaf_score, bool leaf_proven = false);
 	// 末端ノードが評価不要ノードだった場合
-	void update_on_terminal(dnn_table_index &path, float leaf_score);
+	void update_on_terminal(dnn_table_index &path, float leaf_score, bool leaf_proven = false);
 	// 新規展開ノードがmateだったときの処理
 	void update_on_mate(dnn_table_index &path, float mate_score);
 	// UCBに従い次に探索する子ノードのインデックスを選択する
 	size_t select_edge(UCTNode *node);
+	// 指し手として最善の子ノードのインデックスを返す(子ノードがなければ-1)。
+	// 勝ちが確定した手があればそれを、なければ負けが確定していない手を優先して訪問回数(policy_onlyなら事前確率)で選ぶ。
+	int best_child(UCTNode *node, bool policy_only);
+	// 局面をDNN評価用の行列に変換してバッチバッファの行に直接書き込み、評価に回す。詰みで評価不要な場合はfalseを返す。
 	bool enqueue_pos(const Position &pos, MCTSSearchInfo &sei, dnn_eval_obj *eval_info, float &score);
 	void get_pv_recursive(UCTNode *node, Position &pos, std::vector<Move> &pv, float &winrate, bool root);
 	void make_root_with_children_recursive(int depth, Position & pos, MCTSSearchInfo & sei, int &n_put, int max_put);
+	// 置換表全体のロック(concurrent_treeモードでは何もしない)
+	void lock_tree();
+	void unlock_tree();
+	// ノード単位のロック(concurrent_treeモードでのみロックする)
+	void lock_node(UCTNode *node);
+	void unlock_node(UCTNode *node);
+	// measure_lock時に、ロックの取得直後と解放直前に呼んで時間を集計する
+	void lock_acquired(std::chrono::steady_clock::time_point wait_start);
+	void lock_releasing();
 
-	std::mutex mutex_;//置換表のロック
+	std::mutex mutex_;//置換表のロック(concurrent_treeがfalseのときのみ使用)
 	MCTSTT* tt;//置換表(MCTSオブジェクトと1対1対応)
 };
@@ -0,0 +1,357 @@
+﻿#pragma once
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+// 有界のロックフリーなマルチプロデューサ・マルチコンシューマのリングバッファ(Dmitry Vyukovの方式)の共通部分。
+// 各セルの通し番号(seq)で、そのセルが書き込み可能か読み出し可能かを表す。
+// 位置posのセルは、seq == posなら書き込み可能、seq == pos + 1なら読み出し可能。
+// 書き込み・読み出しは、連続して使えるセルの範囲を1回のCASで確保するので、まとめて行うとatomic操作が少なくて済む。
+// 取り出しを待つスレッドは、しばらく空回りしてからcondition_variableで眠る。公開側は待機スレッドがいるときだけmutexを取って起こす。
+// セルの中身の受け渡し(コピーするか、確保したまま使うか)は派生クラスで決める。
+template <typename T>
+class SeqRing
+{
+public:
+	// 取り出し待ちの要素数(統計用、概数)
+	size_t size() const
+	{
+		size_t enqueue_pos = _enqueue_pos.load(std::memory_order_relaxed);
+		size_t dequeue_pos = _dequeue_pos.load(std::memory_order_relaxed);
+		return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+	}
+
+	size_t capacity() const
+	{
+		return _mask + 1;
+	}
+
+	SeqRing(const SeqRing&) = delete;
+	SeqRing& operator=(const SeqRing&) = delete;
+
+protected:
+	// 眠る前に取り出しを試みる回数
+	static const int POP_SPIN_COUNT = 256;
+
+	struct Cell
+	{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	// capacityは2のべき乗に切り上げる
+	explicit SeqRing(size_t capacity) : _cells(round_up_pow2(capacity)), _mask(_cells.size() - 1), _enqueue_pos(0), _dequeue_pos(0), _n_waiters(0)
+	{
+		for (size_t i = 0; i < _cells.size(); i++)
+		{
+			_cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	Cell &cell(size_t pos)
+	{
+		return _cells[pos & _mask];
+	}
+
+	const Cell &cell(size_t pos) const
+	{
+		return _cells[pos & _mask];
+	}
+
+	// 待たずに、連続して書き込み可能な最大max_size個のセルを確保し、その数を返す(満杯なら0)。先頭の位置をfirstに返す。
+	// 確保したセルは、書き込んだらpublishで読み出しを許可する。
+	size_t claim_write(size_t &first, size_t max_size)
+	{
+		size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			// posから連続して書き込み可能なセルの数を数える
+			size_t n = 0;
+			while (n < max_size)
+			{
+				size_t seq = cell(pos + n).seq.load(std::memory_order_acquire);
+				if (seq != pos + n)
+				{
+					break;
+				}
+				n++;
+			}
+			if (n == 0)
+			{
+				size_t seq = cell(pos).seq.load(std::memory_order_acquire);
+				if ((intptr_t)(seq - pos) < 0)
+				{
+					return 0;//満杯
+				}
+				// 他のスレッドが先に確保した
+				pos = _enqueue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (_enqueue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+			{
+				first = pos;
+				return n;
+			}
+		}
+	}
+
+	// claim_writeで確保した位置posのセルの読み出しを許可する
+	void publish(size_t pos)
+	{
+		cell(pos).seq.store(pos + 1, std::memory_order_release);
+	}
+
+	// 待たずに、連続して読み出し可能な最大max_size個のセルを確保し、その数を返す(空なら0)。先頭の位置をfirstに返す。
+	// no_wrapなら、リングの末尾で折り返さない範囲に限る。
+	// 確保したセルは、読み終わったらreleaseで1周後の書き込みを許可する。
+	size_t claim_read(size_t &first, size_t max_size, bool no_wrap = false)
+	{
+		size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			// posから連続して読み出し可能なセルの数を数える
+			size_t limit = no_wrap ? std::min(max_size, _mask + 1 - (pos & _mask)) : max_size;
+			size_t n = 0;
+			while (n < limit)
+			{
+				size_t seq = cell(pos + n).seq.load(std::memory_order_acquire);
+				if (seq != pos + n + 1)
+				{
+					break;
+				}
+				n++;
+			}
+			if (n == 0)
+			{
+				size_t seq = cell(pos).seq.load(std::memory_order_acquire);
+				if ((intptr_t)(seq - (pos + 1)) < 0)
+				{
+					return 0;//空、または先頭のセルが書き込み中
+				}
+				// 他のスレッドが先に取り出した
+				pos = _dequeue_pos.load(std::memory_order_relaxed);
+				continue;
+			}
+			if (_dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+			{
+				first = pos;
+				return n;
+			}
+		}
+	}
+
+	// claim_readで確保した位置posのセルの、1周後の書き込みを許可する
+	void release(size_t pos)
+	{
+		cell(pos).seq.store(pos + _mask + 1, std::memory_order_release);
+	}
+
+	// publishの後に呼び、取り出しを待っているスレッドがいれば起こす
+	void notify_waiters()
+	{
+		// publishしたseqの書き込みと待機スレッド数の読み出しの順序を保証し、待機に入る直前のスレッドを取りこぼさない
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (_n_waiters.load(std::memory_order_relaxed) > 0)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+			}
+			_cond.notify_all();
+		}
+	}
+
+	// try_pop()が1個以上取り出すかdeadlineに達するまで待ち、取り出した数を返す(deadlineがnullptrなら取り出せるまで待つ)
+	template <typename TryPop>
+	size_t wait_pop(TryPop try_pop, const std::chrono::steady_clock::time_point *deadline)
+	{
+		// 要素はすぐに届くことが多いので、しばらく空回りしてから眠る(CPUが1つなら空回りは無駄なのですぐ眠る)
+		int spin_count = can_spin() ? POP_SPIN_COUNT : 0;
+		for (int spin = 0; spin < spin_count; spin++)
+		{
+			size_t n = try_pop();
+			if (n > 0)
+			{
+				return n;
+			}
+		}
+		while (true)
+		{
+			size_t n = try_pop();
+			if (n > 0)
+			{
+				return n;
+			}
+			std::unique_lock<std::mutex> lock(_mutex);
+			_n_waiters.fetch_add(1);
+			if (deadline)
+			{
+				_cond.wait_until(lock, *deadline, [&] { return readable(); });
+			}
+			else
+			{
+				_cond.wait(lock, [&] { return readable(); });
+			}
+			_n_waiters.fetch_sub(1);
+			if (deadline && std::chrono::steady_clock::now() >= *deadline)
+			{
+				lock.unlock();
+				return try_pop();
+			}
+		}
+	}
+
+	static bool can_spin()
+	{
+		static const bool multi_core = std::thread::hardware_concurrency() > 1;
+		return multi_core;
+	}
+
+	static void backoff(int &spin)
+	{
+		if (++spin >= 64 || !can_spin())
+		{
+			std::this_thread::yield();
+			spin = 0;
+		}
+	}
+
+private:
+	static size_t round_up_pow2(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		return size;
+	}
+
+	// 先頭のセルが読み出し可能か(待機の条件確認用)
+	bool readable() const
+	{
+		size_t pos = _dequeue_pos.load();
+		return cell(pos).seq.load() == pos + 1;
+	}
+
+	std::vector<Cell> _cells;
+	size_t _mask;
+	// 投入側と取り出し側で別のキャッシュラインに置く(newで確保するのでalignasではなく詰め物で離す)
+	std::atomic<size_t> _enqueue_pos;
+	char _padding1[64];
+	std::atomic<size_t> _dequeue_pos;
+	char _padding2[64];
+	std::atomic<int> _n_waiters;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+};
+
+// 有界のロックフリーなマルチプロデューサ・マルチコンシューマのキュー。要素はセルにコピーして受け渡す。
+// 取り出しを待つスレッドがいなければ、投入はmutexを取らない(MTQueueは投入のたびにmutexを取る)。
+// 満杯のときの投入は空きができるまで待つので、容量は同時に入りうる要素数より十分大きくすること。
+template <typename T>
+class MPMCQueue : public SeqRing<T>
+{
+	typedef SeqRing<T> Base;
+
+public:
+	// capacityは2のべき乗に切り上げる
+	explicit MPMCQueue(size_t capacity) : Base(capacity)
+	{
+	}
+
+	void push(const T &item)
+	{
+		push_batch(&item, 1);
+	}
+
+	// 満杯なら空きができるまで待つ
+	void push_batch(const T *items, size_t size)
+	{
+		size_t pushed = 0;
+		int spin = 0;
+		while (pushed < size)
+		{
+			size_t n = try_push_batch(items + pushed, size - pushed);
+			if (n == 0)
+			{
+				Base::backoff(spin);
+				continue;
+			}
+			pushed += n;
+			spin = 0;
+		}
+		Base::notify_waiters();
+	}
+
+	// 待たずに投入する。満杯なら投入せずfalseを返す
+	bool try_push(const T &item)
+	{
+		if (try_push_batch(&item, 1) == 0)
+		{
+			return false;
+		}
+		Base::notify_waiters();
+		return true;
+	}
+
+	bool pop_nb(T &item)
+	{
+		return pop_batch_nb(&item, 1) == 1;
+	}
+
+	void pop(T &item)
+	{
+		pop_batch(&item, 1);
+	}
+
+	T pop()
+	{
+		T item;
+		pop_batch(&item, 1);
+		return item;
+	}
+
+	// 1個以上取り出せるまで待ち、最大max_size個取り出す
+	size_t pop_batch(T *items, size_t max_size)
+	{
+		return Base::wait_pop([&] { return pop_batch_nb(items, max_size); }, nullptr);
+	}
+
+	// 1個以上取り出せるかdeadlineに達するまで待ち、最大max_size個取り出す。取り出せなければ0を返す。
+	size_t pop_batch(T *items, size_t max_size, std::chrono::steady_clock::time_point deadline)
+	{
+		return Base::wait_pop([&] { return pop_batch_nb(items, max_size); }, &deadline);
+	}
+
+	// 待たずに最大max_size個取り出す
+	size_t pop_batch_nb(T *items, size_t max_size)
+	{
+		size_t first;
+		size_t n = Base::claim_read(first, max_size);
+		for (size_t i = 0; i < n; i++)
+		{
+			items[i] = Base::cell(first + i).data;
+			Base::release(first + i);
+		}
+		return n;
+	}
+
+private:
+	// 待たずに最大size個投入し、投入した数を返す(満杯なら0)
+	size_t try_push_batch(const T *items, size_t size)
+	{
+		size_t first;
+		size_t n = Base::claim_write(first, size);
+		for (size_t i = 0; i < n; i++)
+		{
+			Base::cell(first + i).data = items[i];
+			Base::publish(first + i);
+		}
+		return n;
+	}
+};
@@ -131,6 +131,13 @@ public:
 		cond_.notify_one();
 	}
 
+	// 現在の要素数(統計用)
+	size_t size()
+	{
+		std::unique_lock<std::mutex> mlock(mutex_);
+		return queue_.size();
+	}
+
 	void set_batch_size_limit(size_t limit)
 	{
 		batch_size_limit = limit;
@@ -0,0 +1,361 @@
+﻿#include "../../extra/all.h"
+#include "numa_memory.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+// huge pageのサイズ。領域をこの単位に揃えると、透過的huge pageが使われやすい。
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+// これより小さい領域は並列化せずにクリアする
+static const size_t PARALLEL_CLEAR_MIN_BYTES = 256 * 1024 * 1024;
+
+#ifdef _WIN32
+
+// プロセスのトークンでSeLockMemoryPrivilege(メモリ内のページのロック)を有効化する。
+// ユーザーに権限が付与されていない場合は失敗する。
+static bool enable_lock_memory_privilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+	TOKEN_PRIVILEGES tp;
+	tp.PrivilegeCount = 1;
+	tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	bool ok = false;
+	if (LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid))
+	{
+		// 権限が付与されていなくてもAdjustTokenPrivileges自体は成功し、GetLastErrorがERROR_NOT_ALL_ASSIGNEDになる
+		ok = AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL) && GetLastError() == ERROR_SUCCESS;
+	}
+	CloseHandle(token);
+	return ok;
+}
+
+void *large_memory_alloc(size_t bytes)
+{
+	// large pageはSeLockMemoryPrivilegeが必要なので、有効化できないか確保に失敗したら通常のページで確保する
+	size_t large_page_size = GetLargePageMinimum();
+	if (large_page_size > 0 && !enable_lock_memory_privilege())
+	{
+		sync_cout << "info string SeLockMemoryPrivilege is not granted, large pages are not used" << sync_endl;
+	}
+	else if (large_page_size > 0)
+	{
+		size_t rounded = (bytes + large_page_size - 1) / large_page_size * large_page_size;
+		void *ptr = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (ptr)
+		{
+			sync_cout << "info string allocated " << (bytes >> 20) << "MB with large pages" << sync_endl;
+			return ptr;
+		}
+	}
+	return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void large_memory_free(void *ptr, size_t bytes)
+{
+	if (ptr)
+	{
+		VirtualFree(ptr, 0, MEM_RELEASE);
+	}
+}
+
+int numa_node_count()
+{
+	ULONG highest_node;
+	if (!GetNumaHighestNodeNumber(&highest_node))
+	{
+		return 1;
+	}
+	return (int)highest_node + 1;
+}
+
+std::vector<int> numa_node_cpus(int node)
+{
+	// プロセッサグループをまたぐ番号付けはしない。グループ内の番号を返す。
+	std::vector<int> cpus;
+	GROUP_AFFINITY affinity;
+	if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+	{
+		for (int i = 0; i < 64; i++)
+		{
+			if (affinity.Mask & ((KAFFINITY)1 << i))
+			{
+				cpus.push_back(i);
+			}
+		}
+	}
+	return cpus;
+}
+
+void numa_bind_this_thread(int node)
+{
+	GROUP_AFFINITY affinity;
+	if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+	{
+		SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+	}
+}
+
+void numa_bind_this_thread_to_cpu(int node, int cpu)
+{
+	// cpuはノードのプロセッサグループ内の番号
+	GROUP_AFFINITY affinity;
+	if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity))
+	{
+		affinity.Mask = (KAFFINITY)1 << cpu;
+		SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+	}
+}
+
+#else
+
+void *large_memory_alloc(size_t bytes)
+{
+	size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+	// 事前に予約されたhuge pageがあればそれを使う(足りなければ確保時点で失敗する)
+	void *ptr = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (ptr != MAP_FAILED)
+	{
+		sync_cout << "info string allocated " << (bytes >> 20) << "MB with huge pages" << sync_endl;
+		return ptr;
+	}
+#endif
+	// 透過的huge pageを使えるよう、huge pageの境界に揃えた領域を確保する
+	char *raw = (char*)mmap(nullptr, rounded + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	char *aligned = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+	// 前後の余りを返却し、[aligned, aligned + rounded)だけを残す
+	if (aligned > raw)
+	{
+		munmap(raw, aligned - raw);
+	}
+	size_t tail = (raw + rounded + HUGE_PAGE_SIZE) - (aligned + rounded);
+	if (tail > 0)
+	{
+		munmap(aligned + rounded, tail);
+	}
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, rounded, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+void large_memory_free(void *ptr, size_t bytes)
+{
+	if (ptr)
+	{
+		size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		munmap(ptr, rounded);
+	}
+}
+
+// "0-3,8-11"形式のCPUリストを展開する
+static std::vector<int> parse_cpulist(const std::string &cpulist)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(cpulist);
+	std::string item;
+	while (getline(ss, item, ','))
+	{
+		if (item.empty() || !isdigit((unsigned char)item[0]))
+		{
+			continue;
+		}
+		size_t hyphen = item.find('-');
+		int first = stoi(item.substr(0, hyphen));
+		int last = hyphen == std::string::npos ? first : stoi(item.substr(hyphen + 1));
+		for (int cpu = first; cpu <= last; cpu++)
+		{
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+static bool read_node_cpulist(int node, std::string &cpulist)
+{
+	std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	return ifs && (bool)getline(ifs, cpulist);
+}
+
+int numa_node_count()
+{
+	int nodes = 0;
+	std::string cpulist;
+	while (read_node_cpulist(nodes, cpulist))
+	{
+		nodes++;
+	}
+	return std::max(nodes, 1);
+}
+
+std::vector<int> numa_node_cpus(int node)
+{
+	std::vector<int> cpus;
+	std::string cpulist;
+	if (!read_node_cpulist(node, cpulist))
+	{
+		return cpus;
+	}
+	// コンテナ等でプロセスが使えるCPUが制限されている場合は、その範囲に絞る
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool has_allowed = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+	for (int cpu : parse_cpulist(cpulist))
+	{
+		if (cpu < CPU_SETSIZE && (!has_allowed || CPU_ISSET(cpu, &allowed)))
+		{
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+void numa_bind_this_thread(int node)
+{
+	std::vector<int> cpus = numa_node_cpus(node);
+	if (cpus.empty())
+	{
+		return;
+	}
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	for (int cpu : cpus)
+	{
+		CPU_SET(cpu, &cpuset);
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+}
+
+void numa_bind_this_thread_to_cpu(int node, int cpu)
+{
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+}
+
+#endif
+
+// スレッドの配置方針
+enum AffinityPolicy
+{
+	AFFINITY_NONE,
+	AFFINITY_NODE,
+	AFFINITY_CORE,
+};
+static AffinityPolicy affinity_policy = AFFINITY_NONE;
+
+bool set_thread_affinity_policy(const std::string &policy)
+{
+	if (policy == "node")
+	{
+		affinity_policy = AFFINITY_NODE;
+	}
+	else if (policy == "core")
+	{
+		affinity_policy = AFFINITY_CORE;
+	}
+	else
+	{
+		affinity_policy = AFFINITY_NONE;
+		return policy == "none";
+	}
+	return true;
+}
+
+// idx番目のスレッドを配置するノード(用途によらない)
+static int thread_node(int idx)
+{
+	return idx % numa_node_count();
+}
+
+int bind_thread_by_role(ThreadRole role, int idx)
+{
+	if (affinity_policy == AFFINITY_NONE)
+	{
+		return -1;
+	}
+	int node = thread_node(idx);
+	std::vector<int> cpus = numa_node_cpus(node);
+	if (cpus.empty())
+	{
+		return -1;
+	}
+	if (affinity_policy == AFFINITY_CORE && role != THREAD_ROLE_MATE)
+	{
+		// 各ノードに順番に割り当てるので、ノード内ではidx / ノード数番目
+		size_t slot = (size_t)(idx / numa_node_count()) % cpus.size();
+		int cpu = role == THREAD_ROLE_DNN ? cpus[cpus.size() - 1 - slot] : cpus[slot];
+		numa_bind_this_thread_to_cpu(node, cpu);
+	}
+	else
+	{
+		numa_bind_this_thread(node);
+	}
+	return node;
+}
+
+void run_on_thread_node(int idx, const std::function<void()> &fn)
+{
+	if (affinity_policy == AFFINITY_NONE)
+	{
+		fn();
+		return;
+	}
+	std::thread th([&] {
+		numa_bind_this_thread(thread_node(idx));
+		fn();
+	});
+	th.join();
+}
+
+void parallel_first_touch_clear(void *ptr, size_t bytes)
+{
+	int n_threads = (int)std::thread::hardware_concurrency();
+	if (bytes < PARALLEL_CLEAR_MIN_BYTES || n_threads <= 1)
+	{
+		memset(ptr, 0, bytes);
+		return;
+	}
+	// 領域をスレッド数で分割し、連続したブロックごとに同じノードのスレッドが担当する
+	int n_nodes = numa_node_count();
+	size_t chunk = (bytes / n_threads + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < n_threads; i++)
+	{
+		size_t begin = chunk * i;
+		if (begin >= bytes)
+		{
+			break;
+		}
+		size_t size = std::min(chunk, bytes - begin);
+		int node = i * n_nodes / n_threads;
+		threads.emplace_back([ptr, begin, size, node, n_nodes] {
+			if (n_nodes > 1)
+			{
+				numa_bind_this_thread(node);
+			}
+			memset((char*)ptr + begin, 0, size);
+		});
+	}
+	for (auto &th : threads)
+	{
+		th.join();
+	}
+}
@@ -0,0 +1,47 @@
+﻿#pragma once
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <functional>
+
+// 巨大なメモリ領域の確保と、NUMAノードを考慮したスレッド配置のためのユーティリティ
+
+// 巨大なメモリ領域を確保する。可能な場合はhuge page(large page)を用いる。
+// 確保した領域はゼロクリアされている。確保できない場合はnullptrを返す。
+void *large_memory_alloc(size_t bytes);
+// large_memory_allocで確保した領域を解放する。bytesは確保時と同じ値を与える。
+void large_memory_free(void *ptr, size_t bytes);
+
+// NUMAノード数(情報が得られない場合は1)
+int numa_node_count();
+// NUMAノードに属し、このプロセスが使用可能な論理CPU番号のリスト(情報が得られない場合は空)
+std::vector<int> numa_node_cpus(int node);
+// 現在のスレッドを、指定したNUMAノードのCPUで実行するよう固定する。
+void numa_bind_this_thread(int node);
+// 現在のスレッドを1つの論理CPUに固定する。cpuはnuma_node_cpus(node)の要素。
+void numa_bind_this_thread_to_cpu(int node, int cpu);
+
+// スレッドの用途。配置方針(set_thread_affinity_policy)に従い、用途ごとに番号順に配置する。
+enum ThreadRole
+{
+	THREAD_ROLE_SEARCH,//探索スレッド
+	THREAD_ROLE_DNN,//DNN評価の要求をまとめて評価器へ送るスレッド
+	THREAD_ROLE_MATE,//詰み探索スレッド
+};
+
+// スレッドの配置方針を設定する。スレッドを作成する前に呼ぶこと。未知の方針ならfalseを返し、noneとする。
+// none: 固定しない(OSに任せる)
+// node: 各スレッドを1つのNUMAノードのCPU群に固定する。用途ごとに、番号順にノードへ順番に割り当てる。
+// core: 探索スレッド・DNNスレッドを1つの論理CPUに固定する。各ノードのCPUを、探索スレッドは先頭から、DNNスレッドは末尾から使う。
+//       詰み探索スレッドは負荷が断続的なので、nodeと同様にノード単位で固定する。
+bool set_thread_affinity_policy(const std::string &policy);
+// 現在のスレッドを、用途roleのidx番目のスレッドとして配置方針に従い固定する。固定したノード番号を返す(固定しない場合は-1)。
+// スレッドがメモリを最初に書き込んだノードに割り当てられるので、スレッドごとの領域は固定した後に確保すること。
+int bind_thread_by_role(ThreadRole role, int idx);
+// idx番目のスレッド(用途によらない)と同じノードに固定した一時スレッドでfnを実行する。
+// 別スレッドが使う領域を、そのスレッドのノードに確保するために用いる。固定しない方針ならこのスレッドで実行する。
+void run_on_thread_node(int idx, const std::function<void()> &fn);
+
+// 領域を、各NUMAノードに固定した複数のスレッドで分担してゼロクリアする。
+// ページは最初に書き込んだスレッドのノードに配置される(first touch)ので、領域はノード間に均等に分散される。
+void parallel_first_touch_clear(void *ptr, size_t bytes);
@@ -0,0 +1,100 @@
+﻿#pragma once
+#include <atomic>
+#include <vector>
+#include <new>
+#include <cstdint>
+
+// スレッドごとのオブジェクトプール。
+// 確保(alloc)はプールを所有する1スレッドだけが行い、返却(release)は任意のスレッドから行える。
+// 他スレッドからの返却は所有者の返却用スタックに積まれ、所有者の手元が空になったときにまとめて引き取る。
+// 返却用スタックからの取り出しは所有者によるexchangeだけなので、ABA問題は起きない。
+// Tはメンバ「T *pool_next」「ObjectPool<T> *pool_owner」を持つこと。
+// オブジェクトはalignof(T)に揃えて配置するので、Tにalignasでキャッシュライン境界を指定できる。
+template <typename T>
+class ObjectPool
+{
+public:
+	// block_size: 不足時にまとめて確保する個数
+	explicit ObjectPool(size_t block_size) : _block_size(block_size), _local_free(nullptr), _remote_free(nullptr), _n_created(0)
+	{
+	}
+
+	~ObjectPool()
+	{
+		for (char *raw : _blocks)
+		{
+			T *block = align_block(raw);
+			for (size_t i = 0; i < _block_size; i++)
+			{
+				block[i].~T();
+			}
+			delete[] raw;
+		}
+	}
+
+	// 所有スレッドから呼ぶ
+	T *alloc()
+	{
+		if (_local_free == nullptr)
+		{
+			_local_free = _remote_free.exchange(nullptr, std::memory_order_acquire);
+			if (_local_free == nullptr)
+			{
+				grow();
+			}
+		}
+		T *obj = _local_free;
+		_local_free = obj->pool_next;
+		return obj;
+	}
+
+	// 所有スレッドから呼ぶ。objはこのプールで確保したものであること。
+	// releaseと異なりatomic操作が不要なので、所有スレッド自身が返却する場合はこちらを用いる。
+	void recycle(T *obj)
+	{
+		obj->pool_next = _local_free;
+		_local_free = obj;
+	}
+
+	// 任意のスレッドから呼べる。objは確保したプールに返却される。
+	static void release(T *obj)
+	{
+		ObjectPool<T> *owner = obj->pool_owner;
+		T *head = owner->_remote_free.load(std::memory_order_relaxed);
+		do
+		{
+			obj->pool_next = head;
+		} while (!owner->_remote_free.compare_exchange_weak(head, obj, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	// これまでにヒープから確保したオブジェクト数
+	size_t created() const { return _n_created; }
+
+private:
+	// C++14のnewはalignof(T)を保証しないので、余分に確保して先頭を揃える
+	T *align_block(char *raw) const
+	{
+		return (T*)(((uintptr_t)raw + alignof(T) - 1) & ~(uintptr_t)(alignof(T) - 1));
+	}
+
+	void grow()
+	{
+		char *raw = new char[sizeof(T) * _block_size + alignof(T)];
+		_blocks.push_back(raw);
+		T *block = align_block(raw);
+		for (size_t i = 0; i < _block_size; i++)
+		{
+			new (&block[i]) T();
+			block[i].pool_owner = this;
+			block[i].pool_next = i + 1 < _block_size ? &block[i + 1] : nullptr;
+		}
+		_local_free = block;
+		_n_created += _block_size;
+	}
+
+	size_t _block_size;
+	T *_local_free;//所有スレッドだけが触る
+	std::atomic<T*> _remote_free;//他スレッドから返却されたもののスタック
+	std::vector<char*> _blocks;
+	size_t _n_created;
+};
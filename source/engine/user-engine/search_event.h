@@ -0,0 +1,54 @@
+﻿#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+// 探索の状態変化(評価結果の到着、停止要求等)を待つためのイベント。
+// 待機する側は、先にgeneration()を取得してから条件を確認し、条件が満たされていなければその値をwait_forに渡す。
+// 確認後に通知された場合は世代が進んでいるので、通知を取りこぼさない。
+// 待機中のスレッドがなければ、notify_allはmutexを取らずatomic操作だけで済む。
+class SearchEvent
+{
+public:
+	SearchEvent() : _generation(0), _n_waiters(0)
+	{
+	}
+
+	uint64_t generation() const
+	{
+		return _generation.load();
+	}
+
+	// 世代がgenから進むか、timeoutが経過するまで待つ
+	template <typename Rep, typename Period>
+	void wait_for(uint64_t gen, const std::chrono::duration<Rep, Period> &timeout)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_n_waiters++;
+		_cond.wait_for(lock, timeout, [&] { return _generation.load() != gen; });
+		_n_waiters--;
+	}
+
+	void notify_all()
+	{
+		_generation++;
+		if (_n_waiters.load() > 0)
+		{
+			// 待機側が条件を確認してから待機に入るまでの間に通知しないよう、mutexを経由する
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+			}
+			_cond.notify_all();
+		}
+	}
+
+	SearchEvent(const SearchEvent&) = delete;
+	SearchEvent& operator=(const SearchEvent&) = delete;
+
+private:
+	std::atomic<uint64_t> _generation;
+	std::atomic<int> _n_waiters;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+};
@@ -0,0 +1,103 @@
+﻿#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "search_instance.h"
+#include "dnn_thread.h"
+
+SearchInstance::SearchInstance(MCTS *mcts, DnnBatchBuffer *request_queue, size_t pending_limit, int search_batch_size, int gc_hashfull)
+	: _mcts(mcts), _request_queue(request_queue), _response_queue(dnn_queue_capacity()), _eval_obj_pool(16), _dup_eval_pool(64),
+	_pending_limit(std::max(pending_limit, (size_t)1)), _search_batch_size(search_batch_size), _gc_hashfull(gc_hashfull), _n_evaluated(0)
+{
+}
+
+SearchInstance::~SearchInstance()
+{
+	for (auto eobj : _spare_eobjs)
+	{
+		_eval_obj_pool.recycle(eobj);
+	}
+	delete _mcts;
+}
+
+UCTNode *SearchInstance::make_root(Position &pos)
+{
+	if (_mcts->get_hashfull() >= _gc_hashfull)
+	{
+		_mcts->collect_garbage(pos);
+	}
+	MCTSSearchInfo sei(cvt, _request_queue, &_response_queue, nullptr);
+	dnn_eval_obj *eobj = _eval_obj_pool.alloc();
+	bool created;
+	UCTNode *root = _mcts->make_root(pos, sei, eobj, created);
+	if (sei.put_dnn_eval)
+	{
+		dnn_eval_obj *sentback;
+		_response_queue.pop(sentback);
+		_mcts->backup_dnn(sentback);
+		_eval_obj_pool.recycle(sentback);
+		_n_evaluated++;
+	}
+	else
+	{
+		_eval_obj_pool.recycle(eobj);
+	}
+	if (root->n_children == 0)
+	{
+		// 宣言勝ち・詰みで評価されなかったか、子ノード領域が足りず展開できなかったルートは、これ以上探索できない。
+		// 確定扱いにしてsearchがすぐに戻るようにする(降りても評価要求が出ず、評価待ちも増えないため終わらない)
+		root->terminal = true;
+		return root;
+	}
+	// 勝敗が確定していると指し手が決まらないので、探索し直す(子ノードから確定していれば、最初のbackupで再び確定する)
+	root->terminal = false;
+	return root;
+}
+
+void SearchInstance::search(UCTNode *root, Position &pos, uint64_t nodes)
+{
+	MCTSSearchInfo sei(cvt, _request_queue, &_response_queue, nullptr, &_dup_eval_pool);
+	size_t n_put = 0, n_get = 0;
+	while (true)
+	{
+		bool searching = root->value_n_sum < nodes && !root->terminal;
+		if (!searching && n_put == n_get)
+		{
+			break;
+		}
+		// 探索を進められないときは、評価結果が来るまでブロッキングする
+		bool wait_response = true;
+		if (searching && n_put - n_get < _pending_limit)
+		{
+			int k = (int)std::min((size_t)_search_batch_size, _pending_limit - (n_put - n_get));
+			while ((int)_spare_eobjs.size() < k)
+			{
+				_spare_eobjs.push_back(_eval_obj_pool.alloc());
+			}
+			int n_batch_put = _mcts->search_batch(root, pos, sei, _spare_eobjs.data(), k);
+			_spare_eobjs.erase(_spare_eobjs.begin(), _spare_eobjs.begin() + n_batch_put);
+			n_put += n_batch_put;
+			// 評価待ちのノードにばかり到達した場合は、木が更新されるまで待つ
+			wait_response = n_batch_put == 0 && sei.n_leaf_dup > 0;
+		}
+		if (n_put > n_get)
+		{
+			dnn_eval_obj *eobj = nullptr;
+			if (wait_response)
+			{
+				_response_queue.pop(eobj);
+			}
+			else
+			{
+				_response_queue.pop_nb(eobj);
+			}
+			if (eobj)
+			{
+				_mcts->backup_dnn(eobj);
+				_eval_obj_pool.recycle(eobj);
+				n_get++;
+			}
+		}
+	}
+	_n_evaluated += n_put;
+}
+
+#endif // USER_ENGINE_MCTS
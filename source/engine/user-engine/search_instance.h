@@ -0,0 +1,47 @@
+﻿#pragma once
+#include "../../shogi.h"
+#ifdef USER_ENGINE_MCTS
+#include <vector>
+#include "mcts.h"
+
+// 1つの探索木と、その探索に必要な評価結果のキュー・プールをまとめたもの。
+// 1プロセスで複数の局面(対局)を並行して探索し、共有のDNNスレッドのバッチを埋めるために用いる。
+// 個々の探索が小さくても、インスタンス数を増やせば評価待ちの合計が増えてバッチが埋まる。
+// 1つのインスタンスは1つのスレッドから使う(探索木のロックは行うが、評価結果のキューとプールはそのスレッド専用)。
+class SearchInstance
+{
+public:
+	// mcts: このインスタンス専用の探索木(所有権を受け取る)
+	// request_queue: DNN評価要求を書き込むバッチバッファ(他のインスタンス・通常の探索と共有してよい)
+	// pending_limit: 評価待ちの局面数の上限
+	// search_batch_size: 1回の木の走査でまとめて選択する末端局面数
+	// gc_hashfull: make_rootでhashfull(千分率)がこの値以上なら、ルートから到達できないノードを解放する
+	SearchInstance(MCTS *mcts, DnnBatchBuffer *request_queue, size_t pending_limit, int search_batch_size, int gc_hashfull);
+	~SearchInstance();
+
+	// posのルートノードを用意する。前回までの探索木は再利用し、新規作成した場合はDNN評価の結果を待つ。
+	// 詰み・宣言勝ちの局面など子ノードのないルートは勝敗確定として返すので、searchしても探索は行われない。
+	UCTNode *make_root(Position &pos);
+	// ルートの訪問回数がnodesに達するか勝敗が確定するまで探索する。評価待ちの結果をすべて受け取ってから戻る。
+	void search(UCTNode *root, Position &pos, uint64_t nodes);
+	MCTS *mcts() const { return _mcts; }
+	// これまでにDNN評価を要求した局面数
+	uint64_t n_evaluated() const { return _n_evaluated; }
+
+	SearchInstance(const SearchInstance&) = delete;
+	SearchInstance& operator=(const SearchInstance&) = delete;
+
+private:
+	MCTS *_mcts;
+	DnnBatchBuffer *_request_queue;
+	DnnEvalQueue _response_queue;
+	DnnEvalObjPool _eval_obj_pool;
+	DupEvalChainPool _dup_eval_pool;
+	std::vector<dnn_eval_obj*> _spare_eobjs;//探索に渡す未使用の評価用オブジェクト
+	size_t _pending_limit;
+	int _search_batch_size;
+	int _gc_hashfull;
+	uint64_t _n_evaluated;
+};
+
+#endif
@@ -0,0 +1,168 @@
+﻿#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "search_trace.h"
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+
+bool SearchTrace::open(const std::string &path, const std::vector<std::string> &columns)
+{
+	_ofs.open(path);
+	if (!_ofs)
+	{
+		return false;
+	}
+	for (size_t i = 0; i < columns.size(); i++)
+	{
+		_ofs << (i > 0 ? "," : "") << columns[i];
+	}
+	_ofs << "\n";
+	return true;
+}
+
+void SearchTrace::write_row(const std::vector<int64_t> &values)
+{
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		_ofs << (i > 0 ? "," : "") << values[i];
+	}
+	_ofs << "\n";
+}
+
+void SearchTrace::close()
+{
+	_ofs.close();
+}
+
+// 列ごとの集計値
+struct TraceColumnStat
+{
+	std::string name;
+	double sum = 0.0;
+	double min_value = 0.0;
+	double max_value = 0.0;
+};
+
+bool SearchTrace::summarize(const std::string &path, std::vector<std::string> &lines)
+{
+	std::ifstream ifs(path);
+	std::string line;
+	if (!ifs || !getline(ifs, line))
+	{
+		return false;
+	}
+	std::vector<TraceColumnStat> stats;
+	{
+		std::stringstream ss(line);
+		std::string name;
+		while (getline(ss, name, ','))
+		{
+			stats.push_back(TraceColumnStat{ name });
+		}
+	}
+	int n_rows = 0;
+	while (getline(ifs, line))
+	{
+		if (line.empty())
+		{
+			continue;
+		}
+		std::stringstream ss(line);
+		std::string item;
+		for (size_t i = 0; i < stats.size() && getline(ss, item, ','); i++)
+		{
+			double v = atof(item.c_str());
+			TraceColumnStat &st = stats[i];
+			st.sum += v;
+			st.min_value = n_rows == 0 ? v : std::min(st.min_value, v);
+			st.max_value = n_rows == 0 ? v : std::max(st.max_value, v);
+		}
+		n_rows++;
+	}
+	if (n_rows == 0)
+	{
+		return false;
+	}
+
+	auto find = [&](const char *name) -> const TraceColumnStat* {
+		for (auto &st : stats)
+		{
+			if (st.name == name)
+			{
+				return &st;
+			}
+		}
+		return nullptr;
+	};
+	auto fmt = [](double v) {
+		std::stringstream ss;
+		ss << std::fixed << std::setprecision(v != 0.0 && std::abs(v) < 10.0 ? 2 : 0) << v;
+		return ss.str();
+	};
+
+	lines.push_back("trace " + path + ", " + std::to_string(n_rows) + " rows");
+	for (auto &st : stats)
+	{
+		lines.push_back(st.name + ": sum " + fmt(st.sum) + " min " + fmt(st.min_value)
+			+ " avg " + fmt(st.sum / n_rows) + " max " + fmt(st.max_value));
+	}
+
+	// 増分の列から、区間全体での指標を求める
+	const TraceColumnStat *interval = find("interval_ms"), *samples = find("dnn_samples"), *batches = find("dnn_batches"),
+		*busy = find("dnn_busy_us"), *dup = find("leaf_dup"), *n_lock = find("lock_count"),
+		*lock_wait = find("lock_wait_us"), *lock_hold = find("lock_hold_us"), *mate_busy = find("leaf_mate_busy_us");
+	if (interval && interval->sum > 0.0)
+	{
+		double sec = interval->sum / 1000.0;
+		if (samples)
+		{
+			lines.push_back("nps " + fmt(samples->sum / sec));
+		}
+		if (samples && batches && batches->sum > 0.0)
+		{
+			lines.push_back("average batch size " + fmt(samples->sum / batches->sum));
+		}
+		if (busy)
+		{
+			// DNNスレッド数倍になりうる
+			lines.push_back("dnn busy " + fmt(busy->sum / 1000.0 / interval->sum * 100.0) + "% (sum over dnn threads)");
+		}
+		if (mate_busy)
+		{
+			lines.push_back("leaf mate busy " + fmt(mate_busy->sum / 1000.0 / interval->sum * 100.0) + "% (sum over mate threads)");
+		}
+		if (lock_wait && lock_hold)
+		{
+			lines.push_back("lock wait " + fmt(lock_wait->sum / 1000.0 / interval->sum * 100.0) + "%, hold "
+				+ fmt(lock_hold->sum / 1000.0 / interval->sum * 100.0) + "% (sum over threads)");
+		}
+	}
+	if (n_lock && n_lock->sum > 0.0 && lock_wait && lock_hold)
+	{
+		lines.push_back("per lock: wait " + fmt(lock_wait->sum * 1000.0 / n_lock->sum) + " ns, hold "
+			+ fmt(lock_hold->sum * 1000.0 / n_lock->sum) + " ns");
+	}
+	if (samples && dup && samples->sum + dup->sum > 0.0)
+	{
+		lines.push_back("leaf dup rate " + fmt(dup->sum / (samples->sum + dup->sum) * 100.0) + "%");
+	}
+	// スレッドごとの探索回数の偏り
+	double playouts_min = 0.0, playouts_max = 0.0;
+	int n_threads = 0;
+	for (auto &st : stats)
+	{
+		if (st.name.compare(0, 9, "playouts_") == 0)
+		{
+			playouts_min = n_threads == 0 ? st.sum : std::min(playouts_min, st.sum);
+			playouts_max = n_threads == 0 ? st.sum : std::max(playouts_max, st.sum);
+			n_threads++;
+		}
+	}
+	if (n_threads > 0)
+	{
+		lines.push_back("playouts per thread: min " + fmt(playouts_min) + " max " + fmt(playouts_max) + " (" + std::to_string(n_threads) + " threads)");
+	}
+	return true;
+}
+
+#endif // USER_ENGINE_MCTS
@@ -0,0 +1,25 @@
+﻿#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+
+// 探索の計測値を一定間隔で1行ずつ記録するトレースファイル(CSV)。思考(指し手)ごとに1ファイルとする。
+// 1行目は列名で、各列は記録時点の値(キューの長さ等)か、前回の記録からの増分(評価局面数等)。
+class SearchTrace
+{
+public:
+	// ファイルを作成し、列名の行を書き込む。失敗したらfalseを返す。
+	bool open(const std::string &path, const std::vector<std::string> &columns);
+	// 1行書き込む。valuesは列名と同じ数だけ与える。
+	void write_row(const std::vector<int64_t> &values);
+	void close();
+	bool is_open() const { return _ofs.is_open(); }
+
+	// トレースファイルを読み込み、列ごとの合計・最小・平均・最大と、ボトルネックの判断に使う指標を行ごとに返す。
+	// 読み込めなければfalseを返す。
+	static bool summarize(const std::string &path, std::vector<std::string> &lines);
+
+private:
+	std::ofstream _ofs;
+};
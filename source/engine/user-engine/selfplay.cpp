@@ -0,0 +1,236 @@
+﻿#include "../../extra/all.h"
+#ifdef USER_ENGINE_MCTS
+#include "selfplay.h"
+#include "search_instance.h"
+#include "numa_memory.h"
+
+SelfPlayWriter::SelfPlayWriter() : _closing(false), _n_written(0)
+{
+}
+
+SelfPlayWriter::~SelfPlayWriter()
+{
+	close();
+}
+
+bool SelfPlayWriter::open(const std::string &path)
+{
+	// 教師局面を貯めていけるよう、gensfenと同様に追記する
+	_ofs.open(path, std::ios::out | std::ios::binary | std::ios::app);
+	if (!_ofs)
+	{
+		return false;
+	}
+	_closing = false;
+	_thread = std::thread([this] { worker(); });
+	return true;
+}
+
+void SelfPlayWriter::write_game(std::vector<SelfPlayRecord> &&records)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_games.push_back(std::move(records));
+	}
+	_cond.notify_one();
+}
+
+void SelfPlayWriter::close()
+{
+	if (!_thread.joinable())
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closing = true;
+	}
+	_cond.notify_one();
+	_thread.join();
+	_ofs.close();
+}
+
+void SelfPlayWriter::worker()
+{
+	std::vector<std::vector<SelfPlayRecord>> games;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cond.wait(lock, [this] { return _closing || !_games.empty(); });
+			if (_games.empty())
+			{
+				break;
+			}
+			games.swap(_games);
+		}
+		// ファイルへの書き込み中は対局スレッドを止めない
+		for (auto &records : games)
+		{
+			_ofs.write((const char*)records.data(), sizeof(SelfPlayRecord) * records.size());
+			_n_written += records.size();
+		}
+		_ofs.flush();
+		games.clear();
+	}
+}
+
+SelfPlayGenerator::SelfPlayGenerator(const std::vector<SearchInstance*> &instances, SelfPlayWriter &writer, const SelfPlaySettings &settings)
+	: n_games_done(0), n_black_wins(0), n_white_wins(0), n_draws(0), n_positions(0),
+	_instances(instances), _writer(writer), _settings(settings), _n_games_started(0), _n_games(0)
+{
+}
+
+void SelfPlayGenerator::run(int n_games)
+{
+	_n_games = n_games;
+	_n_games_started = 0;
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < _instances.size(); i++)
+	{
+		threads.emplace_back([this, i] {
+			bind_thread_by_role(THREAD_ROLE_SEARCH, (int)i);
+			SearchInstance *inst = _instances[i];
+			PRNG rng;
+			std::vector<SelfPlayRecord> records;
+			while (_n_games_started++ < _n_games)
+			{
+				records.clear();
+				Color winner = play_game(inst, rng, records);
+				for (auto &record : records)
+				{
+					// 奇数手目の局面は先手番(平手の初期局面が1手目)
+					Color us = (record.game_ply & 1) ? BLACK : WHITE;
+					record.game_result = winner == COLOR_NB ? 0 : winner == us ? 1 : -1;
+				}
+				n_positions += records.size();
+				(winner == BLACK ? n_black_wins : winner == WHITE ? n_white_wins : n_draws)++;
+				_writer.write_game(std::move(records));
+				records = std::vector<SelfPlayRecord>();
+				int done = ++n_games_done;
+				if (done % 10 == 0 || done == _n_games)
+				{
+					sync_cout << "info string selfplay games " << done << "/" << _n_games << " positions " << n_positions
+						<< " black " << n_black_wins << " white " << n_white_wins << " draw " << n_draws << sync_endl;
+				}
+			}
+		});
+	}
+	for (auto &th : threads)
+	{
+		th.join();
+	}
+}
+
+Color SelfPlayGenerator::play_game(SearchInstance *inst, PRNG &rng, std::vector<SelfPlayRecord> &records)
+{
+	// 対局間で探索木は共有しない
+	inst->mcts()->clear();
+	Position pos;
+	StateListPtr states(new StateList(1));
+	pos.set_hirate(&states->back(), Threads.main());
+	while (true)
+	{
+		Color us = pos.side_to_move();
+		if (pos.is_mated())
+		{
+			return ~us;
+		}
+		if (pos.DeclarationWin() != MOVE_NONE)
+		{
+			return us;
+		}
+		if (pos.game_ply() >= _settings.max_ply)
+		{
+			return COLOR_NB;
+		}
+		// 対局の千日手は、初期局面まで遡って同一局面が2回出現していること(3回目の出現)で判定する
+		switch (pos.is_repetition(0))
+		{
+		case REPETITION_DRAW:
+			return COLOR_NB;
+		case REPETITION_WIN:
+			return us;
+		case REPETITION_LOSE:
+			return ~us;
+		default:
+			break;
+		}
+
+		UCTNode *root = inst->make_root(pos);
+		inst->search(root, pos, _settings.nodes);
+		records.emplace_back();
+		Move m = record_and_select(inst, root, pos, rng, records.back());
+		if (m == MOVE_RESIGN)
+		{
+			records.pop_back();
+			return ~us;
+		}
+		states->emplace_back();
+		pos.do_move(m, states->back());
+	}
+}
+
+Move SelfPlayGenerator::record_and_select(SearchInstance *inst, UCTNode *root, Position &pos, PRNG &rng, SelfPlayRecord &record)
+{
+	MCTS *mcts = inst->mcts();
+	UCTChildren ch = mcts->children(root);
+	int n_children = root->n_children;
+	memset(&record, 0, sizeof(record));
+	pos.sfen_pack(record.sfen);
+	record.game_ply = (u16)pos.game_ply();
+	record.root_visits = (u32)std::min(root->value_n_sum, (uint64_t)UINT32_MAX);
+
+	// 子ノードの価値は親の手番側から見た値なので、そのまま平均すればルートの評価値になる
+	uint64_t child_visits = 0;
+	double child_w = 0.0;
+	std::vector<int> order(n_children);
+	for (int i = 0; i < n_children; i++)
+	{
+		order[i] = i;
+		child_visits += ch.value_n[i];
+		child_w += ch.value_w[i];
+	}
+	record.root_value = root->terminal ? root->score : child_visits > 0 ? (float)(child_w / child_visits) : 0.0F;
+
+	int n_moves = std::min(n_children, SELFPLAY_TOP_MOVES);
+	std::partial_sort(order.begin(), order.begin() + n_moves, order.end(), [&](int a, int b) { return ch.value_n[a] > ch.value_n[b]; });
+	record.n_moves = (u8)n_moves;
+	for (int j = 0; j < n_moves; j++)
+	{
+		record.moves[j] = ch.move_list[order[j]];
+		record.probs[j] = child_visits > 0 ? (float)ch.value_n[order[j]] / child_visits : 0.0F;
+	}
+
+	if (pos.game_ply() <= _settings.random_plies && !root->terminal)
+	{
+		// 負けが確定した手を除き、訪問回数に比例した確率で選ぶ
+		uint64_t total = 0;
+		for (int i = 0; i < n_children; i++)
+		{
+			if (ch.proof[i] != EDGE_PROOF_LOSS)
+			{
+				total += ch.value_n[i];
+			}
+		}
+		if (total > 0)
+		{
+			uint64_t r = rng.rand(total);
+			for (int i = 0; i < n_children; i++)
+			{
+				if (ch.proof[i] == EDGE_PROOF_LOSS)
+				{
+					continue;
+				}
+				if (r < ch.value_n[i])
+				{
+					return (Move)ch.move_list[i];
+				}
+				r -= ch.value_n[i];
+			}
+		}
+	}
+	return mcts->get_bestmove(root, pos);
+}
+
+#endif
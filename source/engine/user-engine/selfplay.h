@@ -0,0 +1,113 @@
+﻿#pragma once
+#include "../../shogi.h"
+#ifdef USER_ENGINE_MCTS
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <atomic>
+#include "../../misc.h"
+
+class Position;
+class UCTNode;
+class SearchInstance;
+
+// 自己対局の教師局面に記録する、ルートの子ノードの数(訪問回数の多い順)
+const int SELFPLAY_TOP_MOVES = 16;
+
+// 自己対局の教師局面1個。ファイルにはこの構造体をそのまま並べる(どの環境でも140バイト)。
+// numpyでは[("sfen","V32"),("root_value","<f4"),("game_ply","<u2"),("game_result","i1"),("n_moves","u1"),
+// ("root_visits","<u4"),("moves","<u2",(16,)),("probs","<f4",(16,))]として読める。
+struct SelfPlayRecord
+{
+	PackedSfen sfen;
+	// 探索後のルートの評価値(手番側から見た勝率-1~1)
+	float root_value;
+	// 初期局面からの手数
+	u16 game_ply;
+	// この局面の手番側が勝ったなら1、負けたなら-1、引き分けなら0
+	s8 game_result;
+	// moves, probsの有効な要素数
+	u8 n_moves;
+	// 探索後のルートの訪問回数
+	u32 root_visits;
+	// 子ノードの指し手(Move16)。訪問回数の多い順。
+	u16 moves[SELFPLAY_TOP_MOVES];
+	// 各手の訪問回数を全子ノードの訪問回数の合計で割ったもの
+	float probs[SELFPLAY_TOP_MOVES];
+};
+static_assert(sizeof(SelfPlayRecord) == 140, "SelfPlayRecord must be 140 bytes");
+
+// 教師局面をバックグラウンドのスレッドでファイルに書き出す。
+// 対局スレッドは終局ごとにwrite_gameで1局分を渡すだけで、ファイルへの書き込みを待たない。
+class SelfPlayWriter
+{
+public:
+	SelfPlayWriter();
+	~SelfPlayWriter();
+	// ファイルを追記モードで開き、書き込みスレッドを開始する。失敗したらfalseを返す。
+	bool open(const std::string &path);
+	// 任意のスレッドから呼べる
+	void write_game(std::vector<SelfPlayRecord> &&records);
+	// 渡された局面をすべて書き出してからファイルを閉じる
+	void close();
+	// ファイルに書き出した局面数
+	uint64_t n_written() const { return _n_written; }
+
+	SelfPlayWriter(const SelfPlayWriter&) = delete;
+	SelfPlayWriter& operator=(const SelfPlayWriter&) = delete;
+
+private:
+	void worker();
+
+	std::ofstream _ofs;
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	std::vector<std::vector<SelfPlayRecord>> _games;//書き出し待ちの対局
+	bool _closing;
+	std::atomic<uint64_t> _n_written;
+};
+
+struct SelfPlaySettings
+{
+	// 1手あたりの探索ノード数(ルートの訪問回数)
+	uint64_t nodes;
+	// この手数までは、ルートの子ノードの訪問回数に比例した確率で指し手を選ぶ(序盤の多様化)
+	int random_plies;
+	// この手数に達したら引き分けとする
+	int max_ply;
+};
+
+// 探索インスタンスごとにスレッドを立て、指定局数の自己対局を並行して行う。
+// インスタンスは共有のDNNスレッドに評価を依頼するので、インスタンス数を増やすとバッチが埋まる。
+class SelfPlayGenerator
+{
+public:
+	SelfPlayGenerator(const std::vector<SearchInstance*> &instances, SelfPlayWriter &writer, const SelfPlaySettings &settings);
+	// n_games局を終えるまで戻らない。進捗はinfo stringで表示する。
+	void run(int n_games);
+
+	// 終局した対局数と、先手勝ち・後手勝ち・引き分けの数
+	std::atomic<int> n_games_done;
+	std::atomic<int> n_black_wins;
+	std::atomic<int> n_white_wins;
+	std::atomic<int> n_draws;
+	std::atomic<uint64_t> n_positions;
+
+private:
+	// 1局指してrecordsに記録し、勝者を返す(引き分けはCOLOR_NB)
+	Color play_game(SearchInstance *inst, PRNG &rng, std::vector<SelfPlayRecord> &records);
+	// 探索後のルートから教師局面を作成し、指す手を選ぶ
+	Move record_and_select(SearchInstance *inst, UCTNode *root, Position &pos, PRNG &rng, SelfPlayRecord &record);
+
+	std::vector<SearchInstance*> _instances;
+	SelfPlayWriter &_writer;
+	SelfPlaySettings _settings;
+	std::atomic<int> _n_games_started;
+	int _n_games;
+};
+
+#endif
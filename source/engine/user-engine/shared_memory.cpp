@@ -0,0 +1,104 @@
+﻿#include "../../extra/all.h"
+#include "shared_memory.h"
+
+#ifdef _WIN32
+
+SharedMemory::~SharedMemory()
+{
+}
+
+bool SharedMemory::supported()
+{
+	return false;
+}
+
+bool SharedMemory::create(size_t bytes)
+{
+	sync_cout << "info string shared memory is not supported on this platform" << sync_endl;
+	return false;
+}
+
+std::string SharedMemory::path() const
+{
+	return "";
+}
+
+void shared_wait(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms)
+{
+	std::this_thread::yield();
+}
+
+void shared_wake(std::atomic<uint32_t> *word)
+{
+}
+
+#else
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <time.h>
+
+SharedMemory::~SharedMemory()
+{
+	if (_ptr)
+	{
+		munmap(_ptr, _bytes);
+	}
+	if (_fd >= 0)
+	{
+		close(_fd);
+	}
+}
+
+bool SharedMemory::supported()
+{
+	return true;
+}
+
+bool SharedMemory::create(size_t bytes)
+{
+	// 子プロセスには/proc/<pid>/fd/<fd>として渡すので、close-on-execは付けない
+	_fd = (int)syscall(SYS_memfd_create, "neneshogi", 0);
+	if (_fd < 0)
+	{
+		sync_cout << "info string failed memfd_create " << errno << sync_endl;
+		return false;
+	}
+	if (ftruncate(_fd, (off_t)bytes) != 0)
+	{
+		sync_cout << "info string failed to allocate " << (bytes >> 20) << "MB shared memory " << errno << sync_endl;
+		return false;
+	}
+	void *ptr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		sync_cout << "info string failed to map shared memory " << errno << sync_endl;
+		return false;
+	}
+	_ptr = ptr;
+	_bytes = bytes;
+	return true;
+}
+
+std::string SharedMemory::path() const
+{
+	return "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(_fd);
+}
+
+// 別プロセスと共有する領域なので、FUTEX_PRIVATE_FLAGは付けない
+void shared_wait(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+void shared_wake(std::atomic<uint32_t> *word)
+{
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+#endif
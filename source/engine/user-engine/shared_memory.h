@@ -0,0 +1,46 @@
+﻿#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+// 子プロセス(外部の評価プロセス)と共有するメモリ領域と、プロセス間で待ち合わせるためのユーティリティ。Linuxのみ。
+// 領域はmemfd_createで作った名前のないファイルに割り当てるので、プロセスが異常終了しても/dev/shm等に残らない。
+// 子プロセスはpath()のファイルを開いてmmapすることで同じ領域を参照する。
+class SharedMemory
+{
+public:
+	SharedMemory() : _fd(-1), _ptr(nullptr), _bytes(0)
+	{
+	}
+	~SharedMemory();
+
+	// このプラットフォームで使えるか
+	static bool supported();
+
+	// bytesの領域を確保する。確保した領域はゼロクリアされている。失敗したら理由を表示してfalseを返す。
+	bool create(size_t bytes);
+
+	void *data() const { return _ptr; }
+	size_t size() const { return _bytes; }
+	// [ptr, ptr + bytes)がこの領域に含まれるか
+	bool contains(const void *ptr, size_t bytes) const
+	{
+		return _ptr != nullptr && (const char*)ptr >= (const char*)_ptr && (const char*)ptr + bytes <= (const char*)_ptr + _bytes;
+	}
+	// 他のプロセスからこの領域を開くためのパス(/proc/<pid>/fd/<fd>)
+	std::string path() const;
+
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+private:
+	int _fd;
+	void *_ptr;
+	size_t _bytes;
+};
+
+// *wordがexpectedである間、最大timeout_ms待つ(プロセス間で共有する領域上の値にも使える)。値が変わったか、起こされたか、時間切れで戻る。
+void shared_wait(std::atomic<uint32_t> *word, uint32_t expected, int timeout_ms);
+// shared_waitで*wordを待っているスレッド・プロセスをすべて起こす
+void shared_wake(std::atomic<uint32_t> *word);
@@ -1,6 +1,6 @@
 #include "../../extra/all.h"
 
-#ifndef DNN_EXTERNAL
+#if !defined(DNN_EXTERNAL) && !defined(DNN_CPU)
 #include "NvInfer.h"
 #include "NvOnnxConfig.h"
 #include "NvOnnxParser.h"
@@ -1,4 +1,4 @@
-#ifndef DNN_EXTERNAL
+#if !defined(DNN_EXTERNAL) && !defined(DNN_CPU)
 bool tensorrt_engine_builder(const char *onnxModelPath,
                              const char *dstDir,
                              int batchSizeMin,
@@ -1,33 +1,72 @@
 ﻿#include "../../extra/all.h"
 #ifdef USER_ENGINE_MCTS
-#include <cstdlib>
 #include "mcts.h"
+#include "numa_memory.h"
+#include "search_event.h"
+#include "leaf_mate_workers.h"
+#include "search_trace.h"
+#include "search_instance.h"
+#include "selfplay.h"
+#include "mt_queue.h"
+#include <iomanip>
+#include <cstdlib>
+#include <unordered_set>
+#include <functional>
 #include "dnn_thread.h"
 #include "gpu_lock.h"
 #include "tensorrt_engine_builder.h"
+#include "cpu_int8_calibration.h"
+#include "dnn_evaluator.h"
+#ifdef USE_AVX2
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 
 static MCTS *mcts = nullptr;
-static vector<MTQueue<dnn_eval_obj *> *> response_queues;
+static vector<DnnEvalQueue *> response_queues;
+static vector<DupEvalChainPool *> dup_eval_pools; //評価待ちノードへの重複到達経路の記録用(スレッドごと)
+static vector<DnnEvalObjPool *> eval_obj_pools; //DNN評価要求の確保用(スレッドごと、response_queuesと対応)
+static atomic<uint64_t> n_leaf_dup(0); //評価待ちノードへの重複到達回数
 static vector<MateEngine::MateSearchForMCTS *> leaf_mate_searchers;
-static MateEngine::MateSearchForMCTS *root_mate_searcher = nullptr;
+static vector<MateEngine::MateSearchForMCTS *> root_mate_searchers; //ルート局面からの詰み探索(スレッドごと、置換表は共有)
+static MateEngine::TranspositionTable *root_mate_table = nullptr;
+static LeafMateWorkers *leaf_mate_workers = nullptr; //末端局面の詰み探索を非同期に行う専用スレッド(LeafMateThreads>0のとき)
+static const size_t LEAF_MATE_QUEUE_CAPACITY = 4096; //詰み探索待ちの局面数の上限。超えた分は詰み探索をしない
 static int pv_interval;				 //PV表示間隔[ms]
-static int root_mate_thread_id = -1; //ルート局面からの詰み探索をするスレッドのid(-1の場合はしない)
+static int root_mate_first_thread_id = -1; //ルート局面からの詰み探索をする最初のスレッドのid。以降のスレッドがすべて詰み探索をする(-1の場合はしない)
 static vector<Move> root_mate_pv;
-static atomic_bool root_mate_found(false); //ルート局面からの詰み探索で詰みがあった場合
-static int nodes_limit = NODES_LIMIT_MAX;  //探索ノード数の上限
-// floatで探索数をカウントしており、2^24になるとインクリメントができなくなる。
-// 詰みに近い局面でPonderしているとこれに達して評価値がおかしくなるので、
-// これ以上の探索数になったらウェイトを挿入して異常値を防止する。
-static const int nodes_safety_max = 16777216 / 2;
+static atomic_bool root_mate_found(false); //ルート局面からの詰み探索で詰みがあった場合(他の詰み探索スレッドはこれを見て打ち切る)
+static std::mutex root_mate_mutex; //root_mate_pvの書き込み用
+static atomic_int root_mate_running(0); //ルート局面からの詰み探索を実行中のスレッド数
+static uint64_t nodes_limit = UINT64_MAX; //探索ノード数の上限
 static bool already_initialized = false; //一度Search::clearで初期化済みかどうか。
 static atomic_size_t pending_limit(1);   //DNN評価待ちの要素数の最大数(スレッドごと)
 static int pending_limit_factor = 16;
 static size_t normal_slave_threads = 1; //通常探索をするslaveスレッド数
 static bool policy_only = false;
 static int limited_batch_size = 1;
-static int limited_until = 0;
+static uint64_t limited_until = 0;
 static int print_status_interval = 0;
 static int early_stop_prob = 0;
+static int search_batch_size = 8; //1回の木の走査でまとめて選択する末端局面数
+static int gc_hashfull = 500; //思考開始時のhashfullがこの値以上なら、ルートから到達できないノードを解放する
+static int pending_control_interval = 100; //評価待ち数の上限を調整する間隔[ms](0なら固定の式で決める)
+static float pending_collision_max = 0.1F; //評価待ちノードへの重複到達率がこれを超えたら評価待ち数の上限を下げる
+static bool pending_control_log = false; //評価待ち数の調整内容を表示するか
+static atomic_size_t pending_budget(0); //全探索スレッド合計の評価待ち数の上限(制御器が調整し、思考をまたいで引き継ぐ)
+static int pending_control_increases = 0, pending_control_decreases = 0; //今回の思考で上限を上げた・下げた回数
+static SearchEvent stop_event; //探索終了条件の変化(stop, ponderhit, ルートの勝敗確定等)の通知。masterとponder中の待機が待つ。
+static SearchEvent tree_event; //DNN評価結果のbackupと探索停止の通知。進められる探索がないslaveが待つ。
+static vector<atomic<uint64_t>> thread_playouts; //スレッドごとの、探索で末端まで選択した回数の累計
+static bool search_trace_enabled = false; //探索の計測値を記録するか
+static string search_trace_path = "trace"; //探索トレースのファイル名の接頭辞
+static int search_trace_interval = 10; //探索トレースの記録間隔[ms]
+static int search_trace_seq = 0; //探索トレースのファイルの通し番号
+static SearchTrace search_trace;
+static string search_trace_file; //記録中の探索トレースのファイル名
 // 環境変数で指定したサイズの置換表を事前確保
 static std::thread *advance_hash_init_thread = nullptr;
 static int advance_node_hash_size = 0; //MB単位
@@ -35,6 +74,81 @@ static int advance_node_hash_size = 0; //MB単位
 // 定跡の指し手を選択するモジュール
 static Book::BookMoveSelector book;
 
+static MCTS *create_mcts(int hash_size_mb, int max_children);
+static vector<SearchInstance*> create_search_instances(int n_instances, int hash_size_mb, size_t &pending);
+static int winrate_to_cp(float winrate);
+// usi.cpp
+void position_cmd(Position& pos, istringstream& is, StateListPtr& states);
+
+// キューのベンチマーク(user queuebench)の1回分。
+// n_producers個のスレッドがpush_size個ずつ投入し、n_consumers個のスレッドが最大pop_size個ずつ取り出す。
+// 値の合計で欠落・重複がないことを確認し、1秒あたりの要素数を返す(不一致なら負の値)。
+template <typename Queue>
+static double queue_bench_run(Queue &queue, int n_producers, int n_consumers, uint64_t items_per_producer, int push_size, int pop_size)
+{
+	std::atomic<uint64_t> received_sum(0);
+	vector<std::thread> consumers, producers;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int c = 0; c < n_consumers; c++)
+	{
+		consumers.emplace_back([&] {
+			// 値0は終了の合図。1回で複数取り出したら、他のスレッドのぶんを戻す。
+			vector<uint64_t> items(pop_size);
+			uint64_t sum = 0;
+			int n_stop = 0;
+			while (n_stop == 0)
+			{
+				size_t n = queue.pop_batch(items.data(), items.size());
+				for (size_t i = 0; i < n; i++)
+				{
+					sum += items[i];
+					n_stop += items[i] == 0;
+				}
+			}
+			for (int i = 1; i < n_stop; i++)
+			{
+				queue.push(0);
+			}
+			received_sum += sum;
+		});
+	}
+	for (int p = 0; p < n_producers; p++)
+	{
+		producers.emplace_back([&, p] {
+			vector<uint64_t> items(push_size);
+			uint64_t base = p * items_per_producer + 1;
+			for (uint64_t i = 0; i < items_per_producer; i += push_size)
+			{
+				size_t n = (size_t)std::min((uint64_t)push_size, items_per_producer - i);
+				for (size_t j = 0; j < n; j++)
+				{
+					items[j] = base + i + j;
+				}
+				queue.push_batch(items.data(), n);
+			}
+		});
+	}
+	for (auto &th : producers)
+	{
+		th.join();
+	}
+	for (int c = 0; c < n_consumers; c++)
+	{
+		queue.push(0);
+	}
+	for (auto &th : consumers)
+	{
+		th.join();
+	}
+	double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / 1000000.0;
+	uint64_t total = n_producers * items_per_producer;
+	if (received_sum != total * (total + 1) / 2)
+	{
+		return -1.0;
+	}
+	return total / std::max(elapsed, 0.000001);
+}
+
 // USI拡張コマンド"user"が送られてくるとこの関数が呼び出される。実験に使ってください。
 void user_test(Position &pos_, istringstream &is)
 {
@@ -48,7 +162,8 @@ void user_test(Position &pos_, istringstream &is)
 		is >> count;
 
 		sync_cout << "info string start bench" << sync_endl;
-		MTQueue<dnn_eval_obj *> *response_queue = response_queues[0];
+		DnnEvalQueue *response_queue = response_queues[0];
+		DnnEvalObjPool *eval_obj_pool = eval_obj_pools[0];
 		int n_put = 0, n_get = 0;
 		std::chrono::system_clock::time_point bench_start = std::chrono::system_clock::now();
 		while (n_get < count)
@@ -57,15 +172,17 @@ void user_test(Position &pos_, istringstream &is)
 			{
 				for (size_t i = 0; i < batch_size; i++)
 				{
-					dnn_eval_obj *eobj = new dnn_eval_obj();
+					dnn_eval_obj *eobj = eval_obj_pool->alloc();
 					// ダミーデータを入れておく
 					eobj->n_moves = 1;
 					eobj->move_indices[0].move = MOVE_NONE;
 					eobj->move_indices[0].index = 0;
-					memset(eobj->input_array, 0, sizeof(eobj->input_array));
 
 					eobj->response_queue = response_queue;
-					request_queues[n_put % request_queues.size()]->push(eobj);
+					DnnBatchBuffer *request_queue = request_queues[n_put % request_queues.size()];
+					size_t ticket = request_queue->reserve();
+					memset(request_queue->row(ticket), 0, request_queue->row_bytes());
+					request_queue->commit(ticket, eobj);
 					n_put++;
 				}
 			}
@@ -74,7 +191,7 @@ void user_test(Position &pos_, istringstream &is)
 			while (response_queue->pop_nb(eobj_ret))
 			{
 				n_get++;
-				delete eobj_ret;
+				eval_obj_pool->recycle(eobj_ret);
 			}
 		}
 		std::chrono::system_clock::time_point bench_end = std::chrono::system_clock::now();
@@ -84,7 +201,550 @@ void user_test(Position &pos_, istringstream &is)
 
 		sync_cout << "info string bench done " << elapsed << " sec, nps=" << nps << sync_endl;
 	}
-#ifndef DNN_EXTERNAL
+	if (token == "multisearch")
+	{
+		// 1プロセス内で複数の探索木(SearchInstance)を並行して動かし、局面集を一定ノード数ずつ探索する。
+		// DNNスレッドは全インスタンスで共有するので、1局面あたりの探索が小さくてもバッチが埋まる。
+		// user multisearch [局面ファイル] [探索ノード数] [インスタンス数] [1インスタンスのハッシュ(MB)]
+		// 局面ファイルは1行1局面で、positionコマンドの引数の形式(startpos moves ... または sfen ... moves ...)。
+		// isreadyでモデルを読み込み終わっている必要がある。
+		string path;
+		uint64_t nodes = 1000;
+		int n_instances = 8, hash_mb = 64;
+		is >> path >> nodes >> n_instances >> hash_mb;
+		n_instances = std::max(n_instances, 1);
+		vector<string> lines;
+		{
+			ifstream ifs(path);
+			string line;
+			while (getline(ifs, line))
+			{
+				if (!line.empty() && line.back() == '\r')
+				{
+					line.pop_back();
+				}
+				if (!line.empty())
+				{
+					lines.push_back(line);
+				}
+			}
+		}
+		if (lines.empty())
+		{
+			sync_cout << "info string no positions in " << path << sync_endl;
+			return;
+		}
+
+		size_t pending;
+		vector<SearchInstance *> instances = create_search_instances(n_instances, hash_mb, pending);
+		sync_cout << "info string multisearch " << lines.size() << " positions, " << nodes << " nodes, "
+				  << n_instances << " instances, pending " << pending << sync_endl;
+
+		int batches_start = n_dnn_evaled_batches, samples_start = n_dnn_evaled_samples;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		std::atomic<size_t> next_line(0);
+		vector<std::thread> workers;
+		for (int i = 0; i < n_instances; i++)
+		{
+			workers.emplace_back([&, i] {
+				bind_thread_by_role(THREAD_ROLE_SEARCH, i);
+				SearchInstance *inst = instances[i];
+				Position pos;
+				StateListPtr states;
+				size_t idx;
+				while ((idx = next_line++) < lines.size())
+				{
+					istringstream line_is(lines[idx]);
+					position_cmd(pos, line_is, states);
+					if (pos.is_mated())
+					{
+						sync_cout << "info string multisearch " << idx << " bestmove resign" << sync_endl;
+						continue;
+					}
+					Move declaration_win = pos.DeclarationWin();
+					if (declaration_win != MOVE_NONE)
+					{
+						sync_cout << "info string multisearch " << idx << " bestmove " << declaration_win << sync_endl;
+						continue;
+					}
+					UCTNode *root = inst->make_root(pos);
+					inst->search(root, pos, nodes);
+					vector<Move> pv;
+					float winrate;
+					inst->mcts()->get_pv(root, pos, pv, winrate);
+					sync_cout << "info string multisearch " << idx << " nodes " << root->value_n_sum << " score cp " << winrate_to_cp(winrate) << " pv";
+					for (auto m : pv)
+					{
+						cout << " " << m;
+					}
+					cout << sync_endl;
+				}
+			});
+		}
+		for (auto &th : workers)
+		{
+			th.join();
+		}
+		double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+		int d_batches = n_dnn_evaled_batches - batches_start, d_samples = n_dnn_evaled_samples - samples_start;
+		sync_cout << "info string multisearch done " << elapsed << " sec, " << (int)(lines.size() / std::max(elapsed, 0.001)) << " positions/s, nps "
+				  << (int)(d_samples / std::max(elapsed, 0.001)) << ", average bs " << (d_batches > 0 ? d_samples / d_batches : 0) << sync_endl;
+		for (auto inst : instances)
+		{
+			delete inst;
+		}
+	}
+	if (token == "selfplay")
+	{
+		// MCTSの自己対局で教師局面(SelfPlayRecord)を生成する。DNNスレッドを共有する複数の探索インスタンスで並行して対局する。
+		// user selfplay [出力ファイル] [対局数] [1手の探索ノード数] [ランダムに指す手数] [インスタンス数] [1インスタンスのハッシュ(MB)] [引き分けとする手数]
+		// インスタンス数が0なら、DNNのバッチを埋められる数にする。出力ファイルには追記する。
+		// isreadyでモデルを読み込み終わっている必要がある。
+		string path;
+		int n_games = 10, n_instances = 0, hash_mb = 64;
+		SelfPlaySettings settings;
+		settings.nodes = 800;
+		settings.random_plies = 16;
+		settings.max_ply = 320;
+		is >> path >> n_games >> settings.nodes >> settings.random_plies >> n_instances >> hash_mb >> settings.max_ply;
+		if (n_instances <= 0)
+		{
+			// インスタンスあたりの評価待ちがsearch_batch_size程度になるようにする
+			n_instances = (int)(batch_size * n_gpu_threads * 2 / std::max(search_batch_size, 1));
+		}
+		n_instances = std::max(std::min(n_instances, n_games), 1);
+		SelfPlayWriter writer;
+		if (!writer.open(path))
+		{
+			sync_cout << "info string cannot open " << path << sync_endl;
+			return;
+		}
+		size_t pending;
+		vector<SearchInstance *> instances = create_search_instances(n_instances, hash_mb, pending);
+		sync_cout << "info string selfplay " << n_games << " games, " << settings.nodes << " nodes, random " << settings.random_plies << " plies, "
+				  << n_instances << " instances, pending " << pending << sync_endl;
+
+		int batches_start = n_dnn_evaled_batches, samples_start = n_dnn_evaled_samples;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		SelfPlayGenerator generator(instances, writer, settings);
+		generator.run(n_games);
+		writer.close();
+		double elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+		int d_batches = n_dnn_evaled_batches - batches_start, d_samples = n_dnn_evaled_samples - samples_start;
+		sync_cout << "info string selfplay done " << elapsed << " sec, " << writer.n_written() << " positions written, "
+				  << (int)(generator.n_positions / std::max(elapsed, 0.001)) << " positions/s, nps " << (int)(d_samples / std::max(elapsed, 0.001))
+				  << ", average bs " << (d_batches > 0 ? d_samples / d_batches : 0) << sync_endl;
+		for (auto inst : instances)
+		{
+			delete inst;
+		}
+	}
+	if (token == "tracesum")
+	{
+		// 探索トレース(SearchTraceオプション)のファイルを集計して表示する。
+		// user tracesum [ファイル名]
+		string path;
+		is >> path;
+		vector<string> lines;
+		if (!SearchTrace::summarize(path, lines))
+		{
+			sync_cout << "info string failed to read trace " << path << sync_endl;
+			return;
+		}
+		for (auto &line : lines)
+		{
+			sync_cout << "info string " << line << sync_endl;
+		}
+	}
+	if (token == "queuebench")
+	{
+		// DNN評価の要求・結果の受け渡しに使うキューの性能を、MTQueue(従来)とMPMCQueue(DnnEvalQueue)で比較する。
+		// 探索スレッドを模したプロデューサを1から倍々に増やし、DNNスレッドを模したコンシューマがまとめて取り出す。
+		// user queuebench [プロデューサ数の最大値] [プロデューサあたりの要素数] [投入単位] [取り出し単位] [コンシューマ数]
+		int max_producers = 64, push_size = 8, pop_size = 256, n_consumers = 1;
+		uint64_t items_per_producer = 100000;
+		is >> max_producers >> items_per_producer >> push_size >> pop_size >> n_consumers;
+		push_size = std::max(push_size, 1);
+		pop_size = std::max(pop_size, 1);
+		n_consumers = std::max(n_consumers, 1);
+		for (int n_producers = 1; n_producers <= max_producers; n_producers *= 2)
+		{
+			MTQueue<uint64_t> mt_queue;
+			mt_queue.set_batch_size_limit(0);
+			// 容量は実際の評価要求のキューと同じにする(isready前ならbatch_sizeが0で最小値になる)
+			MPMCQueue<uint64_t> mpmc_queue(dnn_queue_capacity());
+			double mt_rate = queue_bench_run(mt_queue, n_producers, n_consumers, items_per_producer, push_size, pop_size);
+			double mpmc_rate = queue_bench_run(mpmc_queue, n_producers, n_consumers, items_per_producer, push_size, pop_size);
+			sync_cout << "info string queuebench producers " << n_producers << " consumers " << n_consumers
+					  << " mtqueue " << (int)mt_rate << " items/s mpmc " << (int)mpmc_rate << " items/s"
+					  << (mt_rate < 0 || mpmc_rate < 0 ? " (MISMATCH)" : "") << sync_endl;
+		}
+	}
+	if (token == "dnnxferbench")
+	{
+		// 外部の評価プロセス(nenefwd)との入出力の受け渡しにかかる時間を、TCPと共有メモリで比較する。
+		// 評価プロセスはモデルを実行しないので、受け渡しだけの往復時間と転送速度が得られる。
+		// user dnnxferbench [反復回数] [バッチサイズ...]
+		int iterations = 200;
+		is >> iterations;
+		vector<int> batch_sizes;
+		int bs;
+		while (is >> bs)
+		{
+			batch_sizes.push_back(std::max(bs, 1));
+		}
+		if (batch_sizes.empty())
+		{
+			batch_sizes = { 1, 16, 64, 256 };
+		}
+		string gpu = Options["GPU"];
+		external_transport_bench(Options["EvalDir"], stoi(gpu.substr(0, gpu.find(','))), iterations, batch_sizes);
+	}
+	if (token == "packbench")
+	{
+		// 入力行列のパック形式(DNNPackedInput)を、平手からランダムに指し進めた局面で確かめる。
+		// 展開した結果がfloatの入力行列と一致するかと、1局面あたりのバイト数・書き込みと展開の所要時間を、board表現形式ごとに表示する。
+		// user packbench [局面数]
+		int n_positions = 1024;
+		is >> n_positions;
+		n_positions = std::max(n_positions, 1);
+		vector<string> sfens;
+		PRNG prng(20191208);
+		Position pos;
+		vector<StateInfo> states(MAX_PLY + 1);
+		pos.set_hirate(&states[0], Threads.main());
+		int ply = 0;
+		while ((int)sfens.size() < n_positions)
+		{
+			MoveList<LEGAL> moves(pos);
+			if (moves.size() == 0 || ply >= MAX_PLY)
+			{
+				pos.set_hirate(&states[0], Threads.main());
+				ply = 0;
+				continue;
+			}
+			Move m = moves.begin()[prng.rand<uint32_t>() % moves.size()];
+			pos.do_move(m, states[++ply]);
+			sfens.push_back(pos.sfen());
+		}
+
+		for (int format_board = 0; format_board < 2; format_board++)
+		{
+			DNNConverter converter(format_board, 1);
+			auto input_shape = converter.board_shape();
+			size_t sample_size = accumulate(input_shape.begin(), input_shape.end(), 1, std::multiplies<int>());
+			PackedBoardFormat packed_format = converter.packed_format();
+			size_t packed_bytes = packed_format.bytes();
+			vector<float> arrays(sample_size * n_positions);
+			vector<uint8_t> packed(packed_bytes * n_positions);
+			vector<float> unpacked(sample_size * n_positions);
+			std::chrono::steady_clock::duration array_time(0), packed_time(0);
+			for (int i = 0; i < n_positions; i++)
+			{
+				StateInfo si;
+				pos.set(sfens[i], &si, Threads.main());
+				auto start = std::chrono::steady_clock::now();
+				converter.get_board_array(pos, &arrays[sample_size * i]);
+				auto middle = std::chrono::steady_clock::now();
+				converter.get_board_packed(pos, &packed[packed_bytes * i]);
+				packed_time += std::chrono::steady_clock::now() - middle;
+				array_time += middle - start;
+			}
+			auto unpack_start = std::chrono::steady_clock::now();
+			packed_format.unpack(packed.data(), n_positions, unpacked.data());
+			auto unpack_time = std::chrono::steady_clock::now() - unpack_start;
+			int n_mismatch = 0;
+			for (int i = 0; i < n_positions; i++)
+			{
+				if (memcmp(&arrays[sample_size * i], &unpacked[sample_size * i], sizeof(float) * sample_size) != 0)
+				{
+					n_mismatch++;
+				}
+			}
+			auto ns_per_position = [&](std::chrono::steady_clock::duration d) {
+				return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / n_positions;
+			};
+			sync_cout << "info string packbench format " << format_board << " bytes " << sizeof(float) * sample_size << " -> " << packed_bytes
+				<< " (" << (double)(sizeof(float) * sample_size) / packed_bytes << "x) write " << ns_per_position(array_time) << "ns -> "
+				<< ns_per_position(packed_time) << "ns unpack " << ns_per_position(unpack_time) << "ns mismatched " << n_mismatch << " / " << n_positions << sync_endl;
+		}
+	}
+	if (token == "gccheck")
+	{
+		// 置換表のGC(MCTSTT::collect_garbage)を、小さな置換表にランダムな探索木と無関係なエントリを詰めて確かめる。
+		// GC前にルートから到達できたノードが、GC後もfind_entryで同じ子ノード情報のまま見つかるかと、解放したノード数を調べる。
+		// user gccheck [試行回数] [置換表のエントリ数]
+		int trials = 1000, hash_size = 64;
+		is >> trials >> hash_size;
+		size_t uct_hash_size = (size_t)1 << MSB64(std::max(hash_size, 16));
+		struct ReachableNode
+		{
+			Key key;
+			int game_ply;
+			vector<uint16_t> moves;
+			vector<uint32_t> value_n;
+		};
+		PRNG prng(20191215);
+		int n_failed = 0;
+		for (int trial = 0; trial < trials; trial++)
+		{
+			MCTSTT tt(uct_hash_size, uct_hash_size * 32);
+			vector<StateInfo> states(MAX_PLY + 1);
+			Move path[MAX_PLY];
+			Position pos;
+			pos.set_hirate(&states[0], Threads.main());
+			size_t n_created = 0;
+			// 新規作成したノードに全合法手を子ノードとして割り当て、内容を確かめられるよう訪問回数に目印を入れる
+			auto create = [&](Position &p) -> UCTNode * {
+				bool created = false;
+				UCTNode *node = tt.find_or_create_entry(p, created);
+				if (node && created)
+				{
+					n_created++;
+					MoveList<LEGAL> ml(p);
+					int n_children = std::min((int)ml.size(), MAX_UCT_CHILDREN);
+					if (n_children > 0 && tt.alloc_children(node, n_children))
+					{
+						node->n_children = n_children;
+						UCTChildren ch = tt.children(node);
+						for (int i = 0; i < n_children; i++)
+						{
+							ch.move_list[i] = (uint16_t)ml.begin()[i].move;
+							ch.value_n[i] = (uint32_t)(p.key() >> 32) + i;
+						}
+					}
+				}
+				return node;
+			};
+			UCTNode *game_root = create(pos);
+			// ルートからランダムに子ノードをたどって初めての局面を作成することを、置換表が埋まるまで繰り返す。
+			// 小さな置換表でも木が深くなるよう、たどる手は先頭の2手に限る。
+			// 合間に無関係なキーのエントリも作り、解放されるエントリを線形探索の連なりに混ぜる。
+			bool full = false;
+			while (!full)
+			{
+				int ply = 0;
+				UCTNode *node = game_root;
+				while (node->n_children > 0 && ply < 16)
+				{
+					size_t n_created_before = n_created;
+					path[ply] = (Move)tt.children(node).move_list[prng.rand<uint32_t>() % std::min(node->n_children, 2)];
+					pos.do_move(path[ply], states[ply + 1]);
+					ply++;
+					node = create(pos);
+					if (node == nullptr)
+					{
+						full = true;
+						break;
+					}
+					if (n_created != n_created_before)
+					{
+						break;
+					}
+				}
+				while (ply > 0)
+				{
+					pos.undo_move(path[--ply]);
+				}
+				bool created = false;
+				if (tt.find_or_create_entry(prng.rand<Key>(), prng.rand<uint32_t>() % 4, created) == nullptr)
+				{
+					full = true;
+				}
+				else if (created)
+				{
+					n_created++;
+				}
+			}
+
+			// GCのルートは最初の手を指した局面とし、他の手の先は(合流しない限り)解放させる
+			UCTNode *gc_root = nullptr;
+			while (gc_root == nullptr)
+			{
+				path[0] = (Move)tt.children(game_root).move_list[prng.rand<uint32_t>() % std::min(game_root->n_children, 2)];
+				pos.do_move(path[0], states[1]);
+				gc_root = tt.find_entry(pos);
+				if (gc_root == nullptr)
+				{
+					pos.undo_move(path[0]);
+				}
+			}
+			// GC前に到達できるノードを、MCTSTT::mark_reachableと同じ手順で集める
+			vector<ReachableNode> reachable;
+			std::unordered_set<UCTNode *> visited;
+			std::function<void(UCTNode *, int)> collect = [&](UCTNode *node, int ply) {
+				if (!visited.insert(node).second)
+				{
+					return;
+				}
+				UCTChildren ch = tt.children(node);
+				reachable.push_back(ReachableNode{ pos.key(), pos.game_ply(), vector<uint16_t>(ch.move_list, ch.move_list + node->n_children),
+					vector<uint32_t>(ch.value_n, ch.value_n + node->n_children) });
+				for (int i = 0; i < node->n_children; i++)
+				{
+					Move m = (Move)ch.move_list[i];
+					pos.do_move(m, states[ply + 1]);
+					UCTNode *child_node = tt.find_entry(pos);
+					if (child_node)
+					{
+						collect(child_node, ply + 1);
+					}
+					pos.undo_move(m);
+				}
+			};
+			collect(gc_root, 1);
+
+			size_t n_freed = tt.collect_garbage(pos);
+			int n_lost = 0, n_changed = 0;
+			for (auto &rn : reachable)
+			{
+				UCTNode *node = tt.find_entry(rn.key, rn.game_ply);
+				if (node == nullptr)
+				{
+					n_lost++;
+					continue;
+				}
+				UCTChildren ch = tt.children(node);
+				if (node->n_children != (int)rn.moves.size()
+					|| !std::equal(rn.moves.begin(), rn.moves.end(), ch.move_list)
+					|| !std::equal(rn.value_n.begin(), rn.value_n.end(), ch.value_n))
+				{
+					n_changed++;
+				}
+			}
+			size_t n_expected_freed = n_created - reachable.size();
+			if (n_lost > 0 || n_changed > 0 || n_freed != n_expected_freed)
+			{
+				n_failed++;
+				sync_cout << "info string gccheck trial " << trial << " reachable " << reachable.size() << " lost " << n_lost << " changed " << n_changed
+					<< " freed " << n_freed << " expected " << n_expected_freed << sync_endl;
+			}
+		}
+		sync_cout << "info string gccheck " << trials << " trials, " << n_failed << " failed" << sync_endl;
+	}
+	if (token == "selectbench")
+	{
+		// 子ノード選択(PUCT)の1回あたりの所要時間をベンチマークする。
+		// 乱数で作った統計値を持つ多数のノードを順に選択し、スカラー版とAVX2版を比較する。
+		// user selectbench [子ノード数] [選択回数]
+		int n_children = MAX_UCT_CHILDREN;
+		uint64_t iterations = 10000000;
+		is >> n_children >> iterations;
+		n_children = std::max(1, std::min(n_children, (int)MAX_MOVES));
+		const size_t n_nodes = 4096;
+		const size_t stride = ((size_t)n_children + UCT_CHILDREN_ALIGN - 1) / UCT_CHILDREN_ALIGN * UCT_CHILDREN_ALIGN;
+		size_t total = n_nodes * stride;
+		size_t bytes = total * MCTSTT::child_bytes;
+		char *memory = (char *)large_memory_alloc(bytes);
+		if (memory == nullptr)
+		{
+			sync_cout << "info string failed to allocate memory" << sync_endl;
+			return;
+		}
+		// MCTSTTと同じく、要素サイズの大きい順に並べて各配列の先頭を揃える
+		double *value_w = (double *)memory;
+		uint32_t *value_n = (uint32_t *)(value_w + total);
+		uint32_t *value_vloss = value_n + total;
+		float *value_p = (float *)(value_vloss + total);
+		uint16_t *move_list = (uint16_t *)(value_p + total);
+		uint8_t *proof = (uint8_t *)(move_list + total);
+		memset(memory, 0, bytes);
+		vector<uint64_t> node_n_sum(n_nodes);
+		vector<uint32_t> node_vloss_sum(n_nodes);
+		PRNG prng(20190401);
+		for (size_t node = 0; node < n_nodes; node++)
+		{
+			size_t offset = node * stride;
+			float p_sum = 0.0F;
+			for (int i = 0; i < n_children; i++)
+			{
+				// 未訪問の子ノードも一定割合で混ぜる
+				uint32_t n = prng.rand<uint32_t>() % 4 == 0 ? 0 : prng.rand<uint32_t>() % 1000;
+				value_n[offset + i] = n;
+				value_vloss[offset + i] = prng.rand<uint32_t>() % 4;
+				value_w[offset + i] = n * ((prng.rand<uint32_t>() % 1001) / 1000.0);
+				value_p[offset + i] = (float)(prng.rand<uint32_t>() % 1000 + 1);
+				proof[offset + i] = prng.rand<uint32_t>() % 16 == 0 ? EDGE_PROOF_LOSS : EDGE_PROOF_NONE;
+				p_sum += value_p[offset + i];
+				node_n_sum[node] += n;
+				node_vloss_sum[node] += value_vloss[offset + i];
+			}
+			for (int i = 0; i < n_children; i++)
+			{
+				value_p[offset + i] /= p_sum;
+			}
+		}
+		auto children_of = [&](size_t node) {
+			size_t offset = node * stride;
+			return UCTChildren{ &move_list[offset], &value_n[offset], &value_vloss[offset], &value_w[offset], &value_p[offset], &proof[offset] };
+		};
+		const float c_puct = 1.0F, virtual_loss = 1.0F;
+
+		auto run = [&](const char *name, size_t(*kernel)(const UCTChildren &, int, uint64_t, uint32_t, float, float), vector<uint16_t> &picks) {
+			uint64_t checksum = 0;
+			std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
+#ifdef USE_AVX2
+			uint64_t tsc_start = __rdtsc();
+#endif
+			for (uint64_t it = 0; it < iterations; it++)
+			{
+				size_t node = it % n_nodes;
+				size_t best = kernel(children_of(node), n_children, node_n_sum[node], node_vloss_sum[node], c_puct, virtual_loss);
+				checksum += best;
+				if (it < n_nodes)
+				{
+					picks[node] = (uint16_t)best;
+				}
+			}
+#ifdef USE_AVX2
+			uint64_t tsc_end = __rdtsc();
+#endif
+			std::chrono::system_clock::time_point end = std::chrono::system_clock::now();
+			double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+			sync_cout << "info string " << name << ": " << ns / iterations << " ns/select"
+#ifdef USE_AVX2
+				<< ", " << (double)(tsc_end - tsc_start) / iterations << " cycles/select"
+#endif
+				<< ", checksum=" << checksum << sync_endl;
+		};
+
+		sync_cout << "info string selectbench children=" << n_children << " iterations=" << iterations << sync_endl;
+		vector<uint16_t> picks_scalar(n_nodes), picks_simd(n_nodes);
+		run("scalar", puct_select_scalar, picks_scalar);
+#ifdef USE_AVX2
+		run("avx2", puct_select_avx2, picks_simd);
+		// Wの合計以外は単精度で計算するので、スカラー版と同値のときなどに選択がずれることがある
+		int n_mismatch = 0;
+		for (size_t node = 0; node < std::min(n_nodes, (size_t)iterations); node++)
+		{
+			if (picks_scalar[node] != picks_simd[node])
+			{
+				n_mismatch++;
+			}
+		}
+		sync_cout << "info string mismatched picks " << n_mismatch << " / " << std::min(n_nodes, (size_t)iterations) << sync_endl;
+#endif
+		large_memory_free(memory, bytes);
+	}
+	if (token == "cpucalib")
+	{
+		// CPUでの評価(DNNBackend=cpu)を8bit化するための活性値のスケールを、棋譜の局面から決めてEvalDir/model_cpu.calibに保存する。
+		// floatとの精度差と、バッチサイズごとの速度比も表示する。DNNCpuInt8をtrueにすると、次のisreadyから8bitで評価する。
+		// user cpucalib [PackedSfenValue形式の棋譜] [較正に使う局面数] [比較に使う局面数] [パーセンタイル]
+		string path;
+		int n_calib = 2048, n_eval = 2048;
+		double percentile = 99.99;
+		is >> path >> n_calib >> n_eval >> percentile;
+		string evalDir = Options["EvalDir"];
+		int n_threads = (int)Options["DNNCpuThreads"];
+		if (n_threads == 0)
+		{
+			n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+		}
+		bool ok = cpu_int8_calibration(evalDir, path, n_calib, n_eval, percentile, (int)Options["DNNFormatBoard"], (int)Options["DNNFormatMove"], n_threads);
+		sync_cout << "info string cpucalib " << (ok ? "succeeded" : "failed") << sync_endl;
+	}
+#if !defined(DNN_EXTERNAL) && !defined(DNN_CPU)
 	if (token == "tensorrt_engine_builder")
 	{
 		sync_cout << "info string tensorrt_engine_builder start" << sync_endl;
@@ -110,9 +770,23 @@ void USI::extra_option(USI::OptionsMap &o)
 	o["GPU"] << Option("-1");					  //使用するGPU番号(-1==CPU)、カンマ区切りで複数指定可能
 	o["DNNFormatBoard"] << Option(0, 0, 16);	  //DNNのboard表現形式
 	o["DNNFormatMove"] << Option(0, 0, 16);		  //DNNのmove表現形式
+	o["DNNBackend"] << Option(dnn_backend_names(), dnn_backend_names()[0]); //DNNの評価方法(tensorrt: TensorRTでGPU評価, external: 外部プロセス(nenefwd), cpu: CPUで評価, mock: モデルを使わず局面のハッシュから決まる値を返す)
+	o["DNNCpuThreads"] << Option(0, 0, 1024);	  //CPUで評価する場合(DNNBackend=cpu)の、DNNスレッド1つあたりの計算スレッド数(0なら論理CPU数/DNNスレッド数)
+	o["DNNCpuInt8"] << Option(false);			  //CPUで評価する場合(DNNBackend=cpu)に、EvalDir/model_cpu.calib(user cpucalibで作成)を読み込んで8bitで評価する
+	o["DNNMockLatency"] << Option(1000, 0, 1000000); //DNNBackend=mockで、1バッチの評価にかける時間[us]
+	o["DNNMockSampleLatency"] << Option(10, 0, 100000); //DNNBackend=mockで、1局面ごとに追加でかける時間[us]
+#ifdef _WIN32
+	o["DNNExternalShm"] << Option(false);		  //外部プロセスで評価する場合(DNNBackend=external)に、TCPではなく共有メモリで入出力を受け渡す(Linuxのみ)
+#else
+	o["DNNExternalShm"] << Option(true);		  //外部プロセスで評価する場合(DNNBackend=external)に、TCPではなく共有メモリで入出力を受け渡す(Linuxのみ)
+#endif
+	o["DNNPackedInput"] << Option(true);		  //探索スレッドからDNNスレッド・評価プロセスへ、入力行列をビット単位に詰めて渡す(評価器側でfloatに展開する)
 	o["LeafMateSearchDepth"] << Option(0, 0, 16); //末端局面での詰み探索深さ(0なら探索しない)
+	o["LeafMateThreads"] << Option(2, 0, 256);	  //末端局面での詰み探索を行う専用スレッド数(0なら探索スレッド上で同期的に行う)
 	o["MCTSHash"] << Option(1024, 1, 1048576);	//MCTSのハッシュテーブルサイズ(MB)
+	o["MaxUCTChildren"] << Option(MAX_UCT_CHILDREN, 1, MAX_MOVES); //1ノードに記録する子ノード数の最大値(事前確率上位から)
 	o["RootMateSearch"] << Option(false);		  //ルート局面からの詰み探索専用スレッドを用いるか(Threadsのうちの1つが使われる)
+	o["RootMateThreads"] << Option(1, 1, 256);	  //ルート局面からの詰み探索に使うスレッド数(Threadsのうち末尾から、置換表を共有して並列に探索する)
 	o["PolicyOnly"] << Option(false);			  //policy評価だけで指し手を決定し、探索を行わない
 	o["LimitedBatchSize"] << Option(16, 1, 65536);
 	o["LimitedUntil"] << Option(0, 0, 1000000); //ルートのvalue_n_sumがこの値未満の時、バッチサイズがLimitedBatchSizeだとみなして評価待ち要素数を制限する
@@ -121,13 +795,50 @@ void USI::extra_option(USI::OptionsMap &o)
 	o["CPuct"] << Option(100, 1, 10000);			   //c_puctの100倍
 	o["PrintStatusInterval"] << Option(0, 0, 1000000); //ルートノードの状態表示間隔[nodes]
 	o["EarlyStopProb"] << Option(0, 0, 100);		   //指し手変化確率[%]がこれを下回ったら、予定時間にかかわらず指す
+	o["GlobalTreeLock"] << Option(false);			   //MCTSの木全体を1つのmutexでロックする旧方式で探索する(A/B比較用)
+	o["NodeGCHashfull"] << Option(500, 0, 1000);		   //思考開始時にhashfull(千分率)がこの値以上なら、ルートから到達できないノードを解放する
+	o["SearchBatchSize"] << Option(8, 1, 1024);		   //探索スレッドが1回の木の走査でまとめて選択する末端局面数
+	o["PendingControlInterval"] << Option(100, 0, 10000); //評価待ち数の上限をDNNの稼働状況から調整する間隔[ms](0なら従来の固定式)
+	o["PendingCollisionMax"] << Option(10, 0, 100);	   //評価待ちノードへの重複到達率[%]がこれを超えたら評価待ち数の上限を下げる
+	o["PendingControlLog"] << Option(false);		   //評価待ち数の上限の調整内容をinfo stringで表示する
+	o["SearchTrace"] << Option(false);				   //探索の計測値(キューの長さ、バッチサイズ、ロック待ち時間等)を一定間隔で記録し、思考ごとにCSVファイルへ書き出す
+	o["SearchTracePath"] << Option("trace");		   //探索トレースのファイル名の接頭辞(<接頭辞>_<通し番号>_ply<手数>.csv)
+	o["SearchTraceInterval"] << Option(10, 1, 10000);  //探索トレースの記録間隔[ms]
+	o["ThreadAffinity"] << Option(vector<string>{ "none", "node", "core" }, "none"); //探索・DNN・詰み探索スレッドのCPUへの固定方針(none:固定しない node:NUMAノード単位 core:論理CPU単位)
+}
+
+// ハッシュサイズ(MB)と1ノードの最大子ノード数からMCTSオブジェクトを作成する。
+static MCTS *create_mcts(int hash_size_mb, int max_children)
+{
+	size_t uct_hash_size, children_capacity;
+	MCTSTT::calc_uct_hash_size(hash_size_mb, max_children, uct_hash_size, children_capacity);
+	MCTS *m = new MCTS(uct_hash_size, children_capacity);
+	m->max_children = max_children;
+	return m;
+}
+
+// 通常の探索木(mcts)と同じ設定の探索インスタンスを作成する。
+// 評価待ちの合計が通常の探索と同程度になるよう、インスタンスごとの上限を決めてpendingに返す。
+static vector<SearchInstance*> create_search_instances(int n_instances, int hash_size_mb, size_t &pending)
+{
+	pending = std::max(batch_size * n_gpu_threads * 2 / n_instances, (size_t)1);
+	vector<SearchInstance*> instances;
+	for (int i = 0; i < n_instances; i++)
+	{
+		MCTS *m = create_mcts(hash_size_mb, mcts->max_children);
+		m->c_puct = mcts->c_puct;
+		m->virtual_loss = mcts->virtual_loss;
+		m->concurrent_tree = mcts->concurrent_tree;
+		instances.push_back(new SearchInstance(m, request_queues[i % request_queues.size()], pending, search_batch_size, gc_hashfull));
+	}
+	return instances;
 }
 
 // 起動時に呼び出される。時間のかからない探索関係の初期化処理はここに書くこと。
 void Search::init()
 {
 	// 環境変数で指定したサイズの置換表を事前確保
-	// 大会で、数十GBのメモリをisreadyの際に確保&ゼロクリアしようとすると数十秒かかる。
+	// 大会で、数十GBのメモリをisreadyの際に確保&ページ割り当てしようとすると時間がかかる。
 	// 対局開始になってからisreadyが来るため、相手を待たせてしまう。
 	// 起動時に環境変数でサイズを指定された場合は、ここで確保しておくことによりサーバログイン直後に時間を使える。
 	// 2局以上連続することは想定していない。最初の1局に対してのみ有効。
@@ -139,7 +850,7 @@ void Search::init()
 		{
 			advance_hash_init_thread = new std::thread([] {
 				sync_cout << "info string advance node hash initializing" << sync_endl;
-				mcts = new MCTS(MCTSTT::calc_uct_hash_size(advance_node_hash_size));
+				mcts = create_mcts(advance_node_hash_size, MAX_UCT_CHILDREN);
 				sync_cout << "info string advance node hash init completed" << sync_endl;
 			});
 		}
@@ -154,46 +865,61 @@ void Search::clear()
 		// 初期化する
 		gpu_lock_thread_start();
 		int hash_size_mb = (int)Options["MCTSHash"];
-		bool advance_initialized = false;
+		int max_children = (int)Options["MaxUCTChildren"];
 		if (advance_hash_init_thread)
 		{
 			// Search::initで専用初期化スレッドが開始しているので、それを待つ
-			if (hash_size_mb != advance_node_hash_size)
+			if (hash_size_mb != advance_node_hash_size || max_children != MAX_UCT_CHILDREN)
 			{
 				//サイズが間違ってるのでエラーとして終了
-				sync_cout << "info string node hash size mismatch! " << hash_size_mb << "!=" << advance_node_hash_size << sync_endl;
+				sync_cout << "info string node hash size mismatch! " << hash_size_mb << "!=" << advance_node_hash_size
+					<< " or MaxUCTChildren " << max_children << "!=" << MAX_UCT_CHILDREN << sync_endl;
 				return;
 			}
 			advance_hash_init_thread->join();
 			delete advance_hash_init_thread;
 			advance_hash_init_thread = nullptr;
-			advance_initialized = true;
 		}
 		else
 		{
-			mcts = new MCTS(MCTSTT::calc_uct_hash_size(hash_size_mb));
+			mcts = create_mcts(hash_size_mb, max_children);
 		}
 		// mcts->virtual_loss = (int)Options["VirtualLoss"];
 		mcts->virtual_loss = stof((string)Options["VirtualLoss"]);
 		mcts->c_puct = ((int)Options["CPuct"]) * 0.01F;
+		mcts->concurrent_tree = !(bool)Options["GlobalTreeLock"];
 		batch_size = (int)Options["BatchSize"];
 		limited_batch_size = (int)Options["LimitedBatchSize"];
 		limited_until = (int)Options["LimitedUntil"];
 		pv_interval = (int)Options["PvInterval"];
 		print_status_interval = (int)Options["PrintStatusInterval"];
 		early_stop_prob = (int)Options["EarlyStopProb"];
+		gc_hashfull = (int)Options["NodeGCHashfull"];
+		search_batch_size = (int)Options["SearchBatchSize"];
+		pending_control_interval = (int)Options["PendingControlInterval"];
+		pending_collision_max = (int)Options["PendingCollisionMax"] * 0.01F;
+		pending_control_log = (bool)Options["PendingControlLog"];
+		search_trace_enabled = (bool)Options["SearchTrace"];
+		search_trace_path = (string)Options["SearchTracePath"];
+		search_trace_interval = (int)Options["SearchTraceInterval"];
 		if (pv_interval == 0)
 		{
 			//PVの定期的な表示をしない
 			pv_interval = 100000000;
 		}
-		nodes_limit = (int)Options["NodesLimit"];
-		if (nodes_limit <= 0)
+		nodes_limit = (uint64_t)(int64_t)Options["NodesLimit"];
+		if (nodes_limit == 0)
 		{
-			nodes_limit = NODES_LIMIT_MAX;
+			nodes_limit = UINT64_MAX;
 		}
 		policy_only = (bool)Options["PolicyOnly"];
 
+		// 以降に作成するスレッドの配置方針
+		if (!set_thread_affinity_policy((string)Options["ThreadAffinity"]))
+		{
+			sync_cout << "info string unknown ThreadAffinity, threads are not pinned" << sync_endl;
+		}
+
 		sync_cout << "info string initializing dnn threads" << sync_endl;
 		vector<int> gpuIds;
 		string evalDir = Options["EvalDir"];
@@ -207,23 +933,39 @@ void Search::clear()
 				gpuIds.push_back(gpu_id);
 			}
 		}
-		start_dnn_threads(evalDir, (int)Options["DNNFormatBoard"], (int)Options["DNNFormatMove"], gpuIds);
+		dnn_cpu_threads = (int)Options["DNNCpuThreads"];
+		dnn_cpu_int8 = (bool)Options["DNNCpuInt8"];
+		dnn_mock_batch_latency_us = (int)Options["DNNMockLatency"];
+		dnn_mock_sample_latency_us = (int)Options["DNNMockSampleLatency"];
+		dnn_external_shm = (bool)Options["DNNExternalShm"];
+		dnn_packed_input = (bool)Options["DNNPackedInput"];
+		start_dnn_threads((string)Options["DNNBackend"], evalDir, (int)Options["DNNFormatBoard"], (int)Options["DNNFormatMove"], gpuIds);
 
 		// スレッド間キュー初期化
 		int threads = (int)Options["Threads"];
 		for (int i = 0; i < threads; i++)
 		{
-			response_queues.push_back(new MTQueue<dnn_eval_obj *>());
+			response_queues.push_back(new DnnEvalQueue(dnn_queue_capacity()));
+			dup_eval_pools.push_back(new DupEvalChainPool(64));
+			eval_obj_pools.push_back(new DnnEvalObjPool(16));
 		}
+		thread_playouts = vector<atomic<uint64_t>>(threads);
 
 		// 末端詰み探索の初期化
 		int LeafMateSearchDepth = (int)Options["LeafMateSearchDepth"];
+		int LeafMateThreads = (int)Options["LeafMateThreads"];
+		if (LeafMateSearchDepth > 0 && LeafMateThreads > 0)
+		{
+			// 探索スレッドは局面を投入するだけで、詰み探索は専用スレッドで行う
+			leaf_mate_workers = new LeafMateWorkers(mcts, LeafMateThreads, LeafMateSearchDepth, LEAF_MATE_QUEUE_CAPACITY);
+		}
 		for (int i = 0; i < threads; i++)
 		{
-			if (LeafMateSearchDepth > 0)
+			if (LeafMateSearchDepth > 0 && !leaf_mate_workers)
 			{
 				auto ms = new MateEngine::MateSearchForMCTS();
-				ms->init(16, LeafMateSearchDepth);
+				// 置換表は使用する探索スレッドのノードに確保する(探索スレッドの番号はslaveの通し番号)
+				run_on_thread_node(std::max(i - 1, 0), [&] { ms->init(16, LeafMateSearchDepth); });
 				leaf_mate_searchers.push_back(ms);
 			}
 			else
@@ -235,15 +977,24 @@ void Search::clear()
 		// ルート局面からの詰み探索
 		if ((bool)Options["RootMateSearch"])
 		{
-			root_mate_thread_id = threads - 1; //最終スレッドを使う
-			auto ms = new MateEngine::MateSearchForMCTS();
-			ms->init(128, MAX_PLY);
-			root_mate_searcher = ms;
-			normal_slave_threads = threads - 2;
+			// 末尾のスレッドを使う。通常探索のslaveスレッドを最低1つ残す。
+			int root_mate_threads = std::max(std::min((int)Options["RootMateThreads"], threads - 2), 1);
+			root_mate_first_thread_id = threads - root_mate_threads;
+			// 置換表は全スレッドで共有し、スレッド数に応じて大きくする
+			root_mate_table = new MateEngine::TranspositionTable();
+			root_mate_table->Resize(128 * root_mate_threads);
+			for (int i = 0; i < root_mate_threads; i++)
+			{
+				auto ms = new MateEngine::MateSearchForMCTS();
+				// 先頭のスレッドは従来の手順で探索し、他のスレッドは同点の手を調べる順序を変えて別の筋を読む
+				ms->init_shared(root_mate_table, MAX_PLY, i * 0x9E3779B97F4A7C15ULL, &root_mate_found);
+				root_mate_searchers.push_back(ms);
+			}
+			normal_slave_threads = threads - 1 - root_mate_threads;
 		}
 		else
 		{
-			root_mate_thread_id = -1;
+			root_mate_first_thread_id = -1;
 			normal_slave_threads = threads - 1;
 		}
 
@@ -271,6 +1022,8 @@ static void reset_stats()
 {
 	n_dnn_evaled_batches = 0;
 	n_dnn_evaled_samples = 0;
+	mcts->n_expand_failed = 0;
+	n_leaf_dup = 0;
 }
 
 // 探索に関する統計情報の表示。
@@ -283,6 +1036,34 @@ static void display_stats()
 																					" average bs="
 			  << avg_batchsize << " (" << (avg_batchsize * 100 / batch_size) << "%)"
 			  << sync_endl;
+	size_t dup_pool_size = 0;
+	for (auto pool : dup_eval_pools)
+	{
+		dup_pool_size += pool->created();
+	}
+	sync_cout << "info string dup eval " << n_leaf_dup << " paths, pool " << dup_pool_size << sync_endl;
+	if (pending_control_interval > 0)
+	{
+		sync_cout << "info string pending budget " << pending_budget << " (+" << pending_control_increases
+				  << " -" << pending_control_decreases << ")" << sync_endl;
+	}
+	size_t eval_obj_created = 0;
+	for (auto pool : eval_obj_pools)
+	{
+		eval_obj_created += pool->created();
+	}
+	sync_cout << "info string eval obj pool " << eval_obj_created << " objects ("
+			  << ((eval_obj_created * sizeof(dnn_eval_obj)) >> 20) << "MB)" << sync_endl;
+	if (leaf_mate_workers)
+	{
+		sync_cout << "info string leaf mate " << leaf_mate_workers->n_submitted << " jobs, " << leaf_mate_workers->n_found << " found, "
+				  << leaf_mate_workers->n_rejected << " rejected, " << leaf_mate_workers->n_discarded << " discarded" << sync_endl;
+	}
+	uint64_t n_expand_failed = mcts->n_expand_failed;
+	if (n_expand_failed > 0)
+	{
+		sync_cout << "info string node hash full, " << n_expand_failed << " expansions skipped" << sync_endl;
+	}
 }
 
 static int winrate_to_cp(float winrate)
@@ -325,13 +1106,28 @@ static vector<Move> display_pv(UCTNode *root, Position &rootPos)
 	return pv;
 }
 
+// 置換表の使用率が高ければ、前回までの探索木のうち現局面から到達できない部分を解放する。
+static void collect_garbage(Position &rootPos)
+{
+	int hashfull = mcts->get_hashfull();
+	if (hashfull < gc_hashfull)
+	{
+		return;
+	}
+	int start_ms = Time.elapsed();
+	size_t n_freed = mcts->collect_garbage(rootPos);
+	sync_cout << "info string node gc hashfull " << hashfull << " -> " << mcts->get_hashfull()
+		<< ", freed " << n_freed << " nodes in " << (Time.elapsed() - start_ms) << " ms" << sync_endl;
+}
+
 static UCTNode *make_initial_nodes(Position &rootPos)
 {
+	collect_garbage(rootPos);
 	// ルートノードの作成
 #if 0
 	// ルートだけを作成するのはバッチサイズが埋まらない&直後に同じ浅いノードの評価が殺到して評価値がゆがむので、
 	// 幅優先探索でノードをまとめて評価を行い、置換表を埋めておく（backupはしない）
-	MCTSSearchInfo sei(cvt, request_queues[0 % request_queues.size()], response_queues[0], nullptr);
+	MCTSSearchInfo sei(cvt, request_queues[0 % request_queues.size()], response_queues[0], nullptr, nullptr, eval_obj_pools[0]);
 	int n_put = 0;
 	UCTNode *root = mcts->make_root_with_children(rootPos, sei, n_put, batch_size);
 	int n_get = 0;
@@ -341,14 +1137,14 @@ static UCTNode *make_initial_nodes(Position &rootPos)
 		dnn_eval_obj *sentback;
 		sei.response_queue->pop(sentback);
 		mcts->backup_dnn(sentback, false);
-		delete sentback;
+		eval_obj_pools[0]->recycle(sentback);
 		n_get++;
 	}
 	sync_cout << "info string evaluated root children " << n_put << sync_endl;
 #else
 	// ルートノードだけ作る
 	MCTSSearchInfo sei(cvt, request_queues[0 % request_queues.size()], response_queues[0], nullptr);
-	dnn_eval_obj *eobj = new dnn_eval_obj();
+	dnn_eval_obj *eobj = eval_obj_pools[0]->alloc();
 	bool created;
 	UCTNode *root = mcts->make_root(rootPos, sei, eobj, created);
 	sync_cout << "info string created root " << created << " dnn " << sei.put_dnn_eval << sync_endl;
@@ -358,17 +1154,18 @@ static UCTNode *make_initial_nodes(Position &rootPos)
 		dnn_eval_obj *sentback;
 		sei.response_queue->pop(sentback);
 		mcts->backup_dnn(sentback);
-		delete sentback;
-		root->pprint();
+		eval_obj_pools[0]->recycle(sentback);
+		mcts->pprint(root);
 	}
 	else
 	{
-		delete eobj;
+		eval_obj_pools[0]->recycle(eobj);
 	}
 #endif
 	if (root->terminal)
 	{
-		// ルート局面にて以前詰みが見つかっているが、それだと指し手が決まらないのでそのフラグを解除して探索させる
+		// ルート局面にて以前詰みが見つかっているか勝敗が確定しているが、それだと指し手が決まらないのでそのフラグを解除して探索させる
+		// 子ノードの勝敗から確定していた場合は、最初のbackupで再び確定する
 		sync_cout << "info string root is terminal (found mate)" << sync_endl;
 		root->terminal = false;
 	}
@@ -383,21 +1180,236 @@ void update_pending_limit(UCTNode *root)
 	{
 		plimit_cand = limited_batch_size * n_gpu_threads * 2;
 	}
+	else if (pending_control_interval > 0 && pending_budget > 0)
+	{
+		plimit_cand = pending_budget;
+	}
 	else
 	{
 		plimit_cand = batch_size * n_gpu_threads * 2;
 	}
 #if 0
-	size_t plimit_cand = pending_limit_factor * log2(std::max(root->value_n_sum, 1));
+	size_t plimit_cand = pending_limit_factor * log2(std::max(root->value_n_sum, (uint64_t)1));
 	plimit_cand = std::min(std::max(plimit_cand, (size_t)16), batch_size * n_gpu_threads * 2);
 #endif
-	pending_limit = plimit_cand / normal_slave_threads;
+	pending_limit = std::max(plimit_cand / normal_slave_threads, (size_t)1);
+}
+
+// 評価待ち数の制御器の、前回の調整時点での計測値
+struct PendingControlSample
+{
+	int time_ms;
+	int batches;
+	int samples;
+	uint64_t leaf_dup;
+	uint64_t busy_us;
+};
+static PendingControlSample pending_control_last;
+
+static PendingControlSample take_pending_control_sample()
+{
+	return PendingControlSample{ Time.elapsed(), n_dnn_evaled_batches, n_dnn_evaled_samples, n_leaf_dup, n_dnn_busy_us };
+}
+
+// 思考開始時に呼ぶ。上限は前回の思考での値を引き継ぐ。
+static void start_pending_control()
+{
+	if (pending_budget == 0)
+	{
+		// 初回は従来の固定式の値から始める
+		pending_budget = batch_size * n_gpu_threads * 2;
+	}
+	pending_control_last = take_pending_control_sample();
+	pending_control_increases = pending_control_decreases = 0;
+}
+
+// DNNの稼働状況を見て、全スレッド合計の評価待ち数の上限(pending_budget)を調整する。masterから定期的に呼ぶ。
+// 評価待ちが多すぎると、virtual lossで探索が歪み、評価待ちノードへの重複到達も増える。
+// 少なすぎると、DNNのバッチが埋まらないか、DNNスレッドが要求を待って遊ぶ。
+// そこで、重複到達率が上限を超えたら下げ、DNNが要求を待っていれば上げ、どちらでもなければ少しずつ下げて、
+// DNNを使い切れる最小の値を探り続ける。
+static void control_pending_budget(UCTNode *root)
+{
+	if (pending_control_interval <= 0)
+	{
+		return;
+	}
+	PendingControlSample now = take_pending_control_sample();
+	int interval_ms = now.time_ms - pending_control_last.time_ms;
+	if (interval_ms < pending_control_interval)
+	{
+		return;
+	}
+	int d_batches = now.batches - pending_control_last.batches;
+	int d_samples = now.samples - pending_control_last.samples;
+	uint64_t d_dup = now.leaf_dup - pending_control_last.leaf_dup;
+	uint64_t d_busy_us = now.busy_us - pending_control_last.busy_us;
+	pending_control_last = now;
+	if (d_batches <= 0 || root->value_n_sum < limited_until)
+	{
+		// 計測値がないか、LimitedUntilにより意図的に制限している
+		return;
+	}
+
+	// バッチの充填率、DNNスレッドの稼働率、重複到達率
+	float fill = (float)d_samples / (d_batches * batch_size);
+	float busy = (float)d_busy_us / (interval_ms * 1000.0F * n_gpu_threads);
+	float collision = (float)d_dup / (d_samples + d_dup);
+	const float saturated = 0.9F;
+
+	size_t budget = pending_budget;
+	size_t new_budget;
+	const char *reason;
+	if (collision > pending_collision_max)
+	{
+		new_budget = budget * 4 / 5;
+		reason = "collision";
+	}
+	else if (fill < saturated || busy < saturated)
+	{
+		new_budget = std::max(budget * 5 / 4, budget + 1);
+		reason = "starved";
+	}
+	else
+	{
+		new_budget = budget - std::max(budget / 16, (size_t)1);
+		reason = "probe";
+	}
+	// 1スレッドあたり1個以上、固定式の4倍以下
+	new_budget = std::min(std::max(new_budget, normal_slave_threads), batch_size * n_gpu_threads * 8);
+	if (new_budget > budget)
+	{
+		pending_control_increases++;
+	}
+	else if (new_budget < budget)
+	{
+		pending_control_decreases++;
+	}
+	pending_budget = new_budget;
+
+	if (pending_control_log)
+	{
+		sync_cout << "info string pending " << budget << " -> " << new_budget << " (" << reason << ")"
+				  << " fill " << (int)(fill * 100) << "% busy " << (int)(busy * 100) << "% collision " << (int)(collision * 100)
+				  << "% latency " << (d_busy_us / d_batches) << "us" << sync_endl;
+	}
+}
+
+// 探索トレースの、前回の記録時点での累積値
+struct SearchTraceSample
+{
+	int time_ms;
+	int samples;
+	int batches;
+	uint64_t busy_us;
+	uint64_t leaf_dup;
+	uint64_t n_lock;
+	uint64_t lock_wait_ns;
+	uint64_t lock_hold_ns;
+	uint64_t mate_jobs;
+	uint64_t mate_busy_us;
+	vector<uint64_t> playouts;//通常探索のslaveスレッドごと
+};
+static SearchTraceSample search_trace_last;
+static int search_trace_next_ms = 0;
+
+static SearchTraceSample take_search_trace_sample()
+{
+	SearchTraceSample s{ Time.elapsed(), n_dnn_evaled_samples, n_dnn_evaled_batches, n_dnn_busy_us, n_leaf_dup,
+		mcts->n_lock_measured, mcts->lock_wait_ns, mcts->lock_hold_ns, 0, 0, {} };
+	if (leaf_mate_workers)
+	{
+		s.mate_jobs = leaf_mate_workers->n_submitted;
+		s.mate_busy_us = leaf_mate_workers->n_busy_us;
+	}
+	for (size_t i = 1; i <= normal_slave_threads; i++)
+	{
+		s.playouts.push_back(thread_playouts[i]);
+	}
+	return s;
+}
+
+// 思考開始時(slaveスレッドの起動前)に呼ぶ。SearchTraceがtrueなら、この思考のトレースファイルを作成して計測を始める。
+static void start_search_trace(const Position &rootPos)
+{
+	if (!search_trace_enabled)
+	{
+		return;
+	}
+	stringstream path;
+	path << search_trace_path << "_" << std::setw(4) << std::setfill('0') << search_trace_seq++ << "_ply" << rootPos.game_ply() << ".csv";
+	vector<string> columns = { "time_ms", "interval_ms", "nodes", "dnn_samples", "dnn_batches", "dnn_busy_us", "request_queue", "response_queue",
+		"pending_limit", "pending_budget", "leaf_dup", "lock_count", "lock_wait_us", "lock_hold_us", "leaf_mate_jobs", "leaf_mate_busy_us", "root_mate_threads" };
+	for (size_t i = 1; i <= normal_slave_threads; i++)
+	{
+		columns.push_back("playouts_" + std::to_string(i));
+	}
+	if (!search_trace.open(path.str(), columns))
+	{
+		sync_cout << "info string failed to open search trace " << path.str() << sync_endl;
+		return;
+	}
+	search_trace_file = path.str();
+	mcts->measure_lock = true;
+	search_trace_last = take_search_trace_sample();
+	search_trace_next_ms = search_trace_last.time_ms + search_trace_interval;
+}
+
+// masterから定期的に呼ぶ。前回の記録からSearchTraceInterval以上経っていれば(forceなら常に)1行記録する。
+static void sample_search_trace(UCTNode *root, bool force = false)
+{
+	if (!search_trace.is_open())
+	{
+		return;
+	}
+	SearchTraceSample now = take_search_trace_sample();
+	if (!force && now.time_ms < search_trace_next_ms)
+	{
+		return;
+	}
+	size_t request_depth = 0, response_depth = 0;
+	for (auto queue : request_queues)
+	{
+		request_depth += queue->size();
+	}
+	for (auto queue : response_queues)
+	{
+		response_depth += queue->size();
+	}
+	const SearchTraceSample &last = search_trace_last;
+	vector<int64_t> row = { now.time_ms, now.time_ms - last.time_ms, (int64_t)root->value_n_sum,
+		now.samples - last.samples, now.batches - last.batches, (int64_t)(now.busy_us - last.busy_us),
+		(int64_t)request_depth, (int64_t)response_depth, (int64_t)pending_limit, (int64_t)pending_budget,
+		(int64_t)(now.leaf_dup - last.leaf_dup), (int64_t)(now.n_lock - last.n_lock),
+		(int64_t)(now.lock_wait_ns / 1000 - last.lock_wait_ns / 1000), (int64_t)(now.lock_hold_ns / 1000 - last.lock_hold_ns / 1000),
+		(int64_t)(now.mate_jobs - last.mate_jobs), (int64_t)(now.mate_busy_us - last.mate_busy_us), root_mate_running };
+	for (size_t i = 0; i < now.playouts.size(); i++)
+	{
+		row.push_back((int64_t)(now.playouts[i] - last.playouts[i]));
+	}
+	search_trace.write_row(row);
+	search_trace_last = now;
+	search_trace_next_ms = now.time_ms + search_trace_interval;
+}
+
+// 全スレッドの探索終了後に呼ぶ。最後の区間を記録してファイルを閉じる。
+static void end_search_trace(UCTNode *root)
+{
+	if (!search_trace.is_open())
+	{
+		return;
+	}
+	sample_search_trace(root, true);
+	search_trace.close();
+	mcts->measure_lock = false;
+	sync_cout << "info string search trace " << search_trace_file << sync_endl;
 }
 
 // 探索途中でのルートノードからの各指し手情報のデバッグプリント
 void print_search_status(UCTNode *root)
 {
 	// 自動処理したいのでjsonでパースできるようにする
+	UCTChildren ch = mcts->children(root);
 	sync_cout << "info string PSS {";
 	std::cout << "\"moves\":[";
 	for (int i = 0; i < root->n_children; i++)
@@ -406,9 +1418,9 @@ void print_search_status(UCTNode *root)
 		{
 			std::cout << ",";
 		}
-		std::cout << "{\"move\":\"" << root->move_list[i] << "\",";
-		std::cout << "\"n\":" << root->value_n[i] << ",\"p\":" << root->value_p[i]
-				  << ",\"w\":" << root->value_w[i] << "}";
+		std::cout << "{\"move\":\"" << (Move)ch.move_list[i] << "\",";
+		std::cout << "\"n\":" << ch.value_n[i] << ",\"p\":" << ch.value_p[i]
+				  << ",\"w\":" << ch.value_w[i] << "}";
 	}
 	std::cout << "]}";
 	std::cout << sync_endl;
@@ -427,25 +1439,26 @@ bool decide_early_stop(UCTNode *root)
 	int nps = (int)((long long)n_dnn_evaled_samples * 1000 / max(elapsed_ms, 1));
 	int remaining_ms = Time.optimum() - Time.elapsed();
 	float estimated_future_nodes = nps * remaining_ms / 1000.0F;
-	float cur_nodes = root->value_n_sum;
+	uint64_t cur_nodes = root->value_n_sum;
 	if (cur_nodes < limited_until)
 	{
 		// 一定ノード数以上探索する
 		return false;
 	}
 
-	float max_nodes = -1;
+	uint32_t max_nodes = 0;
+	UCTChildren ch = mcts->children(root);
 	for (size_t i = 0; i < root->n_children; i++)
 	{
-		if (root->value_n[i] > max_nodes)
+		if (ch.value_n[i] > max_nodes)
 		{
-			max_nodes = root->value_n[i];
+			max_nodes = ch.value_n[i];
 		}
 	}
 
-	float pv_prob = max_nodes / cur_nodes;
+	float pv_prob = (float)((double)max_nodes / std::max(cur_nodes, (uint64_t)1));
 	// PVの確率、現在ノード数、今後探索できそうなノード数から、指し手が変化する確率を推定
-	float change_score = pv_prob * -5.326F + log2f(cur_nodes / 1024) * -0.306F + log2f(estimated_future_nodes / 1024) * 0.377F + 0.798F;
+	float change_score = pv_prob * -5.326F + log2f((float)cur_nodes / 1024) * -0.306F + log2f(estimated_future_nodes / 1024) * 0.377F + 0.798F;
 	float change_prob = 1.0F / (expf(-change_score) + 1.0F);
 	if (change_prob < (early_stop_prob / 100.0F))
 	{
@@ -454,6 +1467,35 @@ bool decide_early_stop(UCTNode *root)
 	return false;
 }
 
+// USIコマンドでThreads.stopかThreads.ponderが変更されたときに呼び出される。
+void search_event_handler()
+{
+	stop_event.notify_all();
+	tree_event.notify_all();
+}
+
+// 探索を停止させ、待機中のスレッドを起こす
+static void request_stop()
+{
+	Threads.stop = true;
+	stop_event.notify_all();
+	tree_event.notify_all();
+}
+
+// ponder中は指し手を返してはいけないので、stopかponderhitが来るまで待つ
+static void wait_ponder_end()
+{
+	while (true)
+	{
+		uint64_t event_gen = stop_event.generation();
+		if (!Threads.ponder || Threads.stop)
+		{
+			break;
+		}
+		stop_event.wait_for(event_gen, std::chrono::seconds(1));
+	}
+}
+
 // 探索開始時に呼び出される。
 // この関数内で初期化を終わらせ、slaveスレッドを起動してThread::search()を呼び出す。
 // そのあとslaveスレッドを終了させ、ベストな指し手を返すこと。
@@ -475,60 +1517,65 @@ void MainThread::think()
 		// 定跡
 		sync_cout << "info string book " << bookMove << sync_endl;
 		bestMove = bookMove;
-		while (Threads.ponder && !Threads.stop)
-		{
-			// ponder中は返してはいけない。
-			sleep(1);
-		}
+		wait_ponder_end();
 	}
 	else if (declarationWinMove != MOVE_NONE)
 	{
 		// 入玉宣言勝ち
 		bestMove = declarationWinMove;
-		while (Threads.ponder && !Threads.stop)
-		{
-			// ponder中は返してはいけない。
-			sleep(1);
-		}
+		wait_ponder_end();
 	}
 	else if (policy_only)
 	{
 		UCTNode *root = make_initial_nodes(rootPos);
 		bestMove = mcts->get_bestmove(root, rootPos, true);
-		while (Threads.ponder && !Threads.stop)
-		{
-			// ponder中は返してはいけない。
-			sleep(1);
-		}
+		wait_ponder_end();
 	}
 	else if (!rootPos.is_mated())
 	{
 		UCTNode *root = make_initial_nodes(rootPos);
+		start_pending_control();
 		update_pending_limit(root);
 		// slaveスレッドで探索を開始
 		root_mate_found = false;
+		if (root_mate_table)
+		{
+			root_mate_pv.clear();
+			root_mate_table->NewSearch();
+			root_mate_running = (int)root_mate_searchers.size();
+		}
+		start_search_trace(rootPos);
+		if (leaf_mate_workers)
+		{
+			leaf_mate_workers->begin_search(rootPos);
+		}
 		for (Thread *th : Threads)
 			if (th != this)
 				th->start_searching();
 
 		int lastPvTime = Time.elapsed();
-		int next_status_print_nodes = 0;
+		uint64_t next_status_print_nodes = 0;
 		// masterは探索終了タイミングの決定のみ行う
 		while (!Threads.stop)
 		{
+			// 以降の条件確認の後に通知された変化を取りこぼさないよう、先に世代を取得する
+			uint64_t event_gen = stop_event.generation();
+			control_pending_budget(root);
 			update_pending_limit(root);
+			sample_search_trace(root);
 
 			// 探索終了条件判定
 			if (!Threads.ponder)
 			{
 				// Ponder中は探索を止めない。
 				// Ponderが外れた時、Threads.ponder==trueのままThreads.stop==trueとなる
-				if (Time.elapsed() >= Time.optimum() || root->value_n_sum >= nodes_limit || root_mate_found || decide_early_stop(root))
+				// ルートの勝敗が確定したら、それ以上探索しても指し手は変わらない
+				if (Time.elapsed() >= Time.optimum() || root->value_n_sum >= nodes_limit || root_mate_found || root->terminal || decide_early_stop(root))
 				{
 					// 思考時間が来たら、新たな探索は停止する。
 					// ただし、評価途中のものの結果を受け取ってからbestmoveを決める。
 					// TODO: root->value_n_sum をロックすべき
-					Threads.stop = true;
+					request_stop();
 				}
 			}
 
@@ -544,17 +1591,37 @@ void MainThread::think()
 				// 置換表に最初からルートノードがあり、初回からroot_node.value_n_sumが大きい場合あり
 				// root_node.value_n_sumより大きい最小のprint_statusの倍数
 				print_search_status(root);
-				next_status_print_nodes = ((int)root->value_n_sum + print_status_interval) / print_status_interval * print_status_interval;
+				next_status_print_nodes = (root->value_n_sum + print_status_interval) / print_status_interval * print_status_interval;
 			}
 
-			sleep(10);
+			// 停止要求等の通知か、思考時間・PV表示時刻の到来まで待つ。
+			// 早期終了や探索状況表示の判定のため、最長でも10msごとに起きる。
+			if (!Threads.stop)
+			{
+				int wait_ms = std::min(10, lastPvTime + pv_interval - Time.elapsed());
+				if (!Threads.ponder)
+				{
+					wait_ms = std::min(wait_ms, Time.optimum() - Time.elapsed());
+				}
+				if (search_trace.is_open())
+				{
+					wait_ms = std::min(wait_ms, search_trace_next_ms - Time.elapsed());
+				}
+				stop_event.wait_for(event_gen, std::chrono::milliseconds(std::max(wait_ms, 0)));
+			}
 		}
 
 		// slaveスレッドが探索を終わるのを待つ
 		for (Thread *th : Threads)
 			if (th != this)
 				th->wait_for_search_finished();
-		root->pprint();
+		if (leaf_mate_workers)
+		{
+			// 詰み探索中のジョブがノードに書き込み終わるのを待つ(次の思考開始時のGCより前に完了させる)
+			leaf_mate_workers->end_search();
+		}
+		end_search_trace(root);
+		mcts->pprint(root);
 		display_stats();
 		vector<Move> pv = display_pv(root, rootPos);
 
@@ -577,11 +1644,7 @@ void MainThread::think()
 	else
 	{
 		// ponderする局面が詰んでいる場合、ここに到達
-		while (Threads.ponder && !Threads.stop)
-		{
-			// ponder中は返してはいけない。
-			sleep(1);
-		}
+		wait_ponder_end();
 	}
 
 	if (ponderMove != MOVE_RESIGN)
@@ -594,78 +1657,121 @@ void MainThread::think()
 	}
 }
 
-void root_mate_search(Position &rootPos)
+// ルート局面からの詰み探索。複数スレッドで置換表を共有して探索し、最初に詰みを確かめたスレッドが結果を報告する。
+void root_mate_search(Position &rootPos, int searcher_idx)
 {
-	root_mate_pv.clear();
-	if (root_mate_searcher->dfpn(rootPos, &root_mate_pv))
+	vector<Move> pv;
+	if (root_mate_searchers[searcher_idx]->dfpn(rootPos, &pv))
 	{
-		root_mate_found = true;
-		sync_cout << "info string root MATE FOUND!" << sync_endl;
-		sync_cout << "info depth " << root_mate_pv.size() << " score mate " << root_mate_pv.size() << " pv";
-		for (auto m : root_mate_pv)
+		std::lock_guard<std::mutex> lock(root_mate_mutex);
+		if (!root_mate_found)
 		{
-			cout << " " << m;
+			root_mate_pv = pv;
+			root_mate_found = true;
+			stop_event.notify_all();
+			sync_cout << "info string root MATE FOUND! (thread " << searcher_idx << ")" << sync_endl;
+			sync_cout << "info depth " << root_mate_pv.size() << " score mate " << root_mate_pv.size() << " pv";
+			for (auto m : root_mate_pv)
+			{
+				cout << " " << m;
+			}
+			cout << sync_endl;
 		}
-		cout << sync_endl;
 	}
-	else
+	if (--root_mate_running == 0 && !root_mate_found)
 	{
 		sync_cout << "info string NO root mate" << sync_endl;
 	}
 }
 
+// slaveスレッドを配置方針(ThreadAffinity)に従って固定する。各スレッドの最初の探索時に1回だけ行う。
+// masterは探索終了の判定のみで、ほとんど待機しているので固定しない。
+static void bind_search_thread(int thread_id)
+{
+	static thread_local bool bound = false;
+	if (bound)
+	{
+		return;
+	}
+	bound = true;
+	if (root_mate_first_thread_id >= 0 && thread_id >= root_mate_first_thread_id)
+	{
+		bind_thread_by_role(THREAD_ROLE_MATE, thread_id - root_mate_first_thread_id);
+	}
+	else
+	{
+		bind_thread_by_role(THREAD_ROLE_SEARCH, thread_id - 1);
+	}
+}
+
 // 探索本体。並列化している場合、ここがslaveのエントリーポイント。
 // MainThread::search()はvirtualになっていてthink()が呼び出されるので、MainThread::think()から
 // この関数を呼び出したいときは、Thread::search()とすること。
 void Thread::search()
 {
-	if (thread_id() == root_mate_thread_id)
+	bind_search_thread((int)thread_id());
+	if (root_mate_first_thread_id >= 0 && (int)thread_id() >= root_mate_first_thread_id)
 	{
-		return root_mate_search(rootPos);
+		return root_mate_search(rootPos, (int)thread_id() - root_mate_first_thread_id);
 	}
 	UCTNode *root = mcts->get_root(rootPos);
 	int n_put = 0, n_get = 0, leaf_dup = 0, leaf_mate_search_found = 0;
-	MTQueue<dnn_eval_obj *> *response_queue = response_queues[thread_id()];
-	MTQueue<dnn_eval_obj *> *request_queue = request_queues[thread_id() % request_queues.size()];
+	DnnEvalQueue *response_queue = response_queues[thread_id()];
+	DnnBatchBuffer *request_queue = request_queues[thread_id() % request_queues.size()];
+	DnnEvalObjPool *eval_obj_pool = eval_obj_pools[thread_id()];
 	bool block_until_all_get = false;
+	vector<dnn_eval_obj *> spare_eobjs; //探索に渡す未使用の評価用オブジェクト
 	while (!Threads.stop || (n_put != n_get))
 	{
-		if (root->value_n_sum >= nodes_safety_max)
-		{
-			sleep(1);
-		}
-
+		// 進められる探索がないときに待機するが、その判定後の通知を取りこぼさないよう先に世代を取得する
+		uint64_t event_gen = tree_event.generation();
 		bool enable_search = !Threads.stop && (n_put - n_get < pending_limit) && !block_until_all_get;
+		bool wait_response = !enable_search; //自分の評価結果が来るまでブロッキングするか
 		if (enable_search)
 		{
 			// 探索
-			MCTSSearchInfo sei(cvt, request_queue, response_queue, leaf_mate_searchers[thread_id()]);
-			dnn_eval_obj *eobj = new dnn_eval_obj();
-			mcts->search(root, rootPos, sei, eobj);
-			if (sei.put_dnn_eval)
+			// 評価待ち要素数の上限を超えない範囲で、複数の末端局面をまとめて選択する
+			int k = (int)std::min((size_t)search_batch_size, pending_limit - (n_put - n_get));
+			while ((int)spare_eobjs.size() < k)
 			{
-				n_put++;
-				if (sei.leaf_mate_search_found)
-				{
-					leaf_mate_search_found++;
-				}
+				spare_eobjs.push_back(eval_obj_pool->alloc());
 			}
-			else
+			MCTSSearchInfo sei(cvt, request_queue, response_queue, leaf_mate_searchers[thread_id()], dup_eval_pools[thread_id()], nullptr, leaf_mate_workers);
+			int n_batch_put = mcts->search_batch(root, rootPos, sei, spare_eobjs.data(), k);
+			thread_playouts[thread_id()].fetch_add(k, std::memory_order_relaxed);
+			// 評価に回したものは先頭に詰められており、結果を受け取った後にプールへ返却する
+			spare_eobjs.erase(spare_eobjs.begin(), spare_eobjs.begin() + n_batch_put);
+			n_put += n_batch_put;
+			leaf_mate_search_found += sei.n_leaf_mate_search_found;
+			if (sei.n_leaf_dup > 0)
+			{
+				// 評価待ち数の制御器が重複到達率を見るので、都度集計する
+				n_leaf_dup += sei.n_leaf_dup;
+			}
+			bool dup_wait = n_batch_put == 0 && sei.n_leaf_dup > 0 && (root->value_n_sum < limited_until);
+			if (dup_wait)
+			{
+				// すでに評価中の局面にばかり到達
+				// 木構造が狭い間に無理にたくさん評価しようとすると訪問回数が異常になるので
+				// ヒューリスティックに、木が更新されるまで待機
+				leaf_dup++;
+			}
+			if (root->terminal || root->value_n_sum >= nodes_limit)
+			{
+				// ルートの勝敗が確定したか探索ノード数の上限に達したので、masterに探索終了を判定させる
+				stop_event.notify_all();
+			}
+			if (dup_wait || (n_batch_put == 0 && root->terminal))
 			{
-				delete eobj;
-				if (sei.leaf_dup && (root->value_n_sum < limited_until))
+				if (n_put > n_get)
 				{
-					// すでに評価中の局面に到達
-					// 木構造が狭い間に無理にたくさん評価しようとすると訪問回数が異常になるので
-					// ヒューリスティックに、短い時間待機
-					// もっと洗練された方法が欲しい
-					leaf_dup++;
-					sleep(1);
-					//if (n_put > n_get)
-					//{
-					//	block_until_all_get = true;
-					//	enable_search = false;
-					//}
+					// 自分の評価結果で木が更新されるのを待つ
+					wait_response = true;
+				}
+				else
+				{
+					// 他スレッドの評価結果のbackupか停止要求を待つ(念のため最長1ms)
+					tree_event.wait_for(event_gen, std::chrono::milliseconds(1));
 				}
 			}
 		}
@@ -673,19 +1779,20 @@ void Thread::search()
 		if (n_put > n_get)
 		{
 			dnn_eval_obj *eobj = nullptr;
-			if (enable_search)
+			if (wait_response)
 			{
-				response_queue->pop_nb(eobj);
+				// 探索を停止している条件のため、結果が来るまでブロッキング
+				response_queue->pop(eobj);
 			}
 			else
 			{
-				// 探索を停止している条件のため、結果が来るまでブロッキング
-				response_queue->pop(eobj);
+				response_queue->pop_nb(eobj);
 			}
 			if (eobj)
 			{
 				mcts->backup_dnn(eobj);
-				delete eobj;
+				eval_obj_pool->recycle(eobj);
+				tree_event.notify_all();
 				n_get++;
 				if (n_put == n_get)
 				{
@@ -696,6 +1803,10 @@ void Thread::search()
 			}
 		}
 	}
+	for (auto eobj : spare_eobjs)
+	{
+		eval_obj_pool->recycle(eobj);
+	}
 	/*
 	sync_cout << "info string thread " << thread_id() << " n_put " << n_put
 		<< " leaf_dup " << leaf_dup << " leaf_mate_search_found " << leaf_mate_search_found << sync_endl;
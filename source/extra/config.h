@@ -200,6 +200,10 @@
 // USIプロトコルでgameoverコマンドが送られてきたときに gameover_handler()を呼び出す。
 // #define USE_GAMEOVER_HANDLER
 
+// USIプロトコルでstop,ponderhit等が送られ、Threads.stopかThreads.ponderを変更したときに search_event_handler()を呼び出す。
+// 条件変数で待機している探索スレッドを直ちに起こすために用いる。
+// #define USE_SEARCH_EVENT_HANDLER
+
 // EVAL_HASHで使用するメモリとして大きなメモリを確保するか。
 // これをONすると数%高速化する代わりに、メモリ使用量が1GBほど増える。
 // #define USE_LARGE_EVAL_HASH
@@ -436,6 +440,7 @@
 // Visual Studioのソリューションでpython moduleが指定されている場合
 #ifndef PYMODULE
 #define USER_ENGINE_MCTS
+#define USE_SEARCH_EVENT_HANDLER
 #endif
 // #define EVAL_KPPT // 比較実験用。評価値をKPPTのものに置き換える。
 #define USE_SEE
@@ -445,7 +450,7 @@
 #define USE_KEY_AFTER
 #define USE_MATE_1PLY
 #define USE_MCTS_MATE_ENGINE
-#define MAX_UCT_CHILDREN 16//UCTノードの子ノード数最大
+#define MAX_UCT_CHILDREN 16//UCTノードの子ノード数最大(MaxUCTChildrenオプションの既定値)
 #define MULTI_REQUEST_QUEUE//GPUスレッドごとに別のリクエストキューを持つ
 #endif
 
@@ -74,6 +74,11 @@ namespace Learner
 extern void gameover_handler(const string& cmd);
 #endif
 
+// "stop","ponderhit"等に対するハンドラ
+#ifdef USE_SEARCH_EVENT_HANDLER
+extern void search_event_handler();
+#endif
+
 // Option設定が格納されたglobal object。
 USI::OptionsMap Options;
 
@@ -916,11 +921,17 @@ void USI::loop(int argc, char* argv[])
 			// "go infinite" , "go ponder"などで思考を終えて寝てるかも知れないが、
 			// そいつらはThreads.stopを待っているので問題ない。
 			Threads.stop = true;
+#ifdef USE_SEARCH_EVENT_HANDLER
+			search_event_handler();
+#endif
 
 		} else if (token == "ponderhit")
 		{
 			Time.reset_for_ponderhit(); // ponderhitから計測しなおすべきである。
 			Threads.ponder = false; // 通常探索に切り替える。
+#ifdef USE_SEARCH_EVENT_HANDLER
+			search_event_handler();
+#endif
 		}
 
 		// 与えられた局面について思考するコマンド